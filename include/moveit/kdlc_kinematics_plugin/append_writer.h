@@ -0,0 +1,566 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Background thread that appends cache insertions to a binary journal in large batches
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_APPEND_WRITER_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_APPEND_WRITER_
+
+// ROS
+#include <ros/ros.h>
+
+// Boost
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/function.hpp>
+
+// C++
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Caching
+#include "cache_file.h"
+
+namespace simple_cache
+{
+
+/**
+ * @brief Fixed size queue that any number of threads can push to and pop from without locking. Based on
+ *        Dmitry Vyukov's bounded MPMC queue: every cell carries a sequence number telling whether it is ready
+ *        to be written or read for the current lap around the ring.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+
+  /**
+   * @param capacity rounded up to a power of two
+   */
+  BoundedQueue(std::size_t capacity)
+  {
+    std::size_t size = 2;
+    while( size < capacity )
+      size *= 2;
+    mask_ = size - 1;
+
+    cells_.reset(new Cell[size]);
+    for (std::size_t i = 0; i < size; ++i)
+      cells_[i].sequence.store(i, boost::memory_order_relaxed);
+
+    enqueue_pos_.store(0, boost::memory_order_relaxed);
+    dequeue_pos_.store(0, boost::memory_order_relaxed);
+  }
+
+  /**
+   * @return false if the queue is full
+   */
+  bool push(const T& data)
+  {
+    Cell* cell;
+    std::size_t pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    while( true )
+    {
+      cell = &cells_[pos & mask_];
+      const std::size_t sequence = cell->sequence.load(boost::memory_order_acquire);
+      const intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+      if( diff == 0 )
+      {
+        if( enqueue_pos_.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed) )
+          break;
+      }
+      else if( diff < 0 )
+        return false;
+      else
+        pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    }
+
+    cell->data = data;
+    cell->sequence.store(pos + 1, boost::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @return false if the queue is empty
+   */
+  bool pop(T& data)
+  {
+    Cell* cell;
+    std::size_t pos = dequeue_pos_.load(boost::memory_order_relaxed);
+    while( true )
+    {
+      cell = &cells_[pos & mask_];
+      const std::size_t sequence = cell->sequence.load(boost::memory_order_acquire);
+      const intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+      if( diff == 0 )
+      {
+        if( dequeue_pos_.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed) )
+          break;
+      }
+      else if( diff < 0 )
+        return false;
+      else
+        pos = dequeue_pos_.load(boost::memory_order_relaxed);
+    }
+
+    data = cell->data;
+    cell->sequence.store(pos + mask_ + 1, boost::memory_order_release);
+    return true;
+  }
+
+private:
+
+  struct Cell
+  {
+    boost::atomic<std::size_t> sequence;
+    T data;
+  };
+
+  boost::scoped_array<Cell> cells_;
+  std::size_t mask_;
+
+  // Kept on separate cache lines so producers and the consumer do not fight over one line
+  char pad0_[64];
+  boost::atomic<std::size_t> enqueue_pos_;
+  char pad1_[64];
+  boost::atomic<std::size_t> dequeue_pos_;
+  char pad2_[64];
+
+}; // end of class
+
+// When the journal is forced to disk
+enum fsync_policy_t {FSYNC_NEVER, FSYNC_EVERY_BATCH, FSYNC_INTERVAL};
+
+/**
+ * @brief Settings of the background journal writer
+ */
+struct AppendWriterOptions
+{
+  AppendWriterOptions() :
+    queue_size(1 << 16),
+    batch_size(4096),
+    flush_interval(1.0),
+    fsync_policy(FSYNC_NEVER),
+    fsync_interval(30.0),
+    compact_records(0)
+  {
+  }
+
+  std::size_t queue_size;      // records that can wait for the writer before new ones are dropped
+  std::size_t batch_size;      // records gathered into one write
+  double flush_interval;       // seconds before a partial batch is written anyway
+  fsync_policy_t fsync_policy;
+  double fsync_interval;       // seconds between syncs for FSYNC_INTERVAL
+
+  // Called from the writer thread once this many records were written since the last rotate(), 0 never calls
+  std::size_t compact_records;
+  boost::function<void ()> compact_callback;
+};
+
+/**
+ * @brief Appends journal records from a background thread. append() only pushes onto a lock free queue, so
+ *        inserting into the cache never waits for the disk. If the writer falls behind and the queue fills up,
+ *        records are dropped: the journal is a cache and losing an entry only costs a future solve.
+ */
+class AsyncAppendWriter
+{
+public:
+
+  AsyncAppendWriter() :
+    fd_(-1)
+  {
+    stop_.store(false);
+    num_written_.store(0);
+    num_dropped_.store(0);
+    num_since_rotate_.store(0);
+  }
+
+  ~AsyncAppendWriter()
+  {
+    close();
+  }
+
+  /**
+   * @brief Open a journal and start the writer thread. A new or empty file gets a header, an existing journal
+   *        must have been written with the same settings and is rewritten first if it has an older version.
+   * @param path location of the journal
+   * @param settings how keys and values are built
+   * @param options batching and durability
+   * @return false if the file could not be opened or belongs to a cache with other settings
+   */
+  bool open(const std::string& path, const CacheFileSettings& settings,
+            const AppendWriterOptions& options = AppendWriterOptions())
+  {
+    close();
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if( fd_ < 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Error opening file for appending: " << path);
+      return false;
+    }
+
+    struct stat file_stat;
+    if( fstat(fd_, &file_stat) != 0 )
+    {
+      ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+
+    CacheJournalHeader& header = header_;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = CACHE_JOURNAL_VERSION;
+    header.record_size = sizeof(CacheJournalRecord);
+    header.settings = settings;
+
+    bool valid;
+    if( file_stat.st_size == 0 )
+    {
+      valid = writeAll(fd_, &header, sizeof(header));
+    }
+    else
+    {
+      // Appending to a journal of another cache would corrupt it. The version is not compared, a journal of
+      // an older version is rewritten in the current one first
+      CacheJournalHeader existing;
+      valid = pread(fd_, &existing, sizeof(existing), 0) == ssize_t(sizeof(existing)) &&
+        memcmp(existing.magic, header.magic, sizeof(header.magic)) == 0 &&
+        existing.record_size != 0 && existing.record_size == getJournalRecordSize(existing.version) &&
+        memcmp(&existing.settings, &header.settings, sizeof(header.settings)) == 0;
+      if( !valid )
+        ROS_ERROR_STREAM_NAMED("cache","Not appending to " << path << ", it is not a journal of a cache with these settings");
+      else if( existing.version != header.version )
+        valid = upgrade(path, existing);
+    }
+
+    if( !valid )
+    {
+      if( fd_ >= 0 )
+        ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+
+    path_ = path;
+    options_ = options;
+    num_since_rotate_.store(0);
+    queue_.reset(new BoundedQueue<CacheJournalRecord>(options.queue_size));
+    stop_.store(false);
+    thread_.reset(new boost::thread(boost::bind(&AsyncAppendWriter::run, this)));
+    return true;
+  }
+
+  /**
+   * @brief Queue a record for writing, never blocks
+   * @return false if the queue was full and the record was dropped
+   */
+  bool append(const CacheJournalRecord& record)
+  {
+    if( !queue_->push(record) )
+    {
+      num_dropped_.fetch_add(1, boost::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Write out everything queued so far, sync according to the policy and stop the writer thread
+   */
+  void close()
+  {
+    if( thread_ )
+    {
+      stop_.store(true, boost::memory_order_release);
+      thread_->join();
+      thread_.reset();
+    }
+    if( fd_ >= 0 )
+    {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  bool isOpen() const
+  {
+    return fd_ >= 0;
+  }
+
+  /**
+   * @brief Move the journal to another path and continue in a new, empty journal. Records that are written
+   *        afterwards, including ones that were already queued, go to the new journal.
+   * @param rotated_path where the current journal is moved to
+   * @return false if the journal could not be moved or recreated, appending continues in the old file
+   */
+  bool rotate(const std::string& rotated_path)
+  {
+    boost::mutex::scoped_lock lock(file_mutex_);
+    if( fd_ < 0 )
+      return false;
+
+    if( options_.fsync_policy != FSYNC_NEVER )
+      fdatasync(fd_);
+
+    if( rename(path_.c_str(), rotated_path.c_str()) != 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Unable to rotate journal " << path_ << ": " << strerror(errno));
+      return false;
+    }
+
+    const int fd = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if( fd < 0 || !writeAll(fd, &header_, sizeof(header_)) )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Unable to start a new journal " << path_ << ", moving the old one back");
+      if( fd >= 0 )
+        ::close(fd);
+      rename(rotated_path.c_str(), path_.c_str());
+      return false;
+    }
+
+    ::close(fd_);
+    fd_ = fd;
+    num_since_rotate_.store(0, boost::memory_order_relaxed);
+    return true;
+  }
+
+  std::size_t getNumWritten() const
+  {
+    return num_written_.load(boost::memory_order_relaxed);
+  }
+
+  std::size_t getNumDropped() const
+  {
+    return num_dropped_.load(boost::memory_order_relaxed);
+  }
+
+private:
+
+  // Not copyable, the thread and file are owned
+  AsyncAppendWriter(const AsyncAppendWriter&);
+  AsyncAppendWriter& operator=(const AsyncAppendWriter&);
+
+  /**
+   * @brief Writer thread: gather records into batches and write each batch with one system call
+   */
+  void run()
+  {
+    std::vector<CacheJournalRecord> batch;
+    batch.reserve(options_.batch_size);
+
+    ros::WallTime last_flush = ros::WallTime::now();
+    ros::WallTime last_sync = last_flush;
+    bool unsynced = false;
+
+    // Idle polling period, short enough to keep the queue from filling up
+    const double idle_sleep = std::min(0.01, options_.flush_interval);
+
+    while( true )
+    {
+      const bool stopping = stop_.load(boost::memory_order_acquire);
+
+      CacheJournalRecord record;
+      while( batch.size() < options_.batch_size && queue_->pop(record) )
+        batch.push_back(record);
+      const bool batch_full = batch.size() >= options_.batch_size;
+
+      ros::WallTime now = ros::WallTime::now();
+      if( !batch.empty() && (batch_full || stopping || (now - last_flush).toSec() >= options_.flush_interval) )
+      {
+        {
+          boost::mutex::scoped_lock lock(file_mutex_);
+          if( writeAll(fd_, &batch[0], batch.size() * sizeof(CacheJournalRecord)) )
+          {
+            num_written_.fetch_add(batch.size(), boost::memory_order_relaxed);
+            num_since_rotate_.fetch_add(batch.size(), boost::memory_order_relaxed);
+          }
+
+          if( options_.fsync_policy == FSYNC_EVERY_BATCH )
+            fdatasync(fd_);
+        }
+        batch.clear();
+        last_flush = now;
+        unsynced = options_.fsync_policy != FSYNC_EVERY_BATCH;
+
+        // Compacting blocks this thread, the queue absorbs insertions in the meantime
+        if( !stopping && options_.compact_records > 0 && !options_.compact_callback.empty() &&
+            num_since_rotate_.load(boost::memory_order_relaxed) >= options_.compact_records )
+        {
+          options_.compact_callback();
+          num_since_rotate_.store(0, boost::memory_order_relaxed); // also when compacting failed, retry later
+        }
+      }
+
+      if( unsynced && options_.fsync_policy == FSYNC_INTERVAL &&
+          (now - last_sync).toSec() >= options_.fsync_interval )
+      {
+        boost::mutex::scoped_lock lock(file_mutex_);
+        fdatasync(fd_);
+        last_sync = now;
+        unsynced = false;
+      }
+
+      if( stopping && !batch_full )
+        break; // queue is drained
+
+      if( !batch_full )
+        boost::this_thread::sleep(boost::posix_time::microseconds(long(idle_sleep * 1e6)));
+    }
+
+    if( unsynced && options_.fsync_policy != FSYNC_NEVER )
+    {
+      boost::mutex::scoped_lock lock(file_mutex_);
+      fdatasync(fd_);
+    }
+  }
+
+  /**
+   * @brief Rewrite the journal opened in fd_ in the current version, a torn record at its end is dropped.
+   *        The new journal is written next to the old one and renamed over it, so a crash leaves either
+   *        one complete.
+   * @param path location of the journal
+   * @param existing header of the journal
+   * @return false if the journal could not be rewritten, fd_ is closed then
+   */
+  bool upgrade(const std::string& path, const CacheJournalHeader& existing)
+  {
+    ROS_INFO_STREAM_NAMED("cache","Upgrading journal " << path << " from version " << existing.version
+                          << " to " << header_.version);
+
+    const std::string upgrade_path = path + ".upgrade";
+    const int fd = ::open(upgrade_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool valid = fd >= 0 && writeAll(fd, &header_, sizeof(header_));
+
+    // Records of older versions are a prefix of the current record, the rest is left at its defaults
+    const std::size_t record_size = existing.record_size;
+    std::vector<char> buffer(4096 * record_size);
+    std::vector<CacheJournalRecord> records;
+    records.reserve(4096);
+    off_t offset = sizeof(existing);
+    while( valid )
+    {
+      const ssize_t num_read = pread(fd_, &buffer[0], buffer.size(), offset);
+      if( num_read < 0 && errno == EINTR )
+        continue;
+      if( num_read < ssize_t(record_size) )
+      {
+        valid = num_read >= 0;
+        break;
+      }
+      const std::size_t num_records = std::size_t(num_read) / record_size;
+      records.assign(num_records, CacheJournalRecord());
+      for( std::size_t i = 0; i < num_records; ++i )
+        memcpy(&records[i], &buffer[i * record_size], record_size);
+      valid = writeAll(fd, &records[0], num_records * sizeof(CacheJournalRecord));
+      offset += num_records * record_size;
+    }
+
+    if( fd >= 0 )
+    {
+      valid = valid && fsync(fd) == 0;
+      ::close(fd);
+    }
+    ::close(fd_);
+    fd_ = -1;
+
+    if( !valid || rename(upgrade_path.c_str(), path.c_str()) != 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Unable to upgrade journal " << path << ": " << strerror(errno));
+      unlink(upgrade_path.c_str());
+      return false;
+    }
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_APPEND);
+    if( fd_ < 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Error opening file for appending: " << path);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Write a buffer completely, retrying partial writes
+   */
+  static bool writeAll(int fd, const void* data, std::size_t size)
+  {
+    const char* bytes = static_cast<const char*>(data);
+    while( size > 0 )
+    {
+      const ssize_t written = ::write(fd, bytes, size);
+      if( written < 0 )
+      {
+        if( errno == EINTR )
+          continue;
+        ROS_ERROR_STREAM_NAMED("cache","Error appending to cache journal: " << strerror(errno));
+        return false;
+      }
+      bytes += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  int fd_;
+  std::string path_;
+  CacheJournalHeader header_;
+  boost::mutex file_mutex_; // held while writing, so rotate() can swap fd_ from another thread
+  AppendWriterOptions options_;
+  boost::scoped_ptr<BoundedQueue<CacheJournalRecord> > queue_;
+  boost::scoped_ptr<boost::thread> thread_;
+  boost::atomic<bool> stop_;
+
+  // Stats
+  boost::atomic<std::size_t> num_written_;
+  boost::atomic<std::size_t> num_dropped_;
+  boost::atomic<std::size_t> num_since_rotate_;
+
+}; // end of class
+
+} // namespace
+
+#endif
@@ -0,0 +1,282 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Forward kinematics of a chain for many configurations at once, several per SIMD register
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_BATCH_FK_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_BATCH_FK_
+
+// KDL
+#include <kdl/chain.hpp>
+#include <kdl/frames.hpp>
+
+// Eigen
+#include <Eigen/Core>
+
+// Boost
+#include <boost/shared_ptr.hpp>
+
+// C++
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <math.h>
+
+namespace kdlc_kinematics_plugin
+{
+
+/**
+ * @brief Tip poses of a chain for batches of joint configurations.
+ *
+ * The chain is reduced at construction to one record per moving joint: the joint axis and the constant frame up
+ * to the next joint, with every fixed segment folded into it. Configurations are evaluated LANES at a time. Every
+ * matrix element of the running transform is an Eigen array holding that element for LANES configurations, so
+ * each multiply-add of the frame products works on all of them in one instruction. Joint values are read in
+ * structure of arrays layout, joint j of configuration c at joints[j * stride + c], which loads straight into
+ * the lanes.
+ *
+ * Revolute joints are modelled as KDL::Joint::pose() builds them, a rotation about the axis placed at the joint
+ * origin, prismatic joints as a translation along an axis. The constructor compares this model against KDL::Segment::pose() and marks the kernel invalid if
+ * any joint does not match, e.g. joints with a scale or offset. Callers then use the scalar KDL solver instead.
+ * The object is immutable after construction, so threads can share it.
+ */
+class BatchFK
+{
+public:
+
+  static const int LANES = 4;
+
+  explicit BatchFK(const KDL::Chain& chain) :
+    valid_(true)
+  {
+    for (unsigned int s = 0; s < chain.getNrOfSegments(); ++s)
+    {
+      const KDL::Segment& segment = chain.getSegment(s);
+      const KDL::Joint& joint = segment.getJoint();
+      // Segment pose at q = 0 with the joint motion at q = 0 taken out
+      const KDL::Frame tip = joint.pose(0.0).Inverse() * segment.pose(0.0);
+
+      if( joint.getType() == KDL::Joint::None )
+      {
+        // Fold into the frame of the previous joint, or into the base before the first joint
+        if( joints_.empty() )
+          base_ = base_ * tip;
+        else
+          joints_.back().tip = joints_.back().tip * tip;
+        continue;
+      }
+
+      JointModel model;
+      model.axis = joint.JointAxis();
+      model.tip = tip;
+      switch( joint.getType() )
+      {
+        case KDL::Joint::TransAxis:
+        case KDL::Joint::TransX:
+        case KDL::Joint::TransY:
+        case KDL::Joint::TransZ:
+          model.revolute = false;
+          model.origin = joint.pose(0.0).p;
+          break;
+        default:
+          model.revolute = true;
+          model.origin = joint.JointOrigin();
+          break;
+      }
+
+      // The model has to reproduce KDL, otherwise fall back to the scalar solver
+      static const double TEST_VALUES[] = {-1.3, 0.4, 2.9};
+      for (std::size_t i = 0; i < sizeof(TEST_VALUES) / sizeof(double); ++i)
+      {
+        if( !KDL::Equal(getSegmentPose(model, TEST_VALUES[i]), segment.pose(TEST_VALUES[i]), 1e-9) )
+          valid_ = false;
+      }
+
+      joints_.push_back(model);
+    }
+  }
+
+  /**
+   * @brief False if the chain has joints the kernel does not model, computeTipFrames() must not be used then
+   */
+  bool isValid() const
+  {
+    return valid_;
+  }
+
+  unsigned int getNumJoints() const
+  {
+    return joints_.size();
+  }
+
+  /**
+   * @brief Tip frames of num_configs configurations
+   * @param joints joint values, joint j of configuration c at joints[j * stride + c]
+   * @param stride distance between the values of consecutive joints, at least num_configs
+   * @param num_configs number of configurations
+   * @param frames output, num_configs frames
+   */
+  void computeTipFrames(const double* joints, std::size_t stride, std::size_t num_configs,
+                        KDL::Frame* frames) const
+  {
+    for (std::size_t first = 0; first < num_configs; first += LANES)
+      computeGroup<LANES>(joints, stride, first, std::min<std::size_t>(LANES, num_configs - first), frames);
+  }
+
+  /**
+   * @brief Tip frames of num_configs configurations stored back to back in one vector
+   */
+  void computeTipFrames(const std::vector<double>& joints, std::size_t num_configs,
+                        std::vector<KDL::Frame>& frames) const
+  {
+    frames.resize(num_configs);
+    if( num_configs > 0 )
+      computeTipFrames(&joints[0], num_configs, num_configs, &frames[0]);
+  }
+
+private:
+
+  struct JointModel
+  {
+    bool revolute;
+    KDL::Vector axis; // unit axis in the frame of the previous joint
+    KDL::Vector origin; // position of a revolute joint, offset of a prismatic joint
+    KDL::Frame tip; // from the joint to the next joint, fixed segments included
+  };
+
+  /**
+   * @brief Scalar version of the model, only used to check it against KDL
+   */
+  static KDL::Frame getSegmentPose(const JointModel& model, double q)
+  {
+    if( !model.revolute )
+      return KDL::Frame(model.origin + model.axis * q) * model.tip;
+
+    return KDL::Frame(KDL::Rotation::Rot2(model.axis, q), model.origin) * model.tip;
+  }
+
+  /**
+   * @brief Up to N configurations starting at first, missing lanes repeat the last configuration
+   */
+  template <int N>
+  void computeGroup(const double* joints, std::size_t stride, std::size_t first, std::size_t count,
+                    KDL::Frame* frames) const
+  {
+    typedef Eigen::Array<double, N, 1> Lane;
+
+    // Running transform, rotation row major
+    Lane M[9], p[3];
+    for (int i = 0; i < 3; ++i)
+    {
+      for (int k = 0; k < 3; ++k)
+        M[i * 3 + k].setConstant(base_.M(i, k));
+      p[i].setConstant(base_.p(i));
+    }
+
+    Lane q, R[9], jp[3], tmp[9];
+    for (std::size_t j = 0; j < joints_.size(); ++j)
+    {
+      const JointModel& model = joints_[j];
+      const double* values = joints + j * stride + first;
+      for (int l = 0; l < N; ++l)
+        q(l) = values[std::min<std::size_t>(l, count - 1)];
+
+      const double ax = model.axis(0), ay = model.axis(1), az = model.axis(2);
+      const double ox = model.origin(0), oy = model.origin(1), oz = model.origin(2);
+      if( model.revolute )
+      {
+        // Rodrigues: R = c I + s [a]x + (1 - c) a a^T
+        const Lane c = q.cos();
+        const Lane s = q.sin();
+        const Lane t = 1.0 - c;
+        R[0] = c + t * (ax * ax);      R[1] = t * (ax * ay) - s * az; R[2] = t * (ax * az) + s * ay;
+        R[3] = t * (ax * ay) + s * az; R[4] = c + t * (ay * ay);      R[5] = t * (ay * az) - s * ax;
+        R[6] = t * (ax * az) - s * ay; R[7] = t * (ay * az) + s * ax; R[8] = c + t * (az * az);
+
+        // T = T * joint, the joint frame sits at the origin whatever the angle
+        for (int i = 0; i < 3; ++i)
+        {
+          p[i] += M[i * 3] * ox + M[i * 3 + 1] * oy + M[i * 3 + 2] * oz;
+          for (int k = 0; k < 3; ++k)
+            tmp[i * 3 + k] = M[i * 3] * R[k] + M[i * 3 + 1] * R[3 + k] + M[i * 3 + 2] * R[6 + k];
+        }
+        for (int i = 0; i < 9; ++i)
+          M[i] = tmp[i];
+      }
+      else
+      {
+        jp[0] = ox + ax * q;
+        jp[1] = oy + ay * q;
+        jp[2] = oz + az * q;
+        for (int i = 0; i < 3; ++i)
+          p[i] += M[i * 3] * jp[0] + M[i * 3 + 1] * jp[1] + M[i * 3 + 2] * jp[2];
+      }
+
+      // T = T * tip, the tip is the same for all lanes
+      const KDL::Frame& tip = model.tip;
+      for (int i = 0; i < 3; ++i)
+      {
+        p[i] += M[i * 3] * tip.p(0) + M[i * 3 + 1] * tip.p(1) + M[i * 3 + 2] * tip.p(2);
+        for (int k = 0; k < 3; ++k)
+          tmp[i * 3 + k] = M[i * 3] * tip.M(0, k) + M[i * 3 + 1] * tip.M(1, k) + M[i * 3 + 2] * tip.M(2, k);
+      }
+      for (int i = 0; i < 9; ++i)
+        M[i] = tmp[i];
+    }
+
+    for (std::size_t l = 0; l < count; ++l)
+    {
+      KDL::Frame& frame = frames[first + l];
+      for (int i = 0; i < 3; ++i)
+      {
+        for (int k = 0; k < 3; ++k)
+          frame.M(i, k) = M[i * 3 + k](l);
+        frame.p(i) = p[i](l);
+      }
+    }
+  }
+
+  bool valid_;
+  KDL::Frame base_; // fixed segments before the first joint
+  std::vector<JointModel> joints_;
+
+}; // end of class
+
+typedef boost::shared_ptr<const BatchFK> BatchFKConstPtr;
+
+} // namespace
+
+#endif
@@ -0,0 +1,143 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Value stored for each pose key of the cache
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_ENTRY_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_ENTRY_
+
+// C++
+#include <climits>
+#include <cstddef>
+#include <stdint.h>
+
+namespace simple_cache
+{
+
+/**
+ * @brief What is known about the failed searches for a pose without any solution
+ */
+struct CacheFailures
+{
+  int64_t marker;        // LLONG_MAX, shares memory with the first solution
+  double timeout;        // longest timeout a search failed under in seconds
+  double expiry;         // wall time in seconds after which the pose is searched again, 0 for never
+  uint32_t num_failures;
+  uint32_t reserved;
+};
+
+/**
+ * @brief All solutions stored under one pose key. A pose without any solution is stored as a single
+ *        LLONG_MAX value. Must stay plain old data because binary cache files are mapped straight into memory.
+ */
+struct CacheEntry
+{
+  static const std::size_t MAX_SOLUTIONS = 4;
+
+  // A NOSOLUTION entry keeps its failures in the solution slots it does not use. Entries of files written
+  // before failures were tracked have them all zero.
+  union
+  {
+    int64_t solutions[MAX_SOLUTIONS];
+    CacheFailures failures;
+  };
+  uint8_t num_solutions;
+
+  // CLOCK reference bit, set on every hit and cleared as the eviction hand passes. Lives in what used to be
+  // padding, so the file layout is unchanged.
+  mutable uint8_t referenced;
+
+  // Quality score of each solution, higher is better and 0 is unscored, e.g. entries of files written before
+  // scores existed. Also lives in former padding.
+  uint8_t qualities[MAX_SOLUTIONS];
+
+  bool isNoSolution() const
+  {
+    return num_solutions == 1 && solutions[0] == LLONG_MAX;
+  }
+
+  /**
+   * @brief Whether a NOSOLUTION entry still answers a request without searching
+   * @param timeout of the request. A request with more time than every failed search gets to try.
+   * @param now wall time in seconds
+   */
+  bool rejects(double timeout, double now) const
+  {
+    return timeout <= failures.timeout && (failures.expiry == 0 || now < failures.expiry);
+  }
+
+  /**
+   * @brief Mark as recently used. Lookups only hold a shared lock so the flag is written atomically, and only
+   *        when it is not set yet to keep the cache line clean for other readers.
+   */
+  void touch() const
+  {
+    if( !__atomic_load_n(&referenced, __ATOMIC_RELAXED) )
+      __atomic_store_n(&referenced, 1, __ATOMIC_RELAXED);
+  }
+
+  bool contains(int64_t value) const
+  {
+    return find(value) < num_solutions;
+  }
+
+  /**
+   * @brief Index of a solution, num_solutions if it is not stored
+   */
+  std::size_t find(int64_t value) const
+  {
+    std::size_t i = 0;
+    while( i < num_solutions && solutions[i] != value )
+      ++i;
+    return i;
+  }
+
+  /**
+   * @brief Index of the solution with the lowest quality score
+   */
+  std::size_t findWorst() const
+  {
+    std::size_t worst = 0;
+    for (std::size_t i = 1; i < num_solutions; ++i)
+      if( qualities[i] < qualities[worst] )
+        worst = i;
+    return worst;
+  }
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,401 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Versioned binary cache file that is memory mapped and probed in place
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_FILE_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_FILE_
+
+// ROS
+#include <ros/ros.h>
+
+// C++
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstddef>
+#include <stdint.h>
+
+// POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Caching
+#include "cache_entry.h"
+#include "flat_hash_map.h"
+
+namespace simple_cache
+{
+
+typedef FlatHashMap<CacheEntry> CacheTable;
+typedef CacheTable::Slot CacheSlot;
+
+static const char CACHE_FILE_MAGIC[8] = {'K','D','L','C','A','C','H','E'};
+
+// Increment whenever CacheFileHeader or CacheEntry change layout
+static const uint32_t CACHE_FILE_VERSION = 1;
+
+static const std::size_t CACHE_FILE_MAX_DIMENSIONS = 16;
+
+static const char CACHE_JOURNAL_MAGIC[8] = {'K','D','L','C','J','R','N','L'};
+
+// Increment whenever CacheJournalHeader or CacheJournalRecord change layout
+static const uint32_t CACHE_JOURNAL_VERSION = 3;
+
+/**
+ * @brief Range and bits of every value packed into a key, zero when unused
+ */
+struct CacheFileKeyLayout
+{
+  uint32_t num_dims;
+  uint32_t bits[CACHE_FILE_MAX_DIMENSIONS];
+  double low[CACHE_FILE_MAX_DIMENSIONS];
+  double high[CACHE_FILE_MAX_DIMENSIONS];
+};
+
+/**
+ * @brief Everything that decides how keys and values were built. A file can only be used by a cache with
+ *        identical settings.
+ */
+struct CacheFileSettings
+{
+  uint32_t num_joints;
+  uint32_t encoding;     // encoding_t
+  uint32_t pose_keying;  // pose_keying_t
+  uint32_t reserved;
+  double joint_hi;
+  double joint_low;
+  double pose_hi;
+  double pose_low;
+  CacheFileKeyLayout pose_layout;
+  CacheFileKeyLayout joint_layout;
+};
+
+/**
+ * @brief Start of a binary cache file. It is followed at records_offset by capacity CacheSlots, laid out as
+ *        the slot array of a CacheTable so that lookups probe the file directly. Values are in host byte order.
+ */
+struct CacheFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t slot_size;
+  uint64_t records_offset;
+  uint64_t num_entries;
+  uint64_t capacity;
+  CacheFileSettings settings;
+};
+
+/**
+ * @brief Start of an append only journal of insertions, followed by CacheJournalRecords until the end of file
+ */
+struct CacheJournalHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  CacheFileSettings settings;
+};
+
+/**
+ * @brief One solution or failed search added to the cache. Only fields are appended across versions, so a record
+ *        of an older journal is a prefix of this one.
+ */
+struct CacheJournalRecord
+{
+  int64_t key;
+  int64_t value;    // LLONG_MAX for a failed search
+  uint8_t quality;  // since version 2
+  uint8_t reserved[3];
+  float timeout;    // of a failed search in seconds, since version 3
+  double time;      // wall time of a failed search in seconds, since version 3
+};
+
+/**
+ * @brief Size of the records of a journal version, 0 if the version is unknown. Fields missing from older
+ *        records read as zero.
+ */
+inline std::size_t getJournalRecordSize(uint32_t version)
+{
+  switch( version )
+  {
+    case 1: return offsetof(CacheJournalRecord, quality);
+    case 2: return offsetof(CacheJournalRecord, time);
+    case CACHE_JOURNAL_VERSION: return sizeof(CacheJournalRecord);
+  }
+  return 0;
+}
+
+/**
+ * @brief Check the first bytes of a file for a magic number
+ */
+inline bool hasFileMagic(const std::string& path, const char magic[8])
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if( !file )
+    return false;
+
+  char file_magic[8];
+  const bool matches = fread(file_magic, 1, sizeof(file_magic), file) == sizeof(file_magic) &&
+    memcmp(file_magic, magic, sizeof(file_magic)) == 0;
+  fclose(file);
+  return matches;
+}
+
+/**
+ * @brief Check the first bytes of a file for the binary cache magic
+ */
+inline bool isBinaryCacheFile(const std::string& path)
+{
+  return hasFileMagic(path, CACHE_FILE_MAGIC);
+}
+
+/**
+ * @brief Check the first bytes of a file for the journal magic
+ */
+inline bool isCacheJournal(const std::string& path)
+{
+  return hasFileMagic(path, CACHE_JOURNAL_MAGIC);
+}
+
+/**
+ * @brief Where a journal is moved while the cache is compacted into a snapshot. If the process dies before the
+ *        snapshot is written, this file still holds the insertions and must be replayed before the journal.
+ */
+inline std::string getRotatedJournalPath(const std::string& journal_path)
+{
+  return journal_path + ".old";
+}
+
+/**
+ * @brief Write a header and slot array as a binary cache file. Writes to a temporary file first and renames it,
+ *        so a process that has the old file mapped is not affected.
+ * @param settings how the keys were built
+ * @param table the hash table to write
+ * @return true on success
+ */
+inline bool writeCacheFile(const std::string& path, const CacheFileSettings& settings, const CacheTable& table)
+{
+  CacheFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+  header.version = CACHE_FILE_VERSION;
+  header.slot_size = sizeof(CacheSlot);
+  header.records_offset = (sizeof(CacheFileHeader) + 63) / 64 * 64; // cache line aligned records
+  header.num_entries = table.size();
+  header.capacity = table.capacity();
+  header.settings = settings;
+
+  const std::string temp_path = path + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if( !file )
+  {
+    ROS_ERROR_STREAM_NAMED("cache","Error opening " << temp_path << " for writing");
+    return false;
+  }
+
+  char padding[64];
+  memset(padding, 0, sizeof(padding));
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    fwrite(padding, 1, header.records_offset - sizeof(header), file) == header.records_offset - sizeof(header);
+  if( ok && table.capacity() > 0 )
+    ok = fwrite(table.data(), sizeof(CacheSlot), table.capacity(), file) == table.capacity();
+  ok = (fclose(file) == 0) && ok;
+
+  if( !ok || rename(temp_path.c_str(), path.c_str()) != 0 )
+  {
+    ROS_ERROR_STREAM_NAMED("cache","Error writing binary cache file " << path);
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Read only memory mapping of a binary cache file
+ */
+class MappedCacheFile
+{
+public:
+
+  MappedCacheFile() :
+    data_(NULL),
+    length_(0),
+    header_(NULL),
+    slots_(NULL)
+  {
+  }
+
+  ~MappedCacheFile()
+  {
+    close();
+  }
+
+  /**
+   * @brief Map a binary cache file and check its header
+   * @param path location of file
+   * @return false if the file could not be mapped or is not a valid cache file of this version
+   */
+  bool open(const std::string& path)
+  {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if( fd < 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Error opening " << path);
+      return false;
+    }
+
+    struct stat file_stat;
+    if( fstat(fd, &file_stat) != 0 || std::size_t(file_stat.st_size) < sizeof(CacheFileHeader) )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Binary cache file is too short: " << path);
+      ::close(fd);
+      return false;
+    }
+
+    void* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the file alive
+    if( data == MAP_FAILED )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Error mapping " << path);
+      return false;
+    }
+    data_ = data;
+    length_ = file_stat.st_size;
+    header_ = static_cast<const CacheFileHeader*>(data_);
+
+    if( memcmp(header_->magic, CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC)) != 0 ||
+        header_->version != CACHE_FILE_VERSION || header_->slot_size != sizeof(CacheSlot) )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Binary cache file " << path << " has version " << header_->version
+                             << ", expected " << CACHE_FILE_VERSION);
+      close();
+      return false;
+    }
+
+    // Capacity must be a power of two for the probing mask, and all slots must be inside the file
+    const uint64_t capacity = header_->capacity;
+    const bool too_full = capacity == 0 ? header_->num_entries != 0 : header_->num_entries >= capacity;
+    if( (capacity & (capacity - 1)) != 0 || too_full ||
+        header_->records_offset + capacity * sizeof(CacheSlot) > length_ )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Binary cache file " << path << " is corrupt");
+      close();
+      return false;
+    }
+    slots_ = reinterpret_cast<const CacheSlot*>(static_cast<const char*>(data_) + header_->records_offset);
+
+    // Lookups jump around the file, read ahead would only pull in unrelated pages
+    madvise(data_, length_, MADV_RANDOM);
+    return true;
+  }
+
+  void close()
+  {
+    if( data_ )
+      munmap(data_, length_);
+    data_ = NULL;
+    length_ = 0;
+    header_ = NULL;
+    slots_ = NULL;
+  }
+
+  bool isOpen() const
+  {
+    return data_ != NULL;
+  }
+
+  const CacheFileHeader& getHeader() const
+  {
+    return *header_;
+  }
+
+  /**
+   * @brief Find the entry of a key in the mapped records
+   * @return NULL if not found or if no file is mapped
+   */
+  const CacheEntry* find(int64_t key) const
+  {
+    if( !slots_ )
+      return NULL;
+    return CacheTable::findInSlots(slots_, header_->capacity, key);
+  }
+
+  std::size_t size() const
+  {
+    return header_ ? header_->num_entries : 0;
+  }
+
+  /**
+   * @brief Length of the mapping. The pages are shared with the page cache, not owned by this process.
+   */
+  std::size_t getMappedBytes() const
+  {
+    return length_;
+  }
+
+  CacheTable::const_iterator begin() const
+  {
+    return CacheTable::const_iterator(slots_, slots_ + (header_ ? header_->capacity : 0));
+  }
+
+  CacheTable::const_iterator end() const
+  {
+    const CacheSlot* last = slots_ + (header_ ? header_->capacity : 0);
+    return CacheTable::const_iterator(last, last);
+  }
+
+private:
+
+  // Not copyable, the mapping is owned
+  MappedCacheFile(const MappedCacheFile&);
+  MappedCacheFile& operator=(const MappedCacheFile&);
+
+  void* data_;
+  std::size_t length_;
+  const CacheFileHeader* header_;
+  const CacheSlot* slots_;
+
+}; // end of class
+
+} // namespace
+
+#endif
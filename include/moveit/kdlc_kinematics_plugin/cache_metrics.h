@@ -0,0 +1,331 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Counters and histograms of cache and IK performance that can be read while the planner runs
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_METRICS_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_METRICS_
+
+// Boost
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+
+// C++
+#include <algorithm>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+namespace simple_cache
+{
+
+/**
+ * @brief Write a string as a JSON string literal
+ */
+inline void writeJsonString(std::ostream& stream, const std::string& value)
+{
+  stream << '"';
+  for (std::size_t i = 0; i < value.size(); ++i)
+  {
+    const char c = value[i];
+    if( c == '"' || c == '\\' )
+      stream << '\\' << c;
+    else if( static_cast<unsigned char>(c) < 0x20 )
+      stream << ' ';
+    else
+      stream << c;
+  }
+  stream << '"';
+}
+
+/**
+ * @brief Histogram of non negative integers with power of two buckets. Bucket 0 counts zeros and bucket i
+ *        counts values in [2^(i-1), 2^i). Recording is lock free so it can be done from any thread.
+ */
+class Log2Histogram
+{
+public:
+
+  static const std::size_t NUM_BUCKETS = 40;
+
+  Log2Histogram()
+  {
+    reset();
+  }
+
+  void record(uint64_t value)
+  {
+    std::size_t bucket = 0;
+    while( bucket < NUM_BUCKETS - 1 && (value >> bucket) != 0 )
+      ++bucket;
+
+    buckets_[bucket].fetch_add(1, boost::memory_order_relaxed);
+    count_.fetch_add(1, boost::memory_order_relaxed);
+    total_.fetch_add(value, boost::memory_order_relaxed);
+
+    uint64_t max = max_.load(boost::memory_order_relaxed);
+    while( value > max && !max_.compare_exchange_weak(max, value, boost::memory_order_relaxed) )
+    {
+    }
+  }
+
+  uint64_t getCount() const
+  {
+    return count_.load(boost::memory_order_relaxed);
+  }
+
+  uint64_t getBucket(std::size_t bucket) const
+  {
+    return buckets_[bucket].load(boost::memory_order_relaxed);
+  }
+
+  double getMean() const
+  {
+    const uint64_t count = getCount();
+    return count ? double(total_.load(boost::memory_order_relaxed)) / count : 0.0;
+  }
+
+  uint64_t getMax() const
+  {
+    return max_.load(boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Upper bound of the bucket that holds the given fraction of the values, never more than the maximum
+   * @param fraction between 0 and 1, e.g. 0.99
+   */
+  uint64_t getPercentile(double fraction) const
+  {
+    const uint64_t count = getCount();
+    if( count == 0 )
+      return 0;
+
+    const uint64_t target = uint64_t(fraction * count + 0.5);
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i)
+    {
+      seen += getBucket(i);
+      if( seen >= target && seen > 0 )
+        return std::min(i == 0 ? uint64_t(0) : (uint64_t(1) << i) - 1, getMax());
+    }
+    return getMax();
+  }
+
+  void reset()
+  {
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i)
+      buckets_[i].store(0, boost::memory_order_relaxed);
+    count_.store(0, boost::memory_order_relaxed);
+    total_.store(0, boost::memory_order_relaxed);
+    max_.store(0, boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Write as a JSON object with summary values and the non empty buckets keyed by their upper bound
+   */
+  void writeJson(std::ostream& stream) const
+  {
+    stream << "{\"count\": " << getCount() << ", \"mean\": " << getMean() << ", \"p50\": " << getPercentile(0.5)
+           << ", \"p90\": " << getPercentile(0.9) << ", \"p99\": " << getPercentile(0.99) << ", \"max\": "
+           << getMax() << ", \"buckets\": {";
+    bool first = true;
+    for (std::size_t i = 0; i < NUM_BUCKETS; ++i)
+    {
+      const uint64_t count = getBucket(i);
+      if( !count )
+        continue;
+      stream << (first ? "" : ", ") << "\"" << (i == 0 ? uint64_t(0) : (uint64_t(1) << i) - 1) << "\": " << count;
+      first = false;
+    }
+    stream << "}}";
+  }
+
+private:
+
+  boost::atomic<uint64_t> buckets_[NUM_BUCKETS];
+  boost::atomic<uint64_t> count_;
+  boost::atomic<uint64_t> total_;
+  boost::atomic<uint64_t> max_;
+
+}; // end of class
+
+/**
+ * @brief Snapshot of the counters of a SimpleCache
+ */
+struct CacheStats
+{
+  CacheStats() :
+    num_matches(0),
+    num_misses(0),
+    num_nearest_matches(0),
+    num_inserts(0),
+    num_duplicate_inserts(0),
+    num_nosolutions_inserts(0),
+    num_nosolutions_gets(0),
+    num_nosolutions_retries(0),
+    num_errors(0),
+    num_evictions(0),
+    num_replacements(0),
+    num_journal_writes(0),
+    num_journal_drops(0),
+    size(0),
+    memory_usage(0),
+    mapped_bytes(0)
+  {
+  }
+
+  uint64_t num_matches; // get() found the key, including NOSOLUTION entries
+  uint64_t num_misses;  // get() did not find the key
+  uint64_t num_nearest_matches;
+  uint64_t num_inserts;
+  uint64_t num_duplicate_inserts;
+  uint64_t num_nosolutions_inserts;
+  uint64_t num_nosolutions_gets;
+  uint64_t num_nosolutions_retries; // NOSOLUTION entries that expired or had less time, counted as misses
+  uint64_t num_errors;
+  uint64_t num_evictions;
+  uint64_t num_replacements; // solutions or NOSOLUTION entries replaced by a better solution
+  uint64_t num_journal_writes;
+  uint64_t num_journal_drops;
+  uint64_t size;         // number of keys
+  uint64_t memory_usage; // bytes of heap used by the containers and the nearest neighbour index
+  uint64_t mapped_bytes; // bytes of binary cache file mapped into memory
+
+  double getHitRate() const
+  {
+    const uint64_t lookups = num_matches + num_misses;
+    return lookups ? double(num_matches) / lookups : 0.0;
+  }
+
+  void writeJson(std::ostream& stream) const
+  {
+    stream << "{\"hits\": " << num_matches << ", \"misses\": " << num_misses << ", \"hit_rate\": " << getHitRate()
+           << ", \"nearest_hits\": " << num_nearest_matches << ", \"nosolution_hits\": " << num_nosolutions_gets
+           << ", \"nosolution_retries\": " << num_nosolutions_retries
+           << ", \"errors\": " << num_errors << ", \"evictions\": " << num_evictions
+           << ", \"replacements\": " << num_replacements << ", \"inserts\": " << num_inserts << ", \"duplicate_inserts\": "
+           << num_duplicate_inserts << ", \"nosolution_inserts\": " << num_nosolutions_inserts
+           << ", \"journal_writes\": " << num_journal_writes << ", \"journal_drops\": " << num_journal_drops
+           << ", \"size\": " << size << ", \"memory_bytes\": " << memory_usage << ", \"mapped_bytes\": "
+           << mapped_bytes << "}";
+  }
+};
+
+// Where the seed of an IK search came from
+enum ik_outcome_t {IK_CACHE_HIT, IK_CACHE_NEAREST, IK_CACHE_MISS, IK_CACHE_NOSOLUTION, NUM_IK_OUTCOMES};
+
+/**
+ * @brief Latency and effort of the IK searches of one kinematic chain, split by what the cache returned
+ */
+class IKMetrics
+{
+public:
+
+  IKMetrics() :
+    num_solved_(0),
+    num_failed_(0)
+  {
+  }
+
+  /**
+   * @brief Record one search
+   * @param outcome what the cache lookup returned
+   * @param solved whether a solution was found
+   * @param seconds wall time of the whole search, including the cache lookup
+   * @param attempts number of times the numeric solver was run
+   */
+  void recordSearch(ik_outcome_t outcome, bool solved, double seconds, unsigned int attempts)
+  {
+    latency_[outcome].record(uint64_t(seconds * 1e6 + 0.5));
+    attempts_.record(attempts);
+    (solved ? num_solved_ : num_failed_).fetch_add(1, boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Search latency in microseconds of one outcome
+   */
+  const Log2Histogram& getLatency(ik_outcome_t outcome) const
+  {
+    return latency_[outcome];
+  }
+
+  /**
+   * @brief Solver runs per search
+   */
+  const Log2Histogram& getAttempts() const
+  {
+    return attempts_;
+  }
+
+  uint64_t getNumSolved() const
+  {
+    return num_solved_.load(boost::memory_order_relaxed);
+  }
+
+  uint64_t getNumFailed() const
+  {
+    return num_failed_.load(boost::memory_order_relaxed);
+  }
+
+  void writeJson(std::ostream& stream) const
+  {
+    static const char* OUTCOME_NAMES[] = {"hit", "nearest", "miss", "nosolution"};
+
+    stream << "{\"solved\": " << getNumSolved() << ", \"failed\": " << getNumFailed() << ", \"latency_us\": {";
+    for (std::size_t i = 0; i < NUM_IK_OUTCOMES; ++i)
+    {
+      stream << (i ? ", " : "") << "\"" << OUTCOME_NAMES[i] << "\": ";
+      latency_[i].writeJson(stream);
+    }
+    stream << "}, \"solver_attempts\": ";
+    attempts_.writeJson(stream);
+    stream << "}";
+  }
+
+private:
+
+  Log2Histogram latency_[NUM_IK_OUTCOMES];
+  Log2Histogram attempts_;
+  boost::atomic<uint64_t> num_solved_;
+  boost::atomic<uint64_t> num_failed_;
+
+}; // end of class
+
+typedef boost::shared_ptr<IKMetrics> IKMetricsPtr;
+
+} // namespace
+
+#endif
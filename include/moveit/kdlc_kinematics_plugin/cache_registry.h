@@ -0,0 +1,409 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Process wide registry that gives every kinematic chain its own cache and metrics
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_REGISTRY_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_CACHE_REGISTRY_
+
+// Boost
+#include <boost/function.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+
+// C++
+#include <map>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+// POSIX
+#include <sys/stat.h>
+
+// Caching
+#include "simple_cache.h"
+#include "cache_metrics.h"
+
+namespace simple_cache
+{
+
+/**
+ * @brief Identifies the kinematic chain a cache was built for. Solutions of different chains must never be
+ *        mixed, even when they have the same number of joints.
+ */
+struct CacheId
+{
+  CacheId()
+  {
+  }
+
+  CacheId(const std::string& robot_description_in, const std::string& group_name_in,
+          const std::string& base_frame_in, const std::string& tip_frame_in) :
+    robot_description(robot_description_in),
+    group_name(group_name_in),
+    base_frame(base_frame_in),
+    tip_frame(tip_frame_in)
+  {
+  }
+
+  bool operator<(const CacheId& other) const
+  {
+    if( robot_description != other.robot_description )
+      return robot_description < other.robot_description;
+    if( group_name != other.group_name )
+      return group_name < other.group_name;
+    if( base_frame != other.base_frame )
+      return base_frame < other.base_frame;
+    return tip_frame < other.tip_frame;
+  }
+
+  /**
+   * @brief Human readable form for console output
+   */
+  std::string toString() const
+  {
+    return robot_description + ":" + group_name + " (" + base_frame + " -> " + tip_frame + ")";
+  }
+
+  /**
+   * @brief File name that is unique for the chain of a robot
+   * @param robot_name name of the robot model, since the robot_description parameter is often the same
+   *        for every robot
+   */
+  std::string getFileName(const std::string& robot_name) const
+  {
+    return sanitize(robot_name) + "_" + sanitize(group_name) + "_" + sanitize(base_frame) + "_" +
+      sanitize(tip_frame) + ".dat";
+  }
+
+  std::string robot_description;
+  std::string group_name;
+  std::string base_frame;
+  std::string tip_frame;
+
+private:
+
+  /**
+   * @brief Replace anything that does not belong in a file name, e.g. the slashes of tf frames
+   */
+  static std::string sanitize(const std::string& name)
+  {
+    std::string result = name;
+    for (std::size_t i = 0; i < result.size(); ++i)
+    {
+      const char c = result[i];
+      if( !isalnum(c) && c != '-' && c != '.' )
+        result[i] = '_';
+    }
+    return result;
+  }
+};
+
+/**
+ * @brief Hands out one cache per CacheId, shared by every plugin instance of that chain. The registry only
+ *        holds weak references, so a cache and its journal are closed when the last instance using it is
+ *        destroyed. A new cache of the chain is not created before the old one closed its journal, so the
+ *        journal is never open twice. The IK metrics of a chain are kept for the lifetime of the process.
+ */
+class CacheRegistry
+{
+public:
+
+  typedef boost::function<SimpleCachePtr ()> CacheFactory;
+
+  /**
+   * @brief The registry of this process
+   */
+  static CacheRegistry& getInstance()
+  {
+    static CacheRegistry instance;
+    return instance;
+  }
+
+  /**
+   * @brief Get the cache of a chain, creating it if no instance is using one yet
+   * @param id the chain
+   * @param factory builds and loads the cache. Called with the registry locked, so concurrent callers for the
+   *        same chain wait for the first one instead of loading the file twice.
+   * @return the cache, NULL if the factory failed
+   */
+  SimpleCachePtr getCache(const CacheId& id, const CacheFactory& factory)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    SimpleCachePtr cache = caches_[id].lock();
+    if( cache )
+      return cache;
+
+    // The weak reference expires before the last user has closed the journal, wait for that
+    boost::mutex::scoped_lock close_lock(*close_mutex_);
+
+    ROS_INFO_STREAM_NAMED("cache","Creating cache for " << id.toString());
+    SimpleCachePtr created = factory();
+    if( !created )
+      return created;
+
+    // Users get a reference whose deleter destroys the cache, closing its journal, with close_mutex_ held
+    cache = SimpleCachePtr(created.get(), CacheCloser(close_mutex_, created));
+    caches_[id] = cache;
+    return cache;
+  }
+
+  /**
+   * @brief Get the IK metrics of a chain, creating them on first use
+   */
+  IKMetricsPtr getMetrics(const CacheId& id)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    IKMetricsPtr& metrics = metrics_[id];
+    if( !metrics )
+      metrics.reset(new IKMetrics());
+    return metrics;
+  }
+
+  /**
+   * @brief Write the cache stats and IK metrics of every chain as one JSON object
+   */
+  void writeJson(std::ostream& stream)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    // Chains that have metrics or a live cache
+    std::map<CacheId, bool> ids;
+    for (std::map<CacheId, IKMetricsPtr>::const_iterator it = metrics_.begin(); it != metrics_.end(); ++it)
+      ids[it->first] = true;
+    for (std::map<CacheId, boost::weak_ptr<SimpleCache> >::const_iterator it = caches_.begin();
+         it != caches_.end(); ++it)
+      ids[it->first] = true;
+
+    char stamp[32];
+    snprintf(stamp, sizeof(stamp), "%.3f", ros::WallTime::now().toSec());
+    stream << "{\"stamp\": " << stamp << ", \"chains\": [";
+    for (std::map<CacheId, bool>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+    {
+      const CacheId& id = it->first;
+      stream << (it == ids.begin() ? "" : ", ") << "{\"robot_description\": ";
+      writeJsonString(stream, id.robot_description);
+      stream << ", \"group\": ";
+      writeJsonString(stream, id.group_name);
+      stream << ", \"base_frame\": ";
+      writeJsonString(stream, id.base_frame);
+      stream << ", \"tip_frame\": ";
+      writeJsonString(stream, id.tip_frame);
+
+      stream << ", \"cache\": ";
+      std::map<CacheId, boost::weak_ptr<SimpleCache> >::const_iterator cache_it = caches_.find(id);
+      SimpleCachePtr cache;
+      if( cache_it != caches_.end() )
+        cache = cache_it->second.lock();
+      if( cache )
+        cache->getStats().writeJson(stream);
+      else
+        stream << "null";
+
+      stream << ", \"ik\": ";
+      std::map<CacheId, IKMetricsPtr>::const_iterator metrics_it = metrics_.find(id);
+      if( metrics_it != metrics_.end() )
+        metrics_it->second->writeJson(stream);
+      else
+        stream << "null";
+      stream << "}";
+    }
+    stream << "]}\n";
+  }
+
+  /**
+   * @brief Periodically write writeJson() to a file from a background thread. The file is replaced
+   *        atomically, so readers never see a partial write. Does nothing if already reporting.
+   * @param path location of file
+   * @param interval seconds between writes
+   */
+  void startReporting(const std::string& path, double interval)
+  {
+    boost::mutex::scoped_lock lock(reporter_mutex_);
+    if( reporter_ )
+      return;
+
+    ROS_INFO_STREAM_NAMED("cache","Writing cache metrics to " << path << " every " << interval << "s");
+    reporter_.reset(new boost::thread(boost::bind(&CacheRegistry::report, this, path, interval)));
+  }
+
+  /**
+   * @brief Stop the reporting thread after one last write
+   */
+  void stopReporting()
+  {
+    boost::mutex::scoped_lock lock(reporter_mutex_);
+    if( !reporter_ )
+      return;
+
+    reporter_->interrupt();
+    reporter_->join();
+    reporter_.reset();
+  }
+
+  /**
+   * @brief Number of caches that are currently in use
+   */
+  std::size_t getNumCaches()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::size_t num_caches = 0;
+    for (std::map<CacheId, boost::weak_ptr<SimpleCache> >::const_iterator it = caches_.begin();
+         it != caches_.end(); ++it)
+    {
+      if( !it->second.expired() )
+        ++num_caches;
+    }
+    return num_caches;
+  }
+
+  /**
+   * @brief Directory for cache files when none is configured: $ROS_HOME/kdlc_cache, or ~/.ros/kdlc_cache.
+   *        Created if it does not exist.
+   */
+  static std::string getDefaultDirectory()
+  {
+    std::string ros_home;
+    if( getenv("ROS_HOME") )
+      ros_home = getenv("ROS_HOME");
+    else if( getenv("HOME") )
+      ros_home = std::string(getenv("HOME")) + "/.ros";
+    else
+      ros_home = ".";
+
+    mkdir(ros_home.c_str(), 0755);
+    const std::string directory = ros_home + "/kdlc_cache";
+    mkdir(directory.c_str(), 0755);
+    return directory;
+  }
+
+private:
+
+  /**
+   * @brief Deleter of the caches handed out by getCache(). It owns the cache and destroys it with the close
+   *        mutex held. The mutex is shared, so caches may outlive the registry.
+   */
+  class CacheCloser
+  {
+  public:
+
+    CacheCloser(const boost::shared_ptr<boost::mutex>& close_mutex, const SimpleCachePtr& cache) :
+      close_mutex_(close_mutex),
+      cache_(cache)
+    {
+    }
+
+    void operator()(SimpleCache*)
+    {
+      boost::mutex::scoped_lock lock(*close_mutex_);
+      cache_.reset();
+    }
+
+  private:
+
+    boost::shared_ptr<boost::mutex> close_mutex_;
+    SimpleCachePtr cache_;
+  };
+
+  CacheRegistry() :
+    close_mutex_(new boost::mutex())
+  {
+  }
+
+  ~CacheRegistry()
+  {
+    stopReporting();
+  }
+
+  /**
+   * @brief Body of the reporting thread
+   */
+  void report(const std::string& path, double interval)
+  {
+    const boost::posix_time::milliseconds period(std::max(1, int(interval * 1000)));
+    bool running = true;
+    while( running )
+    {
+      try
+      {
+        boost::this_thread::sleep(period);
+      }
+      catch (const boost::thread_interrupted&)
+      {
+        running = false;
+      }
+      writeReport(path);
+    }
+  }
+
+  /**
+   * @brief Write the metrics next to path and rename over it
+   */
+  void writeReport(const std::string& path)
+  {
+    const std::string temp_path = path + ".tmp";
+    {
+      std::ofstream file(temp_path.c_str());
+      if( !file.is_open() )
+      {
+        ROS_WARN_STREAM_THROTTLE_NAMED(60, "cache","Unable to write cache metrics to " << temp_path);
+        return;
+      }
+      writeJson(file);
+    }
+    if( rename(temp_path.c_str(), path.c_str()) != 0 )
+      ROS_WARN_STREAM_THROTTLE_NAMED(60, "cache","Unable to replace " << path);
+  }
+
+  boost::mutex mutex_;
+  boost::shared_ptr<boost::mutex> close_mutex_; // held while a cache is created or destroyed, after mutex_
+  std::map<CacheId, boost::weak_ptr<SimpleCache> > caches_;
+  std::map<CacheId, IKMetricsPtr> metrics_;
+
+  boost::mutex reporter_mutex_;
+  boost::scoped_ptr<boost::thread> reporter_;
+
+}; // end of class
+
+} // namespace
+
+#endif
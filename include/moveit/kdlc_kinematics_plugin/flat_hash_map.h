@@ -0,0 +1,351 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Open addressing hash table for 64bit int keys with values stored inline
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_FLAT_HASH_MAP_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_FLAT_HASH_MAP_
+
+// C++
+#include <vector>
+#include <utility>
+#include <climits>
+#include <cstddef>
+#include <stdint.h>
+
+namespace simple_cache
+{
+
+/**
+ * @brief Mix the bits of a key so that neighbouring keys do not land in neighbouring slots
+ */
+inline uint64_t hashKey(int64_t key)
+{
+  // splitmix64 finalizer
+  uint64_t x = static_cast<uint64_t>(key);
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * @brief Hash table using linear probing. Keys and values live side by side in one contiguous array so a
+ *        lookup is usually a single cache miss. The key LLONG_MIN is reserved to mark empty slots.
+ */
+template <typename ValueT>
+class FlatHashMap
+{
+public:
+
+  static const int64_t EMPTY_KEY = LLONG_MIN;
+
+  struct Slot
+  {
+    int64_t key;
+    ValueT value;
+  };
+
+  /**
+   * @brief Iterates over the occupied slots only
+   */
+  class const_iterator
+  {
+  public:
+    const_iterator(const Slot* slot, const Slot* end) :
+      slot_(slot),
+      end_(end)
+    {
+      skipEmpty();
+    }
+
+    const Slot& operator*() const { return *slot_; }
+    const Slot* operator->() const { return slot_; }
+    bool operator==(const const_iterator& other) const { return slot_ == other.slot_; }
+    bool operator!=(const const_iterator& other) const { return slot_ != other.slot_; }
+
+    const_iterator& operator++()
+    {
+      ++slot_;
+      skipEmpty();
+      return *this;
+    }
+
+  private:
+    void skipEmpty()
+    {
+      while( slot_ != end_ && slot_->key == EMPTY_KEY )
+        ++slot_;
+    }
+
+    const Slot* slot_;
+    const Slot* end_;
+  };
+
+  FlatHashMap() :
+    size_(0),
+    mask_(0)
+  {
+  }
+
+  /**
+   * @brief Find the value stored for a key
+   * @return pointer to the value inside the table, NULL if not found. Invalidated by the next insert.
+   */
+  ValueT* find(int64_t key)
+  {
+    if( slots_.empty() )
+      return NULL;
+
+    for (std::size_t i = hashKey(key) & mask_; ; i = (i + 1) & mask_)
+    {
+      if( slots_[i].key == key )
+        return &slots_[i].value;
+      if( slots_[i].key == EMPTY_KEY )
+        return NULL;
+    }
+  }
+
+  const ValueT* find(int64_t key) const
+  {
+    return const_cast<FlatHashMap*>(this)->find(key);
+  }
+
+  /**
+   * @brief Insert a key value pair, unless the key is already present
+   * @return pointer to the stored value and true if it was newly inserted, or the existing value and false
+   */
+  std::pair<ValueT*, bool> insert(int64_t key, const ValueT& value)
+  {
+    // Keep load factor under 0.75 so probe sequences stay short
+    if( (size_ + 1) * 4 > slots_.size() * 3 )
+      rehash(slots_.empty() ? 16 : slots_.size() * 2);
+
+    std::size_t i = hashKey(key) & mask_;
+    while( slots_[i].key != EMPTY_KEY )
+    {
+      if( slots_[i].key == key )
+        return std::make_pair(&slots_[i].value, false);
+      i = (i + 1) & mask_;
+    }
+
+    slots_[i].key = key;
+    slots_[i].value = value;
+    ++size_;
+    return std::make_pair(&slots_[i].value, true);
+  }
+
+  /**
+   * @brief Remove a key
+   * @return false if the key was not present
+   */
+  bool erase(int64_t key)
+  {
+    if( slots_.empty() )
+      return false;
+
+    for (std::size_t i = hashKey(key) & mask_; ; i = (i + 1) & mask_)
+    {
+      if( slots_[i].key == key )
+      {
+        eraseSlot(i);
+        return true;
+      }
+      if( slots_[i].key == EMPTY_KEY )
+        return false;
+    }
+  }
+
+  /**
+   * @brief Remove the entry in a slot. Instead of leaving a tombstone, the following entries of the probe
+   *        sequence are shifted back, so a later entry may now occupy this slot.
+   * @param i index of an occupied slot
+   */
+  void eraseSlot(std::size_t i)
+  {
+    std::size_t j = i;
+    while( true )
+    {
+      j = (j + 1) & mask_;
+      if( slots_[j].key == EMPTY_KEY )
+        break;
+
+      // The entry at j can fill the hole at i unless its home slot lies cyclically in (i, j]
+      const std::size_t home = hashKey(slots_[j].key) & mask_;
+      const bool home_between = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+      if( !home_between )
+      {
+        slots_[i] = slots_[j];
+        i = j;
+      }
+    }
+
+    slots_[i].key = EMPTY_KEY;
+    slots_[i].value = ValueT();
+    --size_;
+  }
+
+  /**
+   * @brief Slot by index, for walking the table in place. Empty slots have key EMPTY_KEY.
+   */
+  Slot& getSlot(std::size_t i)
+  {
+    return slots_[i];
+  }
+
+  /**
+   * @brief Find the value for a key in a slot array laid out by this class, e.g. one mapped from a file
+   * @param slots array of capacity slots, capacity must be a power of two with at least one empty slot
+   * @return pointer to the value, NULL if not found
+   */
+  static const ValueT* findInSlots(const Slot* slots, std::size_t capacity, int64_t key)
+  {
+    if( capacity == 0 )
+      return NULL;
+
+    const std::size_t mask = capacity - 1;
+    for (std::size_t i = hashKey(key) & mask; ; i = (i + 1) & mask)
+    {
+      if( slots[i].key == key )
+        return &slots[i].value;
+      if( slots[i].key == EMPTY_KEY )
+        return NULL;
+    }
+  }
+
+  /**
+   * @brief The slot array, capacity() long, e.g. for writing it to disk
+   */
+  const Slot* data() const
+  {
+    return slots_.empty() ? NULL : &slots_[0];
+  }
+
+  /**
+   * @brief Pre-allocate enough slots for num_entries without a rehash
+   */
+  void reserve(std::size_t num_entries)
+  {
+    std::size_t capacity = 16;
+    while( capacity * 3 < num_entries * 4 )
+      capacity *= 2;
+    if( capacity > slots_.size() )
+      rehash(capacity);
+  }
+
+  void clear()
+  {
+    slots_.clear();
+    size_ = 0;
+    mask_ = 0;
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+
+  bool empty() const
+  {
+    return size_ == 0;
+  }
+
+  std::size_t capacity() const
+  {
+    return slots_.size();
+  }
+
+  /**
+   * @brief Number of bytes used by the slot array
+   */
+  std::size_t memoryUsage() const
+  {
+    return slots_.capacity() * sizeof(Slot);
+  }
+
+  const_iterator begin() const
+  {
+    const Slot* first = slots_.empty() ? NULL : &slots_[0];
+    return const_iterator(first, first + slots_.size());
+  }
+
+  const_iterator end() const
+  {
+    const Slot* last = slots_.empty() ? NULL : &slots_[0] + slots_.size();
+    return const_iterator(last, last);
+  }
+
+private:
+
+  /**
+   * @brief Move every entry into a new slot array of the given power of two size
+   */
+  void rehash(std::size_t new_capacity)
+  {
+    Slot empty_slot;
+    empty_slot.key = EMPTY_KEY;
+    empty_slot.value = ValueT();
+
+    std::vector<Slot> old_slots(new_capacity, empty_slot);
+    old_slots.swap(slots_);
+    mask_ = new_capacity - 1;
+
+    for (std::size_t j = 0; j < old_slots.size(); ++j)
+    {
+      if( old_slots[j].key == EMPTY_KEY )
+        continue;
+
+      std::size_t i = hashKey(old_slots[j].key) & mask_;
+      while( slots_[i].key != EMPTY_KEY )
+        i = (i + 1) & mask_;
+      slots_[i] = old_slots[j];
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t size_;
+  std::size_t mask_;
+
+}; // end of class
+
+template <typename ValueT>
+const int64_t FlatHashMap<ValueT>::EMPTY_KEY;
+
+} // namespace
+
+#endif
@@ -0,0 +1,263 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Joint limit aware Levenberg-Marquardt position IK solver for KDL chains
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_IK_SOLVER_LM_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_IK_SOLVER_LM_
+
+// KDL
+#include <kdl/chain.hpp>
+#include <kdl/jntarray.hpp>
+#include <kdl/jacobian.hpp>
+#include <kdl/chainjnttojacsolver.hpp>
+#include <kdl/chainfksolverpos_recursive.hpp>
+#include <kdl/chainiksolver.hpp>
+
+// Eigen
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+
+// C++
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+namespace kdlc_kinematics_plugin
+{
+
+/**
+ * @brief Damped least squares position IK with Levenberg-Marquardt damping, a drop-in for
+ *        KDL::ChainIkSolverPos_NR_JL.
+ *
+ * Every step solves (J^T J + lambda I) dq = J^T e and projects q + dq back into the joint limits, wrapping
+ * continuous joints instead. A step is only taken if it reduces the pose error. Otherwise lambda grows until it
+ * does, so steps shrink towards gradient descent near singularities where the pseudo inverse used by NR_JL
+ * explodes. After a successful step lambda shrinks again towards Gauss-Newton. When no lambda reduces the error
+ * the solver sits in a local minimum, usually pressed against a joint limit. It then gives up right away so the
+ * caller can restart, instead of spending the remaining iterations on it.
+ */
+class ChainIkSolverPos_LM_JL : public KDL::ChainIkSolverPos
+{
+public:
+
+  enum
+  {
+    E_NO_CONVERGE = -3, // max_iterations reached
+    E_STALLED = -4, // no step reduces the error any more
+    E_FK_FAILED = -5
+  };
+
+  /**
+   * @param chain the solver keeps a reference, it must outlive the solver
+   * @param q_min lower joint limits
+   * @param q_max upper joint limits
+   * @param continuous joints that wrap around at +-pi and ignore their limits, may be empty
+   * @param max_iterations number of accepted steps before giving up
+   * @param epsilon convergence tolerance on every component of the pose error, as in NR_JL
+   */
+  ChainIkSolverPos_LM_JL(const KDL::Chain& chain, const KDL::JntArray& q_min, const KDL::JntArray& q_max,
+                         const std::vector<bool>& continuous, unsigned int max_iterations = 500,
+                         double epsilon = 1e-5) :
+    chain_(chain),
+    num_joints_(chain.getNrOfJoints()),
+    q_min_(q_min),
+    q_max_(q_max),
+    continuous_(continuous),
+    max_iterations_(max_iterations),
+    epsilon_(epsilon),
+    fk_solver_(chain),
+    jac_solver_(chain),
+    jac_(num_joints_),
+    q_(num_joints_),
+    q_new_(num_joints_),
+    J_(6, num_joints_),
+    A_(num_joints_, num_joints_),
+    H_(num_joints_, num_joints_),
+    ldlt_(num_joints_),
+    e_(6),
+    e_new_(6),
+    g_(num_joints_),
+    dq_(num_joints_),
+    last_iterations_(0)
+  {
+    continuous_.resize(num_joints_, false);
+  }
+
+  /**
+   * @return number of steps taken, or one of the negative error codes
+   */
+  virtual int CartToJnt(const KDL::JntArray& q_init, const KDL::Frame& p_in, KDL::JntArray& q_out)
+  {
+    static const double LAMBDA_MIN = 1e-9;
+    static const double LAMBDA_MAX = 1e9;
+
+    last_iterations_ = 0;
+    for (unsigned int j = 0; j < num_joints_; ++j)
+      q_(j) = project(j, q_init(j));
+
+    if( !getError(q_, p_in, e_) )
+      return E_FK_FAILED;
+    double error = e_.squaredNorm();
+    if( isConverged() )
+    {
+      q_out = q_;
+      return 0;
+    }
+
+    double lambda = 1e-3;
+    for (unsigned int i = 0; i < max_iterations_; ++i)
+    {
+      if( jac_solver_.JntToJac(q_, jac_) < 0 )
+        return E_FK_FAILED;
+      for (unsigned int r = 0; r < 6; ++r)
+        for (unsigned int c = 0; c < num_joints_; ++c)
+          J_(r, c) = jac_(r, c);
+      A_.noalias() = J_.transpose() * J_;
+      g_.noalias() = J_.transpose() * e_;
+
+      // Raise the damping until a step lowers the error
+      bool improved = false;
+      while( !improved && lambda <= LAMBDA_MAX )
+      {
+        H_ = A_;
+        H_.diagonal().array() += lambda;
+        ldlt_.compute(H_);
+        dq_ = ldlt_.solve(g_);
+
+        for (unsigned int j = 0; j < num_joints_; ++j)
+          q_new_(j) = project(j, q_(j) + dq_(j));
+
+        if( !getError(q_new_, p_in, e_new_) )
+          return E_FK_FAILED;
+        const double new_error = e_new_.squaredNorm();
+        if( new_error < error )
+        {
+          improved = true;
+          error = new_error;
+          q_ = q_new_;
+          e_ = e_new_;
+          lambda = std::max(LAMBDA_MIN, lambda * 0.1);
+        }
+        else
+          lambda *= 10.0;
+      }
+
+      if( !improved )
+      {
+        last_iterations_ = i;
+        return E_STALLED;
+      }
+
+      // Checked after every accepted step, so that the last step allowed can still converge
+      if( isConverged() )
+      {
+        q_out = q_;
+        last_iterations_ = i + 1;
+        return i + 1;
+      }
+    }
+
+    last_iterations_ = max_iterations_;
+    return E_NO_CONVERGE;
+  }
+
+  /**
+   * @brief Steps taken by the last call, whether it converged or not
+   */
+  unsigned int getLastIterations() const
+  {
+    return last_iterations_;
+  }
+
+private:
+
+  /**
+   * @brief Whether every component of the current pose error is within epsilon
+   */
+  bool isConverged() const
+  {
+    return e_.cwiseAbs().maxCoeff() < epsilon_;
+  }
+
+  /**
+   * @brief Keep a joint value within its limits, or within [-pi, pi) for continuous joints
+   */
+  double project(unsigned int j, double value) const
+  {
+    if( continuous_[j] )
+      return value - 2.0 * M_PI * floor((value + M_PI) / (2.0 * M_PI));
+    return std::max(q_min_(j), std::min(q_max_(j), value));
+  }
+
+  /**
+   * @brief Twist from the FK of q to the goal, the same error NR_JL drives to zero
+   */
+  bool getError(const KDL::JntArray& q, const KDL::Frame& p_in, Eigen::VectorXd& e)
+  {
+    if( fk_solver_.JntToCart(q, frame_) < 0 )
+      return false;
+    const KDL::Twist twist = KDL::diff(frame_, p_in);
+    for (unsigned int r = 0; r < 6; ++r)
+      e(r) = twist(r);
+    return true;
+  }
+
+  const KDL::Chain& chain_;
+  const unsigned int num_joints_;
+  const KDL::JntArray q_min_, q_max_;
+  std::vector<bool> continuous_;
+  const unsigned int max_iterations_;
+  const double epsilon_;
+
+  KDL::ChainFkSolverPos_recursive fk_solver_;
+  KDL::ChainJntToJacSolver jac_solver_;
+
+  // Scratch memory, sized once so that solving does not allocate
+  KDL::Jacobian jac_;
+  KDL::Frame frame_;
+  KDL::JntArray q_, q_new_;
+  Eigen::MatrixXd J_, A_, H_;
+  Eigen::LDLT<Eigen::MatrixXd> ldlt_;
+  Eigen::VectorXd e_, e_new_, g_, dq_;
+
+  unsigned int last_iterations_;
+
+}; // end of class
+
+} // namespace
+
+#endif
@@ -40,10 +40,10 @@
 
 // ROS
 #include <ros/ros.h>
-#include <random_numbers/random_numbers.h>
 
 // System
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 // ROS msgs
 #include <geometry_msgs/PoseStamped.h>
@@ -61,10 +61,15 @@
 // MoveIt!
 #include <moveit/kinematics_base/kinematics_base.h>
 #include <moveit/robot_model/robot_model.h>
-#include <moveit/robot_state/robot_state.h>
 
 // Caching
 #include "simple_cache.h"
+#include "cache_registry.h"
+
+// Concurrency
+#include "worker_pool.h"
+#include "solver_context.h"
+#include "batch_fk.h"
 
 namespace kdlc_kinematics_plugin                        
 {
@@ -83,7 +88,8 @@ namespace kdlc_kinematics_plugin
     ~KDLCKinematicsPlugin()
     {
       ROS_DEBUG_STREAM_NAMED("kdlc","Uninitializing kdlc instance #" << this_instance_id_);
-      if( this_instance_id_ == 1 )
+      // The registry only holds weak references, so the last instance of a chain reports on its cache
+      if( cache_ && cache_.unique() )
       {
         cache_->printStats();
       }
@@ -122,15 +128,58 @@ namespace kdlc_kinematics_plugin
                                   const IKCallbackFn &solution_callback,
                                   moveit_msgs::MoveItErrorCodes &error_code) const;      
 
+    /**
+     * @brief Search IK for many poses at once, e.g. all grasp candidates of an object. The cache is checked for the
+     *        whole batch first, then the remaining poses are searched in parallel, each worker thread with its own
+     *        solvers. Consistency limits and solution callbacks are not supported.
+     * @param ik_poses the desired poses of the tip
+     * @param ik_seed_states one seed per pose, or a single seed used for all poses
+     * @param timeout time available to the search of each pose, counted from when a worker picks it up
+     * @param solutions output solution of each pose, empty if it was not solved
+     * @param error_codes output reason for failure or success of each pose
+     * @return true if every pose was solved
+     */
+    bool searchPositionIKBatch(const std::vector<geometry_msgs::Pose> &ik_poses,
+                               const std::vector<std::vector<double> > &ik_seed_states,
+                               double timeout,
+                               std::vector<std::vector<double> > &solutions,
+                               std::vector<moveit_msgs::MoveItErrorCodes> &error_codes) const;
+
     virtual bool getPositionFK(const std::vector<std::string> &link_names,
                                const std::vector<double> &joint_angles, 
                                std::vector<geometry_msgs::Pose> &poses) const;
     
+    /**
+     * @brief Tip poses of many joint configurations, e.g. to fill a cache. Configurations are evaluated several at
+     *        a time in SIMD registers.
+     * @param joint_batch joint values in structure of arrays layout, joint j of configuration c at
+     *        joint_batch[j * num_configs + c]
+     * @param num_configs number of configurations
+     * @param poses output tip pose of each configuration
+     * @return false if the input has the wrong size
+     */
+    bool getPositionFKBatch(const std::vector<double> &joint_batch,
+                            std::size_t num_configs,
+                            std::vector<geometry_msgs::Pose> &poses) const;
+
     virtual bool initialize(const std::string &robot_description,
                             const std::string &group_name,
                             const std::string &base_name,
                             const std::string &tip_name,
                             double search_discretization);
+
+    /**
+     * @brief Initialize from robot models that are already parsed, e.g. from files, instead of loading them from
+     *        the parameter server
+     * @param robot_description name of the robot, identifies its cache together with the group and frames
+     */
+    bool initialize(const std::string &robot_description,
+                    const boost::shared_ptr<urdf::ModelInterface> &urdf_model,
+                    const boost::shared_ptr<srdf::Model> &srdf,
+                    const std::string &group_name,
+                    const std::string &base_name,
+                    const std::string &tip_name,
+                    double search_discretization);
         
     /**
      * @brief  Return all the joint names in the order they are used internally
@@ -141,6 +190,52 @@ namespace kdlc_kinematics_plugin
      * @brief  Return all the link names in the order they are represented internally
      */
     const std::vector<std::string>& getLinkNames() const;
+
+    /**
+     * @brief  Counters, size and memory footprint of the cache of this chain, shared with other instances
+     */
+    simple_cache::CacheStats getCacheStats() const
+    {
+      return cache_ ? cache_->getStats() : simple_cache::CacheStats();
+    }
+
+    /**
+     * @brief  Latency histograms and solver effort of the IK searches of this chain, shared with other instances
+     */
+    simple_cache::IKMetricsPtr getMetrics() const
+    {
+      return metrics_;
+    }
+
+    /**
+     * @brief  Build an empty cache for a chain with the key ranges and encoding set by the cache parameters.
+     *         kdlc_cache_generator and kdlc_cache_convert use this too, so that the plugin can read their files.
+     * @param chain the kinematic chain, only used to bound the workspace
+     * @param joint_min lower joint limits of the chain
+     * @param joint_max upper joint limits of the chain
+     * @param private_handle node handle of the cache parameters
+     * @param storage which container stores the entries
+     * @return the configured cache, without any entries
+     */
+    static simple_cache::SimpleCachePtr configureCache(const KDL::Chain& chain,
+                                                       const KDL::JntArray& joint_min,
+                                                       const KDL::JntArray& joint_max,
+                                                       const ros::NodeHandle& private_handle,
+                                                       simple_cache::storage_t storage = simple_cache::MAP_STORAGE);
+
+    /**
+     * @brief  Load a chain and its joint limits from the parameter server the same way as initialize(), for the
+     *         offline tools that have to build the same cache as the plugin with configureCache()
+     * @param robot_description parameter holding the URDF, the SRDF is expected in <robot_description>_semantic
+     * @return false if the robot, group or chain could not be loaded
+     */
+    static bool loadChain(const std::string& robot_description, const std::string& group_name,
+                          const std::string& base_frame, const std::string& tip_frame, KDL::Chain& chain,
+                          KDL::JntArray& joint_min, KDL::JntArray& joint_max);
+
+    /** @brief Upper bound on the distance from the base frame to the tip frame, from the lengths of all segments */
+    static double getChainReach(const KDL::Chain& chain, const KDL::JntArray& joint_min,
+                                const KDL::JntArray& joint_max);
     
   protected:
 
@@ -183,19 +278,127 @@ namespace kdlc_kinematics_plugin
                           const std::vector<double> &consistency_limit,
                           const KDL::JntArray& solution) const;
 
+    /** @brief Newton iterations from a cached solution until its FK is within the cache tolerances of the goal
+     *  @param context solvers used for the steps
+     *  @param pose_desired goal pose of the tip
+     *  @param jnt_array cached solution, refined in place and kept within the joint limits
+     *  @param max_iterations number of steps allowed, 0 only checks the solution
+     *  @return true if the solution reaches the goal within the tolerances
+     */
+    bool refineCachedSolution(SolverContext& context, const KDL::Frame& pose_desired, KDL::JntArray& jnt_array,
+                              unsigned int max_iterations) const;
+
+    /** @brief A batch of poses shared by the workers of searchPositionIKBatch() */
+    struct BatchJob
+    {
+      const std::vector<geometry_msgs::Pose>* poses;
+      double timeout;
+      std::vector<std::size_t> pending; // poses left for the solver after the cache lookups
+      std::vector<simple_cache::results_t> cache_results;
+      std::vector<simple_cache::ik_outcome_t> outcomes;
+      std::vector<std::vector<double> >* solutions; // holds the seed of each pending pose until it is solved
+      std::vector<moveit_msgs::MoveItErrorCodes>* error_codes;
+      std::vector<SolverContextPtr> contexts; // one per worker, leased from context_pool_ for the batch
+    };
+
+    /** @brief Search one pending pose of a batch
+     *  @param job the batch
+     *  @param item index into job.pending
+     *  @param worker index of the calling worker, selects its solver context
+     */
+    void solveBatchItem(BatchJob& job, std::size_t item, std::size_t worker) const;
+
+    /** @brief One search raced by several restart streams, shared by the workers of searchRacing() */
+    struct RaceJob
+    {
+      RaceJob() :
+        done(false),
+        attempts(0),
+        any_converged(false),
+        found(false),
+        winner_attempts(0)
+      {
+      }
+
+      const geometry_msgs::Pose* ik_pose;
+      KDL::Frame pose_desired;
+      const KDL::JntArray* start_state; // first attempt of stream 0, the cached seed if there is one
+      const KDL::JntArray* seed_state; // the caller's seed, center of the consistency limits
+      const std::vector<double>* consistency_limits;
+      const IKCallbackFn* solution_callback;
+      ros::WallTime start_time;
+      double timeout;
+      std::vector<SolverContextPtr> contexts; // one per worker
+      boost::atomic<bool> done; // set by the winner, the other streams stop at their next attempt
+      boost::atomic<unsigned int> attempts; // solver attempts of all streams
+      boost::atomic<bool> any_converged; // some stream reached the pose, even if its answer was rejected
+      boost::mutex mutex; // one solution_callback at a time, guards the winner below
+      bool found;
+      unsigned int winner_attempts; // attempts of the stream that found the solution, including the winning one
+      std::vector<double> solution;
+      moveit_msgs::MoveItErrorCodes error_code;
+    };
+
+    /** @brief Run search_threads_ restart streams of one search concurrently, the first solution accepted by the
+     *         callback wins. Stream 0 starts from start_state, the others from random configurations. Stream k
+     *         always draws the same restarts for a given search_seed_, whichever worker runs it.
+     *  @param job the search, done, found, solution and error_code are written
+     *  @param pool from acquireRacePool(), released when the race is over
+     */
+    void searchRacing(RaceJob& job, const WorkerPoolPtr& pool) const;
+
+    /** @brief Restart stream of searchRacing()
+     *  @param job the search
+     *  @param stream index of the restart stream, seeds its random numbers
+     *  @param worker index of the calling worker, selects its solver context
+     */
+    void raceStream(RaceJob& job, std::size_t stream, std::size_t worker) const;
+
+    /** @brief Start a pool on first use
+     *  @param pool the pool to start, guarded by pool_mutex_
+     *  @param num_workers size of the pool
+     *  @return the running pool
+     */
+    WorkerPoolPtr getWorkerPool(WorkerPoolPtr& pool, int num_workers) const;
+
+    /** @brief Take an idle race pool, or start one if every pool is racing another search. A pool runs one
+     *         loop at a time, so concurrent searches sharing one would race one after another. At most
+     *         max_race_pools_ pools are started, since their threads live as long as this instance.
+     *  @return a pool of search_threads_ workers, hand it back with releaseRacePool(). NULL if every pool is
+     *          busy and no more may be started, the caller then searches serially.
+     */
+    WorkerPoolPtr acquireRacePool() const;
+
+    /** @brief Hand a pool from acquireRacePool() back for the next search
+     */
+    void releaseRacePool(const WorkerPoolPtr& pool) const;
+
     int getJointIndex(const std::string &name) const;
 
+    /** @brief Build the cache of this chain from the private parameters and load it from cache_location_
+     *  @param private_handle node handle of the cache parameters
+     *  @return the loaded cache
+     */
+    simple_cache::SimpleCachePtr createCache(const ros::NodeHandle& private_handle);
+
+    /** @brief Number of chain segments from the base frame up to a link, 0 for the base frame itself
+     *  @return -1 if the link is not part of the chain
+     */
     int getKDLSegmentIndex(const std::string &name) const;
 
-    void getRandomConfiguration(KDL::JntArray &jnt_array) const;
+    /** @brief Uniformly random joint values within the joint limits, from the random stream of a context. Does not
+     *         allocate, restarts call it once per attempt. */
+    void getRandomConfiguration(SolverContext& context, KDL::JntArray &jnt_array) const;
 
-    /** @brief Get a random configuration within joint limits close to the seed state
+    /** @brief Get a random configuration within joint limits close to the seed state, without allocating
+     *  @param context its random stream is used
      *  @param seed_state Seed state
      *  @param redundancy Index of the redundant joint within the chain
      *  @param consistency_limit The returned state will contain a value for the redundant joint in the range [seed_state(redundancy_limit)-consistency_limit,seed_state(redundancy_limit)+consistency_limit]
      *  @param jnt_array Returned random configuration
      */
-    void getRandomConfiguration(const KDL::JntArray& seed_state,
+    void getRandomConfiguration(SolverContext& context,
+                                const KDL::JntArray& seed_state,
                                 const std::vector<double> &consistency_limits,
                                 KDL::JntArray &jnt_array) const;
     
@@ -207,38 +410,57 @@ namespace kdlc_kinematics_plugin
 
     KDL::Chain kdl_chain_; 
 
-    boost::shared_ptr<KDL::ChainIkSolverVel_pinv> ik_solver_vel_; /** KDLC IK velocity solver */
+    boost::unordered_map<std::string, int> segment_index_; /** getKDLSegmentIndex() of every link of the chain */
 
-    boost::shared_ptr<KDL::ChainFkSolverPos_recursive> fk_solver_;/** KDLC FK solver */
+    SolverContextPoolPtr context_pool_; /** Solvers and scratch memory, one context per concurrent call */
+
+    BatchFKConstPtr batch_fk_; /** Tip poses of many configurations at once */
 
-    boost::shared_ptr<KDL::ChainIkSolverPos_NR_JL> ik_solver_pos_;/** KDLC IK position solver */ 
-    
     unsigned int dimension_; /** Dimension of the group */
 
+    SolverOptions solver_options_; /** Backend, iterations and tolerance of the position solver */
+
     KDL::JntArray joint_min_, joint_max_; /** Joint limits */
 
-    mutable KDL::JntArray jnt_seed_state_,jnt_pos_in_,jnt_pos_out_;/** Pre-allocated for the number of joints (hence mutable) */
+    std::vector<bool> joint_continuous_; /** Joints that wrap around at +-pi */
 
-    mutable random_numbers::RandomNumberGenerator random_number_generator_;
+    typedef double (*JointDistanceFn)(double, double);
+
+    std::vector<JointDistanceFn> joint_distance_; /** Distance between two values of each joint, for consistency checks */
 
     robot_model::RobotModelPtr kinematic_model_;
 
-    robot_state::RobotStatePtr kinematic_state_, kinematic_state_2_;
+    std::string cache_location_; // location to save data to file
+
+    double cache_nn_radius_; // max distance to a cached pose that is used as a seed, 0 disables
 
-    //    robot_state::JointStateGroup* joint_state_group_, joint_state_group_2_;
+    double cache_position_tolerance_, cache_angular_tolerance_; // max error of a cached solution returned as is
 
-    std::string cache_location_; // location to save data to file
+    int cache_refine_iterations_; // Newton steps applied to a cached solution before falling back to the search
 
     int this_instance_id_;
 
-  public: // TODO: not public
-    // Caching stuff
-    static simple_cache::SimpleCachePtr cache_;
+    int batch_threads_; // workers of searchPositionIKBatch(), including the calling thread
 
-  }; // end class
+    int search_threads_; // restart streams raced by each search, 1 searches serially
+
+    int search_seed_; // seed of the restart streams of racing searches
 
-  // initialize this here for some reason?
-  simple_cache::SimpleCachePtr KDLCKinematicsPlugin::cache_;
+    mutable boost::mutex pool_mutex_; // guards the pools below
+
+    mutable WorkerPoolPtr batch_pool_; // started by the first batch
+
+    mutable std::vector<WorkerPoolPtr> free_race_pools_; // idle pools of racing searches, one per concurrent search
+
+    mutable int num_race_pools_; // race pools started so far, idle or not
+
+    int max_race_pools_; // searches that race at the same time, further concurrent searches run serially
+
+    simple_cache::SimpleCachePtr cache_; // shared with the other instances of the same chain, see CacheRegistry
+
+    simple_cache::IKMetricsPtr metrics_; // shared with the other instances of the same chain
+
+  }; // end class
 
 } // end namespace
 
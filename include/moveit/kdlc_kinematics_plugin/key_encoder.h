@@ -0,0 +1,276 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Packs arrays of doubles into 64bit int keys using a fixed number of bits per value
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_KEY_ENCODER_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_KEY_ENCODER_
+
+// C++
+#include <vector>
+#include <stdint.h>
+
+namespace simple_cache
+{
+
+/**
+ * @brief Range and resolution of one value packed into a key
+ */
+struct KeyDimension
+{
+  KeyDimension() :
+    low(0.0),
+    high(0.0),
+    bits(0)
+  {
+  }
+
+  KeyDimension(double low_in, double high_in, unsigned int bits_in) :
+    low(low_in),
+    high(high_in),
+    bits(bits_in)
+  {
+  }
+
+  double low;
+  double high;
+  unsigned int bits;
+};
+
+/**
+ * @brief Quantizes each value into 2^bits bins over its range and packs the bins side by side with shifts and
+ *        masks. The first value occupies the lowest bits. At most 62 bits are used in total so a key is always
+ *        positive and can never collide with LLONG_MAX.
+ */
+class BitPackedEncoder
+{
+public:
+
+  static const unsigned int MAX_BITS = 62;
+  static const unsigned int MAX_DIMENSIONS = 62;
+
+  BitPackedEncoder() :
+    num_dims_(0)
+  {
+  }
+
+  /**
+   * @brief Set the range and number of bits of every value
+   * @return false if the ranges are empty or the bits do not fit in a key
+   */
+  bool setDimensions(const std::vector<KeyDimension>& dims)
+  {
+    unsigned int total_bits = 0;
+    for (std::size_t i = 0; i < dims.size(); ++i)
+    {
+      if( dims[i].bits == 0 || dims[i].high <= dims[i].low )
+        return false;
+      total_bits += dims[i].bits;
+    }
+    if( dims.empty() || total_bits > MAX_BITS )
+      return false;
+
+    num_dims_ = dims.size();
+    unsigned int shift = 0;
+    for (std::size_t i = 0; i < num_dims_; ++i)
+    {
+      const double num_bins = double(uint64_t(1) << dims[i].bits);
+      bits_[i] = dims[i].bits;
+      low_[i] = dims[i].low;
+      high_[i] = dims[i].high;
+      scale_[i] = num_bins / (dims[i].high - dims[i].low);
+      bin_width_[i] = (dims[i].high - dims[i].low) / num_bins;
+      mask_[i] = (uint64_t(1) << dims[i].bits) - 1;
+      shift_[i] = shift;
+      shift += dims[i].bits;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Number of values packed into each key
+   */
+  std::size_t getNumDimensions() const
+  {
+    return num_dims_;
+  }
+
+  /**
+   * @brief Range and bits of a value, as passed to setDimensions()
+   */
+  KeyDimension getDimension(std::size_t dim) const
+  {
+    return KeyDimension(low_[dim], high_[dim], bits_[dim]);
+  }
+
+  /**
+   * @brief Width of one bin of a value
+   */
+  double getBinWidth(std::size_t dim) const
+  {
+    return bin_width_[dim];
+  }
+
+  /**
+   * @brief Pack N values into a key. N is a compile time constant so the loop unrolls.
+   * @return false if a value is outside of its range
+   */
+  template <int N>
+  bool encode(const double values[], int64_t& key) const
+  {
+    uint64_t packed = 0;
+    for (int i = 0; i < N; ++i)
+    {
+      if( !(values[i] >= low_[i] && values[i] < high_[i]) ) // also rejects NaN
+        return false;
+
+      uint64_t bin = uint64_t((values[i] - low_[i]) * scale_[i]);
+      if( bin > mask_[i] ) // rounding right at the top of the range
+        bin = mask_[i];
+      packed |= bin << shift_[i];
+    }
+    key = int64_t(packed);
+    return true;
+  }
+
+  /**
+   * @brief Unpack N values from a key. Each value is placed in the center of its bin.
+   */
+  template <int N>
+  void decode(int64_t key, double values[]) const
+  {
+    const uint64_t packed = uint64_t(key);
+    for (int i = 0; i < N; ++i)
+    {
+      const uint64_t bin = (packed >> shift_[i]) & mask_[i];
+      values[i] = low_[i] + (double(bin) + 0.5) * bin_width_[i];
+    }
+  }
+
+  /**
+   * @brief Pack a runtime number of values, dispatching to the unrolled version for common sizes
+   */
+  bool encode(const double values[], std::size_t n, int64_t& key) const
+  {
+    if( n != num_dims_ )
+      return false;
+
+    switch( n )
+    {
+      case 1: return encode<1>(values, key);
+      case 2: return encode<2>(values, key);
+      case 3: return encode<3>(values, key);
+      case 4: return encode<4>(values, key);
+      case 5: return encode<5>(values, key);
+      case 6: return encode<6>(values, key);
+      case 7: return encode<7>(values, key);
+      case 8: return encode<8>(values, key);
+      case 9: return encode<9>(values, key);
+      case 10: return encode<10>(values, key);
+      default: return encodeDynamic(values, key);
+    }
+  }
+
+  /**
+   * @brief Unpack a runtime number of values, dispatching to the unrolled version for common sizes
+   */
+  bool decode(int64_t key, std::size_t n, double values[]) const
+  {
+    if( n != num_dims_ )
+      return false;
+
+    switch( n )
+    {
+      case 1: decode<1>(key, values); break;
+      case 2: decode<2>(key, values); break;
+      case 3: decode<3>(key, values); break;
+      case 4: decode<4>(key, values); break;
+      case 5: decode<5>(key, values); break;
+      case 6: decode<6>(key, values); break;
+      case 7: decode<7>(key, values); break;
+      case 8: decode<8>(key, values); break;
+      case 9: decode<9>(key, values); break;
+      case 10: decode<10>(key, values); break;
+      default: decodeDynamic(key, values); break;
+    }
+    return true;
+  }
+
+private:
+
+  bool encodeDynamic(const double values[], int64_t& key) const
+  {
+    uint64_t packed = 0;
+    for (std::size_t i = 0; i < num_dims_; ++i)
+    {
+      if( !(values[i] >= low_[i] && values[i] < high_[i]) )
+        return false;
+
+      uint64_t bin = uint64_t((values[i] - low_[i]) * scale_[i]);
+      if( bin > mask_[i] )
+        bin = mask_[i];
+      packed |= bin << shift_[i];
+    }
+    key = int64_t(packed);
+    return true;
+  }
+
+  void decodeDynamic(int64_t key, double values[]) const
+  {
+    const uint64_t packed = uint64_t(key);
+    for (std::size_t i = 0; i < num_dims_; ++i)
+    {
+      const uint64_t bin = (packed >> shift_[i]) & mask_[i];
+      values[i] = low_[i] + (double(bin) + 0.5) * bin_width_[i];
+    }
+  }
+
+  std::size_t num_dims_;
+
+  // Precomputed per dimension
+  double low_[MAX_DIMENSIONS];
+  double high_[MAX_DIMENSIONS];
+  double scale_[MAX_DIMENSIONS];
+  double bin_width_[MAX_DIMENSIONS];
+  uint64_t mask_[MAX_DIMENSIONS];
+  unsigned int shift_[MAX_DIMENSIONS];
+  unsigned int bits_[MAX_DIMENSIONS];
+
+}; // end of class
+
+} // namespace
+
+#endif
@@ -0,0 +1,277 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   k-d tree over cached poses for finding the closest cached pose in SE(3)
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_POSE_NN_INDEX_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_POSE_NN_INDEX_
+
+// C++
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+namespace simple_cache
+{
+
+/**
+ * @brief Nearest neighbour index over poses (x, y, z, qx, qy, qz, qw), each tagged with its cache key.
+ *
+ * The distance between two poses is |p1 - p2| + rotation_weight * angle(q1, q2), so rotation_weight is in
+ * meters per radian. The tree splits on position only, which is valid because the position distance never
+ * exceeds the full distance. Poses added after the last build are kept in an unindexed tail that is scanned
+ * linearly, and the tree is rebuilt once the tail grows past a fraction of the indexed size.
+ */
+class PoseNearestNeighbors
+{
+public:
+
+  PoseNearestNeighbors(double rotation_weight = 0.1) :
+    rotation_weight_(rotation_weight),
+    num_indexed_(0)
+  {
+  }
+
+  void setRotationWeight(double rotation_weight)
+  {
+    rotation_weight_ = rotation_weight;
+  }
+
+  double getRotationWeight() const
+  {
+    return rotation_weight_;
+  }
+
+  /**
+   * @brief Add a pose to the index
+   * @param pose x, y, z, qx, qy, qz, qw
+   * @param key the cache key of this pose
+   */
+  void add(const double pose[], int64_t key)
+  {
+    Point point;
+    for (std::size_t i = 0; i < 3; ++i)
+      point.position[i] = float(pose[i]);
+
+    // Normalize so the angle computation can trust the dot product
+    const double norm = sqrt(pose[3]*pose[3] + pose[4]*pose[4] + pose[5]*pose[5] + pose[6]*pose[6]);
+    for (std::size_t i = 0; i < 4; ++i)
+      point.orientation[i] = norm > 0 ? float(pose[3 + i] / norm) : 0.0f;
+
+    point.key = key;
+    points_.push_back(point);
+
+    // Amortize rebuilding the tree over many insertions
+    const std::size_t tail = points_.size() - num_indexed_;
+    if( tail > MIN_TAIL_SIZE && tail * 8 > num_indexed_ )
+      rebuild();
+  }
+
+  /**
+   * @brief Find the closest pose within radius
+   * @param pose x, y, z, qx, qy, qz, qw
+   * @param radius maximum distance of a match
+   * @param key output cache key of the closest pose
+   * @param distance output distance to the closest pose
+   * @return false if no pose is within radius
+   */
+  bool nearest(const double pose[], double radius, int64_t& key, double& distance) const
+  {
+    Point query;
+    for (std::size_t i = 0; i < 3; ++i)
+      query.position[i] = float(pose[i]);
+    const double norm = sqrt(pose[3]*pose[3] + pose[4]*pose[4] + pose[5]*pose[5] + pose[6]*pose[6]);
+    if( !(norm > 0) )
+      return false;
+    for (std::size_t i = 0; i < 4; ++i)
+      query.orientation[i] = float(pose[3 + i] / norm);
+
+    double best_distance = radius;
+    const Point* best = NULL;
+
+    if( num_indexed_ > 0 )
+      searchTree(query, 0, num_indexed_, 0, best_distance, best);
+
+    for (std::size_t i = num_indexed_; i < points_.size(); ++i)
+    {
+      const double d = poseDistance(query, points_[i]);
+      if( d <= best_distance )
+      {
+        best_distance = d;
+        best = &points_[i];
+      }
+    }
+
+    if( !best )
+      return false;
+
+    key = best->key;
+    distance = best_distance;
+    return true;
+  }
+
+  /**
+   * @brief Rebuild the tree over all poses
+   */
+  void rebuild()
+  {
+    buildTree(0, points_.size(), 0);
+    num_indexed_ = points_.size();
+  }
+
+  void clear()
+  {
+    points_.clear();
+    num_indexed_ = 0;
+  }
+
+  std::size_t size() const
+  {
+    return points_.size();
+  }
+
+  /**
+   * @brief Number of bytes used by the index
+   */
+  std::size_t memoryUsage() const
+  {
+    return points_.capacity() * sizeof(Point);
+  }
+
+private:
+
+  struct Point
+  {
+    float position[3];
+    float orientation[4];
+    int64_t key;
+  };
+
+  static const std::size_t MIN_TAIL_SIZE = 256;
+
+  struct CompareAxis
+  {
+    CompareAxis(std::size_t axis) : axis_(axis) {}
+    bool operator()(const Point& a, const Point& b) const
+    {
+      return a.position[axis_] < b.position[axis_];
+    }
+    std::size_t axis_;
+  };
+
+  /**
+   * @brief Arrange points[begin, end) into an implicit balanced tree: the median on the current axis sits in
+   *        the middle, smaller values to its left and larger to its right
+   */
+  void buildTree(std::size_t begin, std::size_t end, std::size_t depth)
+  {
+    if( end - begin <= 1 )
+      return;
+
+    const std::size_t mid = begin + (end - begin) / 2;
+    std::nth_element(points_.begin() + begin, points_.begin() + mid, points_.begin() + end,
+                     CompareAxis(depth % 3));
+    buildTree(begin, mid, depth + 1);
+    buildTree(mid + 1, end, depth + 1);
+  }
+
+  void searchTree(const Point& query, std::size_t begin, std::size_t end, std::size_t depth,
+                  double& best_distance, const Point*& best) const
+  {
+    if( begin >= end )
+      return;
+
+    const std::size_t mid = begin + (end - begin) / 2;
+    const Point& node = points_[mid];
+
+    const double d = poseDistance(query, node);
+    if( d <= best_distance )
+    {
+      best_distance = d;
+      best = &node;
+    }
+
+    const std::size_t axis = depth % 3;
+    const double diff = double(query.position[axis]) - double(node.position[axis]);
+
+    // Visit the side containing the query first, it is most likely to shrink best_distance
+    if( diff < 0 )
+    {
+      searchTree(query, begin, mid, depth + 1, best_distance, best);
+      if( -diff <= best_distance )
+        searchTree(query, mid + 1, end, depth + 1, best_distance, best);
+    }
+    else
+    {
+      searchTree(query, mid + 1, end, depth + 1, best_distance, best);
+      if( diff <= best_distance )
+        searchTree(query, begin, mid, depth + 1, best_distance, best);
+    }
+  }
+
+  /**
+   * @brief Weighted SE(3) distance. Uses |q1.q2| so that q and -q are the same rotation.
+   */
+  double poseDistance(const Point& a, const Point& b) const
+  {
+    double position_sq = 0;
+    for (std::size_t i = 0; i < 3; ++i)
+    {
+      const double diff = double(a.position[i]) - double(b.position[i]);
+      position_sq += diff * diff;
+    }
+
+    double dot = 0;
+    for (std::size_t i = 0; i < 4; ++i)
+      dot += double(a.orientation[i]) * double(b.orientation[i]);
+    dot = std::min(1.0, fabs(dot));
+
+    return sqrt(position_sq) + rotation_weight_ * 2.0 * acos(dot);
+  }
+
+  double rotation_weight_;
+
+  std::vector<Point> points_;
+
+  // Number of points at the front of points_ that are arranged as a tree
+  std::size_t num_indexed_;
+
+}; // end of class
+
+} // namespace
+
+#endif
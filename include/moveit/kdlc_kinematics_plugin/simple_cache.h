@@ -36,6 +36,9 @@
    Desc:   Simple 7 number cacher using 64bit ints
 */
 
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_SIMPLE_CACHE_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_SIMPLE_CACHE_
+
 // ROS
 #include <ros/ros.h>
 #include <geometry_msgs/Pose.h>
@@ -43,36 +46,159 @@
 // Boost
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 // C++
 #include <iostream>
 #include <fstream>
 #include <math.h>
 #include <climits>
+#include <limits>
 #define _USE_MATH_DEFINES
 
+// Caching
+#include "flat_hash_map.h"
+#include "key_encoder.h"
+#include "pose_nn_index.h"
+#include "cache_entry.h"
+#include "cache_file.h"
+#include "append_writer.h"
+#include "cache_metrics.h"
+
 namespace simple_cache
 {
 
 enum results_t {SUCCESS, FAILURE, DUPLICATE, NOTFOUND, NOSOLUTION};
 
-// Class
+// Storage engine behind the cache
+enum storage_t {MAP_STORAGE, FLAT_HASH_STORAGE};
+
+// How doubles are packed into keys
+enum encoding_t {DECIMAL_ENCODING, BITPACKED_ENCODING};
+
+// Which pose values go into a key: the 7 raw pose fields, or position plus a sign canonical quaternion
+enum pose_keying_t {RAW_POSE_KEYS, SE3_POSE_KEYS};
+
+/**
+ * @brief Cache of IK solutions keyed by pose.
+ *
+ * insert(), get() and getNearest() may be called from any number of threads at once. The keys are split over
+ * NUM_SHARDS shards by hash, each with its own containers and reader writer lock, so threads only contend when
+ * they touch the same shard and lookups in a shard run in parallel. Configuration, reading files and clear()
+ * must not run concurrently with other calls.
+ */
 class SimpleCache
 {
+public:
+
+  static const std::size_t NUM_SHARDS = 64;
+
+  static const uint32_t MAX_NOSOLUTION_DOUBLINGS = 10;
+
 private:
 
-  std::map<int64_t,int64_t> cache_;
+  // A std::map node holds the value plus three pointers and a color
+  static const std::size_t MAP_NODE_SIZE = sizeof(std::pair<const int64_t, CacheEntry>) + 4 * sizeof(void*);
+
+  /**
+   * @brief One slice of the key space with its own lock, containers and stats
+   */
+  struct CacheShard
+  {
+    CacheShard() :
+      num_mapped_overrides(0),
+      clock_hand(0),
+      num_matches(0),
+      num_misses(0),
+      num_nearest_matches(0),
+      num_inserts(0),
+      num_duplicate_inserts(0),
+      num_nosolutions_inserts(0),
+      num_nosolutions_gets(0),
+      num_evictions(0),
+      num_replacements(0),
+      num_nosolutions_retries(0)
+    {
+    }
+
+    // Shared for lookups, exclusive for insertions
+    mutable boost::shared_mutex mutex;
+
+    std::map<int64_t,CacheEntry> cache;
+    FlatHashMap<CacheEntry> flat_cache;
+    std::size_t num_mapped_overrides; // keys that are both in the mapping and in a container
+
+    // Position of the CLOCK eviction hand: a slot index for FLAT_HASH_STORAGE, a key for MAP_STORAGE
+    int64_t clock_hand;
+
+    // Stats, atomic because lookups only hold the shared lock
+    boost::atomic<unsigned int> num_matches;
+    boost::atomic<unsigned int> num_misses;
+    boost::atomic<unsigned int> num_nearest_matches;
+    boost::atomic<unsigned int> num_inserts;
+    boost::atomic<unsigned int> num_duplicate_inserts;
+    boost::atomic<unsigned int> num_nosolutions_inserts;
+    boost::atomic<unsigned int> num_nosolutions_gets;
+    boost::atomic<unsigned int> num_evictions;
+    boost::atomic<unsigned int> num_replacements;
+    boost::atomic<unsigned int> num_nosolutions_retries;
+
+    // Keep neighbouring shards off each other's cache lines
+    char padding[64];
+  };
+
+  CacheShard shards_[NUM_SHARDS];
+
+  // Which container of the shards is in use
+  storage_t storage_;
+
+  // Binary cache file that is served in place. Entries in the shards take precedence, the mapping itself is
+  // never modified so it is read without locks.
+  MappedCacheFile mapped_;
 
   // Size of ik solutions
   int num_joints_;
 
+  // Number of different solutions kept for one pose, at most CacheEntry::MAX_SOLUTIONS
+  std::size_t max_solutions_;
+
+  // Joints that wrap around, compared the shorter way around when choosing the solution closest to a seed.
+  // Empty if there are none.
+  std::vector<bool> continuous_joints_;
+
+  // Seconds a NOSOLUTION entry answers requests after its first failure, doubled by every further failure.
+  // 0 keeps them forever.
+  double nosolution_ttl_;
+
   // Output to console
   bool verbose_;
 
   // Whether to keep the file open and write to disk as insertions are made
   bool live_write_;
-  //FILE *append_file_;
-  std::ofstream append_file_;
+  AsyncAppendWriter append_writer_;
+  std::string journal_path_;
+
+  // Memory budget, enforced per shard by evicting with CLOCK. 0 is unlimited.
+  std::size_t memory_budget_;
+  std::size_t max_entries_per_shard_;
+
+  // How keys are built, and the encoders used for BITPACKED_ENCODING
+  encoding_t encoding_;
+  BitPackedEncoder pose_encoder_;
+  BitPackedEncoder joint_encoder_;
+
+  // SE3_POSE_KEYS use their own encoder over x, y, z, qx, qy, qz
+  pose_keying_t pose_keying_;
+  BitPackedEncoder se3_encoder_;
+
+  // Closest pose lookup for when the exact bin is empty
+  bool use_nearest_;
+  PoseNearestNeighbors nearest_;
+  mutable boost::shared_mutex nearest_mutex_;
+  boost::atomic<std::size_t> evictions_since_rebuild_; // evicted keys that are still in nearest_
 
   // Ranges of inputs
   double joint_hi_;
@@ -80,335 +206,1424 @@ private:
   double pose_hi_;
   double pose_low_;
 
-  // Stats
-  unsigned int num_matches_;
-  unsigned int num_inserts_;
-  unsigned int num_duplicate_inserts_;
-  unsigned int num_nosolutions_inserts_;
-  unsigned int num_nosolutions_gets_;
-  unsigned int num_errors_;
+  // Stats that are not tied to a key, the others live in the shards
+  boost::atomic<unsigned int> num_errors_;
 
 public:
 
   /**
-   * @brief Constructor
-   * @param num_joints size of ik solutions
-   * @param verbose whether to print debug output to screen
-   * @param joint_hi  -- Limits of max and min values
-   * @param joint_low
-   * @param pose_hi
-   * @param pose_low
+   * @brief Constructor
+   * @param num_joints size of ik solutions
+   * @param verbose whether to print debug output to screen
+   * @param joint_hi  -- Limits of max and min values
+   * @param joint_low
+   * @param pose_hi
+   * @param pose_low
+   * @param storage which container stores the key value pairs
+   */
+  SimpleCache(int num_joints, bool verbose,
+              double joint_hi, double joint_low, double pose_hi,  double pose_low,
+              storage_t storage = MAP_STORAGE) :
+    storage_(storage),
+    num_joints_(num_joints),
+    max_solutions_(1),
+    nosolution_ttl_(0),
+    verbose_(verbose),
+    joint_hi_(joint_hi),
+    joint_low_(joint_low),
+    pose_hi_(pose_hi),
+    pose_low_(pose_low),
+    live_write_(false),
+    memory_budget_(0),
+    max_entries_per_shard_(0),
+    encoding_(DECIMAL_ENCODING),
+    pose_keying_(RAW_POSE_KEYS),
+    use_nearest_(false),
+    evictions_since_rebuild_(0),
+    num_errors_(0)
+  {
+  }
+
+  /**
+   * @brief Deconstructor - close append file if still open
+   */
+  ~SimpleCache()
+  {
+    // Only close file if we are in append mode
+    if( live_write_ )
+    {
+      ROS_INFO_STREAM_NAMED("cache","Closing append file...");
+      append_writer_.close();
+    }
+  }
+
+  /**
+   * @brief Pack keys with shifts and masks instead of base 100 digits. Each value gets its own number of bits.
+   *        Keys of the two encodings are not compatible, so call this before inserting or reading a file.
+   * @param pose_bits number of bits for x, y, z, qx, qy, qz, qw
+   * @param joint_bits number of bits for each joint
+   * @return false if the bits do not fit into a 64 bit key
+   */
+  bool setBitPacking(const std::vector<unsigned int>& pose_bits, const std::vector<unsigned int>& joint_bits)
+  {
+    static const std::size_t POSE_SIZE = 7;
+    if( pose_bits.size() != POSE_SIZE || joint_bits.size() != std::size_t(num_joints_) )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Expected " << POSE_SIZE << " pose bit sizes and " << num_joints_
+                             << " joint bit sizes");
+      return false;
+    }
+
+    std::vector<KeyDimension> pose_dims;
+    for (std::size_t i = 0; i < pose_bits.size(); ++i)
+      pose_dims.push_back(KeyDimension(pose_low_, pose_hi_, pose_bits[i]));
+
+    std::vector<KeyDimension> joint_dims;
+    for (std::size_t i = 0; i < joint_bits.size(); ++i)
+      joint_dims.push_back(KeyDimension(joint_low_, joint_hi_, joint_bits[i]));
+
+    if( !pose_encoder_.setDimensions(pose_dims) || !joint_encoder_.setDimensions(joint_dims) )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Invalid bit packing, each key holds at most " << BitPackedEncoder::MAX_BITS
+                             << " bits");
+      return false;
+    }
+
+    encoding_ = BITPACKED_ENCODING;
+    return true;
+  }
+
+  /**
+   * @brief Pack keys with shifts and masks, using the same number of bits for all position and for all
+   *        orientation values. The joints share all available bits evenly.
+   * @param position_bits number of bits for each of x, y, z
+   * @param orientation_bits number of bits for each quaternion component
+   * @return false if the bits do not fit into a 64 bit key
+   */
+  bool setBitPacking(unsigned int position_bits = 10, unsigned int orientation_bits = 8)
+  {
+    std::vector<unsigned int> pose_bits(3, position_bits);
+    pose_bits.resize(7, orientation_bits);
+    std::vector<unsigned int> joint_bits(num_joints_, BitPackedEncoder::MAX_BITS / num_joints_);
+    return setBitPacking(pose_bits, joint_bits);
+  }
+
+  /**
+   * @brief Key poses by position and a sign canonical quaternion, so that q and -q share a key, with separate
+   *        position and angular resolution. Replaces pose_hi/pose_low for poses. Call this before inserting or
+   *        reading a file.
+   * @param position_resolution width of a position bin in meters
+   * @param angular_resolution approximate width of an orientation bin in radians
+   * @param workspace_low minimum x, y, z that can be cached, e.g. from the reach of the chain
+   * @param workspace_high maximum x, y, z that can be cached
+   * @return false if the resolution needs more bits than fit into a 64 bit key
+   */
+  bool setPoseResolution(double position_resolution, double angular_resolution,
+                         const double workspace_low[3], const double workspace_high[3])
+  {
+    if( position_resolution <= 0 || angular_resolution <= 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Pose resolutions must be positive");
+      return false;
+    }
+
+    std::vector<KeyDimension> dims;
+    for (std::size_t i = 0; i < 3; ++i)
+      dims.push_back(KeyDimension(workspace_low[i], workspace_high[i],
+                                  bitsForBins((workspace_high[i] - workspace_low[i]) / position_resolution)));
+
+    // A rotation by a small angle moves the quaternion components by about half that angle
+    const unsigned int orientation_bits = bitsForBins(2.0 / (angular_resolution / 2.0));
+    for (std::size_t i = 0; i < 3; ++i)
+      dims.push_back(KeyDimension(-1.0, 1.0, orientation_bits));
+
+    if( !se3_encoder_.setDimensions(dims) )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Pose resolution needs more than " << BitPackedEncoder::MAX_BITS
+                             << " bits per key, use a coarser resolution or smaller workspace");
+      return false;
+    }
+
+    if(verbose_)
+      ROS_INFO_STREAM_NAMED("cache","SE(3) pose keys use " << dims[0].bits << "," << dims[1].bits << ","
+                            << dims[2].bits << " position bits and " << orientation_bits << " bits per quaternion component");
+
+    pose_keying_ = SE3_POSE_KEYS;
+    return true;
+  }
+
+  /**
+   * @brief get which pose values go into a key
+   */
+  pose_keying_t getPoseKeying() const
+  {
+    return pose_keying_;
+  }
+
+  /**
+   * @brief get how keys are built
+   */
+  encoding_t getEncoding() const
+  {
+    return encoding_;
+  }
+
+  /**
+   * @brief Keep up to max_solutions different IK solutions for each pose, e.g. elbow up and elbow down.
+   *        get() with a seed returns the one closest to the seed.
+   * @param max_solutions between 1 and CacheEntry::MAX_SOLUTIONS
+   */
+  void setMaxSolutions(std::size_t max_solutions)
+  {
+    max_solutions_ = std::max(std::size_t(1), std::min(max_solutions, std::size_t(CacheEntry::MAX_SOLUTIONS)));
+  }
+
+  std::size_t getMaxSolutions() const
+  {
+    return max_solutions_;
+  }
+
+  /**
+   * @brief Mark the joints that wrap around, so that +pi and -pi are the same angle when get() picks the
+   *        solution closest to a seed
+   * @param continuous_joints one flag per joint, or empty if no joint is continuous
+   */
+  void setContinuousJoints(const std::vector<bool>& continuous_joints)
+  {
+    if( !continuous_joints.empty() && continuous_joints.size() != std::size_t(num_joints_) )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Expected " << num_joints_ << " continuous joint flags, got "
+                             << continuous_joints.size());
+      return;
+    }
+    continuous_joints_ = continuous_joints;
+  }
+
+  /**
+   * @brief Let NOSOLUTION entries expire, so that a pose that failed once is searched again later. Each further
+   *        failure doubles how long the entry lasts, up to 2^MAX_NOSOLUTION_DOUBLINGS times ttl.
+   * @param ttl seconds after the first failure, 0 keeps entries forever
+   */
+  void setNoSolutionExpiry(double ttl)
+  {
+    nosolution_ttl_ = std::max(0.0, ttl);
+  }
+
+  double getNoSolutionExpiry() const
+  {
+    return nosolution_ttl_;
+  }
+
+  /**
+   * @brief Keep an index of all poses with a solution so getNearest() can find close poses in other bins
+   * @param rotation_weight meters of position distance that are equivalent to one radian of rotation
+   */
+  void enableNearest(double rotation_weight)
+  {
+    use_nearest_ = true;
+    {
+      boost::unique_lock<boost::shared_mutex> lock(nearest_mutex_);
+      nearest_.setRotationWeight(rotation_weight);
+    }
+    rebuildNearest();
+  }
+
+  /**
+   * @brief Bound the memory used by the cache entries. When a shard is full, inserting a new key evicts an entry
+   *        that was not looked up since the eviction hand last passed it (CLOCK), so frequently used regions of
+   *        the workspace stay resident. Entries of a mapped binary file are not counted, the kernel pages them.
+   *        The nearest neighbour index comes on top when enabled, it is rebuilt without evicted keys once they
+   *        make up a third of it.
+   * @param bytes budget for all shards together, 0 for unlimited
+   */
+  void setMemoryBudget(std::size_t bytes)
+  {
+    memory_budget_ = bytes;
+    max_entries_per_shard_ = 0;
+    if( bytes == 0 )
+      return;
+
+    const std::size_t shard_budget = bytes / NUM_SHARDS;
+    if( storage_ == FLAT_HASH_STORAGE )
+    {
+      // The table doubles at a load factor of 0.75, so stop just before the doubling that would exceed the budget
+      std::size_t capacity = 16;
+      while( capacity * 2 * sizeof(FlatHashMap<CacheEntry>::Slot) <= shard_budget )
+        capacity *= 2;
+      max_entries_per_shard_ = capacity * 3 / 4;
+    }
+    else
+      max_entries_per_shard_ = std::max(std::size_t(1), shard_budget / MAP_NODE_SIZE);
+
+    // Shrink right away if the cache is already larger
+    for (std::size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shards_[i].mutex);
+      while( containerSize(shards_[i]) > max_entries_per_shard_ )
+        evictOne(shards_[i]);
+    }
+    rebuildNearestIfStale();
+
+    if(verbose_)
+      ROS_INFO_STREAM_NAMED("cache","Memory budget of " << bytes << " bytes holds " << max_entries_per_shard_ * NUM_SHARDS
+                            << " entries");
+  }
+
+  std::size_t getMemoryBudget() const
+  {
+    return memory_budget_;
+  }
+
+  /**
+   * @brief Write a cache to file
+   * @param path location of file
+   * @return true if write was successful
+   */
+  bool writeFile(std::string path)
+  {
+    ROS_INFO_STREAM_NAMED("cache","Writing to file");
+
+    int num_insertions = 0;
+    if (getSize() == 0)
+    {
+      if(verbose_)
+        ROS_WARN_STREAM_NAMED("cache","Did not write to file because cache is empty");
+      return false;
+    }
+
+    //FILE *file = fopen(path.c_str(), "w");
+    std::ofstream file;
+    file.open(path.c_str(), std::ios_base::out);
+
+    if (!file.is_open() || !file.good())
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Error writing KDLC cache to disk.");
+      return false;
+    }
+
+    // Write to file, one line per solution so that a key with several solutions repeats
+    EntryWriter writer(file);
+    forEachEntry(writer);
+    num_insertions = writer.num_lines_;
+
+    //fclose(file);
+    file.close();
+
+    ROS_INFO_STREAM_NAMED("cache","Wrote " << num_insertions << " key value pairs to file");
+
+    // Sucess
+    return true;
+  }
+
+  /**
+   * @brief Write the cache in the binary format, which readFile() maps into memory without parsing
+   * @param path location of file
+   * @return true if write was successful
+   */
+  bool writeBinaryFile(const std::string& path)
+  {
+    // Merge the shards into one table with the file layout
+    TableBuilder builder(getSize());
+    forEachEntry(builder);
+    const bool written = writeCacheFile(path, getFileSettings(), builder.table_);
+
+    if( written )
+      ROS_INFO_STREAM_NAMED("cache","Wrote " << getSize() << " keys to binary file " << path);
+    return written;
+  }
+
+  /**
+   * @brief open a binary journal that every insertion is appended to by a background thread. Replay it with
+   *        readFile() or replayJournal().
+   * @param path location of file, should not be the text or binary cache file itself
+   * @param options batching and durability of the writes
+   * @param snapshot_path if not empty, compact() into this file every options.compact_records journal records
+   */
+  void startAppend(std::string path, const AppendWriterOptions& options = AppendWriterOptions(),
+                   const std::string& snapshot_path = "")
+  {
+    AppendWriterOptions writer_options = options;
+    if( !snapshot_path.empty() && options.compact_records > 0 )
+      writer_options.compact_callback = boost::bind(&SimpleCache::compact, this, snapshot_path);
+
+    journal_path_ = path;
+    live_write_ = append_writer_.open(path, getFileSettings(), writer_options);
+  }
+
+  /**
+   * @brief Replace the file on disk with what is in memory and empty the journal, so the files stop growing
+   *        and evicted entries are dropped from disk as well. The journal is rotated before the snapshot is
+   *        taken, so every insertion ends up in the snapshot, the new journal or both. At startup, read the
+   *        snapshot, then replay getRotatedJournalPath() if it exists, then the journal.
+   * @param snapshot_path the cache file that is read at startup, written in the binary format
+   * @return true if the snapshot was written
+   */
+  bool compact(const std::string& snapshot_path)
+  {
+    // A rotated journal left by an earlier failed compaction is already in memory, so it is only deleted
+    // after this snapshot is written and the current journal keeps going until the next compaction
+    const std::string rotated_path = getRotatedJournalPath(journal_path_);
+    const bool rotate = live_write_ && access(rotated_path.c_str(), F_OK) != 0;
+    if( rotate && !append_writer_.rotate(rotated_path) )
+      return false;
+
+    if( !writeBinaryFile(snapshot_path) )
+      return false; // the rotated journal is replayed at the next startup
+
+    if( live_write_ )
+      remove(rotated_path.c_str());
+    return true;
+  }
+
+  /**
+   * @brief Add the insertions recorded in a journal on top of what is already in the cache
+   * @param path location of file
+   * @return true if the journal was read
+   */
+  bool replayJournal(const std::string& path)
+  {
+    FILE* file = fopen(path.c_str(), "rb");
+    if( !file )
+    {
+      ROS_WARN_STREAM_NAMED("cache","File not found: " << path);
+      return false;
+    }
+
+    CacheJournalHeader header;
+    const CacheFileSettings settings = getFileSettings();
+    if( fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CACHE_JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size == 0 || header.record_size != getJournalRecordSize(header.version) ||
+        memcmp(&header.settings, &settings, sizeof(settings)) != 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Journal " << path << " was not written by a cache with these settings");
+      fclose(file);
+      return false;
+    }
+
+    // Read in chunks, a torn record at the end from a crash is ignored. Records of older versions are a prefix
+    // of the current one.
+    int num_insertions = 0;
+    const std::size_t record_size = header.record_size;
+    std::vector<char> buffer(4096 * record_size);
+    std::size_t num_read;
+    CacheJournalRecord record = CacheJournalRecord();
+    while( (num_read = fread(&buffer[0], record_size, 4096, file)) > 0 )
+    {
+      for (std::size_t i = 0; i < num_read; ++i)
+      {
+        memcpy(&record, &buffer[i * record_size], record_size);
+        addRecord(record);
+      }
+      num_insertions += num_read;
+    }
+    fclose(file);
+
+    ROS_INFO_STREAM_NAMED("cache","Replayed " << num_insertions << " insertions from journal " << path);
+
+    if( use_nearest_ )
+      rebuildNearest();
+
+    return true;
+  }
+
+  /**
+   * @brief Load a cache from file
+   * @param path location of file
+   * @return true if read was successful
+   */
+  bool readFile(std::string path)
+  {
+    if (access(path.c_str(), R_OK) < 0)
+    {
+      ROS_WARN_STREAM_NAMED("cache","File not found: " << path);
+      return false;
+    }
+
+    if( isBinaryCacheFile(path) )
+      return readBinaryFile(path);
+
+    if( isCacheJournal(path) )
+    {
+      clear();
+      return replayJournal(path);
+    }
+
+    std::ifstream file(path.c_str());
+    //FILE *file = fopen(path.c_str(), "r");
+    if (!file.is_open())
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Error opening file " << path);
+      return false;
+    }
+
+    clear();
+
+    int num_insertions = 0;
+    int64_t key;
+    int64_t value;
+
+    while( file >> key >> value )
+    {
+      //ROS_INFO_STREAM_NAMED("cache","Read in " << key << "," << value);
+      // Add to cache
+      addSolution(key, value);
+
+      ++num_insertions;
+    }
+
+    ROS_INFO_STREAM_NAMED("cache","Read " << num_insertions << " key value pairs into cache");
+
+    if( use_nearest_ )
+      rebuildNearest();
+
+    // Sucess
+    return true;
+  }
+
+  /**
+   * @brief Add an IK solution to cache. A full bucket keeps the solutions with the highest quality, and any
+   *        scored solution replaces a NOSOLUTION entry.
+   * @param ik_pose the input key
+   * @param joint_values the input value
+   * @param no_solution store that the pose has no solution instead of joint_values, see insertNoSolution()
+   * @param quality score of the solution, higher is better. 0 is unscored and never replaces anything.
+   * @return results_t an enum of different status
+   */
+  results_t insert(const geometry_msgs::Pose& ik_pose, const std::vector<double>& joint_values, bool no_solution = false,
+                   uint8_t quality = 0)
+  {
+    if( no_solution )
+      return insertNoSolution(ik_pose, 0.0);
+
+    // Error check
+    if( joint_values.size() != num_joints_ )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Mismatched solution size for joint values. Recieved " << joint_values.size()
+                             << " expected " << num_joints_);
+      increment(num_errors_);
+      return FAILURE;
+    }
+
+    CacheJournalRecord record = CacheJournalRecord();
+    if( !poseToKey(ik_pose, record.key) || !jointsToKey(joint_values, record.value) )
+    {
+      increment(num_errors_);
+      return FAILURE;
+    }
+    record.quality = quality;
+
+    return insertRecord(ik_pose, record);
+  }
+
+  /**
+   * @brief Record that a search for a pose failed. get() answers NOSOLUTION for the pose until the entry expires
+   *        or a request comes with more time than any failed search had. Every further failure makes the entry
+   *        last longer. A solution found later replaces the entry.
+   * @param ik_pose the input key
+   * @param timeout seconds the failed search had
+   * @return results_t an enum of different status
+   */
+  results_t insertNoSolution(const geometry_msgs::Pose& ik_pose, double timeout)
+  {
+    CacheJournalRecord record = CacheJournalRecord();
+    if( !poseToKey(ik_pose, record.key) )
+    {
+      increment(num_errors_);
+      return FAILURE;
+    }
+    record.value = LLONG_MAX;
+    record.timeout = float(timeout);
+    record.time = ros::WallTime::now().toSec();
+
+    increment(getShard(record.key).num_nosolutions_inserts);
+    return insertRecord(ik_pose, record);
+  }
+
+  /**
+   * @brief Get an IK solution from cache
+   * @param ik_pose the input key
+   * @param joint_values the returned ik seed
+   * @return results_t an enum of different status
+   */
+  results_t get(const geometry_msgs::Pose& ik_pose, std::vector<double>& joint_values)
+  {
+    std::vector<double> no_seed;
+    return get(ik_pose, no_seed, joint_values);
+  }
+
+  /**
+   * @brief Get the cached IK solution that is closest to a seed
+   * @param ik_pose the input key
+   * @param seed the solution closest to this in joint space is returned, if empty the first solution is returned
+   * @param joint_values the returned ik seed
+   * @param timeout of the request. NOSOLUTION is only returned if a search with at least this much time failed,
+   *        otherwise the pose counts as not found so that it is searched again.
+   * @return results_t an enum of different status
+   */
+  results_t get(const geometry_msgs::Pose& ik_pose, const std::vector<double>& seed, std::vector<double>& joint_values,
+                double timeout = 0.0)
+  {
+    // Convert ik_pose to key
+    int64_t key = 0;
+    if(!poseToKey(ik_pose,key))
+    {
+      increment(num_errors_);
+      return FAILURE;
+    }
+
+    // Check map for key
+    CacheShard& shard = getShard(key);
+    CacheEntry entry;
+    if( !findEntry(shard, key, entry) )
+    {
+      if(verbose_)
+        ROS_WARN_STREAM_NAMED("cache","get: No value found for key " << key);
+
+      increment(shard.num_misses);
+      return NOTFOUND;
+    }
+
+    if(verbose_)
+      ROS_INFO_STREAM_NAMED("cache","get: found " << int(entry.num_solutions) << " values, first is "
+                            << entry.solutions[0] << " max is " << LLONG_MAX);
+
+    // Check if key is at maximum value, if it is that means no solution was found
+    if( entry.isNoSolution() )
+    {
+      if( !entry.rejects(timeout, ros::WallTime::now().toSec()) )
+      {
+        increment(shard.num_nosolutions_retries);
+        increment(shard.num_misses);
+        return NOTFOUND;
+      }
+      increment(shard.num_matches);
+      increment(shard.num_nosolutions_gets);
+      return NOSOLUTION;
+    }
+    increment(shard.num_matches);
+
+    // Convert value to vector
+    if( !closestSolution(entry, seed, joint_values) )
+    {
+      increment(num_errors_);
+      return FAILURE;
+    }
+
+    return SUCCESS;
+  }
+
+  /**
+   * @brief Get the IK solution of the closest cached pose, for when get() finds nothing in the exact bin
+   * @param ik_pose the input pose
+   * @param radius maximum distance of a match, see PoseNearestNeighbors for the metric
+   * @param joint_values the returned ik seed
+   * @return results_t an enum of different status
+   */
+  results_t getNearest(const geometry_msgs::Pose& ik_pose, double radius, std::vector<double>& joint_values)
+  {
+    std::vector<double> no_seed;
+    return getNearest(ik_pose, radius, no_seed, joint_values);
+  }
+
+  /**
+   * @brief Get the IK solution of the closest cached pose that is closest to a seed
+   * @param ik_pose the input pose
+   * @param radius maximum distance of a match, see PoseNearestNeighbors for the metric
+   * @param seed the solution closest to this in joint space is returned, if empty the first solution is returned
+   * @param joint_values the returned ik seed
+   * @return results_t an enum of different status
+   */
+  results_t getNearest(const geometry_msgs::Pose& ik_pose, double radius, const std::vector<double>& seed,
+                       std::vector<double>& joint_values)
+  {
+    if( !use_nearest_ )
+      return NOTFOUND;
+
+    double pose[] = {ik_pose.position.x, ik_pose.position.y, ik_pose.position.z, ik_pose.orientation.x,
+                     ik_pose.orientation.y, ik_pose.orientation.z, ik_pose.orientation.w};
+    int64_t key;
+    double distance;
+    {
+      boost::shared_lock<boost::shared_mutex> lock(nearest_mutex_);
+      if( !nearest_.nearest(pose, radius, key, distance) )
+        return NOTFOUND;
+    }
+
+    CacheShard& shard = getShard(key);
+    CacheEntry entry;
+    if( !findEntry(shard, key, entry) || entry.isNoSolution() )
+      return NOTFOUND;
+
+    if(verbose_)
+      ROS_INFO_STREAM_NAMED("cache","getNearest: found key " << key << " at distance " << distance);
+
+    if( !closestSolution(entry, seed, joint_values) )
+    {
+      increment(num_errors_);
+      return FAILURE;
+    }
+
+    increment(shard.num_nearest_matches);
+    return SUCCESS;
+  }
+
+  /**
+   * @brief get size of cache (map)
+   * @return size of cache
+   */
+  size_t getSize() const
+  {
+    std::size_t size = mapped_.size();
+    for (std::size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shards_[i].mutex);
+      if( storage_ == FLAT_HASH_STORAGE )
+        size += shards_[i].flat_cache.size();
+      else
+        size += shards_[i].cache.size();
+      size -= shards_[i].num_mapped_overrides;
+    }
+    return size;
+  }
+
+  /**
+   * @brief Bytes of heap used by the containers and the nearest neighbour index. A mapped binary file is not
+   *        included, see CacheStats::mapped_bytes.
+   */
+  std::size_t getMemoryUsage() const
+  {
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shards_[i].mutex);
+      bytes += shards_[i].flat_cache.memoryUsage() + shards_[i].cache.size() * MAP_NODE_SIZE;
+    }
+
+    boost::shared_lock<boost::shared_mutex> lock(nearest_mutex_);
+    return bytes + nearest_.memoryUsage();
+  }
+
+  /**
+   * @brief Read all counters, e.g. to monitor the hit rate while the planner is running. Safe to call
+   *        concurrently with lookups and insertions.
+   */
+  CacheStats getStats() const
+  {
+    CacheStats stats;
+    stats.num_matches = sumShardStat(&CacheShard::num_matches);
+    stats.num_misses = sumShardStat(&CacheShard::num_misses);
+    stats.num_nearest_matches = sumShardStat(&CacheShard::num_nearest_matches);
+    stats.num_inserts = sumShardStat(&CacheShard::num_inserts);
+    stats.num_duplicate_inserts = sumShardStat(&CacheShard::num_duplicate_inserts);
+    stats.num_nosolutions_inserts = sumShardStat(&CacheShard::num_nosolutions_inserts);
+    stats.num_nosolutions_gets = sumShardStat(&CacheShard::num_nosolutions_gets);
+    stats.num_evictions = sumShardStat(&CacheShard::num_evictions);
+    stats.num_replacements = sumShardStat(&CacheShard::num_replacements);
+    stats.num_nosolutions_retries = sumShardStat(&CacheShard::num_nosolutions_retries);
+    stats.num_errors = num_errors_.load(boost::memory_order_relaxed);
+    if( live_write_ )
+    {
+      stats.num_journal_writes = append_writer_.getNumWritten();
+      stats.num_journal_drops = append_writer_.getNumDropped();
+    }
+    stats.size = getSize();
+    stats.memory_usage = getMemoryUsage();
+    stats.mapped_bytes = mapped_.getMappedBytes();
+    return stats;
+  }
+
+  /**
+   * @brief remove all entries and unmap any binary file
+   */
+  void clear()
+  {
+    clearShards();
+    mapped_.close();
+    boost::unique_lock<boost::shared_mutex> lock(nearest_mutex_);
+    nearest_.clear();
+  }
+
+  /**
+   * @brief get which container is storing the cache
+   */
+  storage_t getStorage() const
+  {
+    return storage_;
+  }
+
+  /**
+   * @brief output cache to console for debugging
+   */
+  void printMap()
+  {
+    ROS_INFO_STREAM_NAMED("cache","Printing key value pairs in map: ---------------------------------------");
+    EntryWriter writer(std::cout);
+    forEachEntry(writer);
+  }
+
+  /**
+   * @brief output the number limits to consolte for debugging
+   */
+  void printLimits()
+  {
+    ROS_INFO_STREAM_NAMED("cache","Limits of numbers:");
+    std::cout << "joint_hi: " << joint_hi_ << std::endl;
+    std::cout << "joint_low: " << joint_low_ << std::endl;
+    std::cout << "pose_hi: " << pose_hi_ << std::endl;
+    std::cout << "pose_low: " << pose_low_ << std::endl;
+  }
+
+  /**
+   * @brief print out stats
+   */
+  void printStats()
+  {
+    const CacheStats stats = getStats();
+    ROS_INFO_STREAM_NAMED("cache","Stats");
+    std::cout << "num matches: \t\t\t" << stats.num_matches << std::endl;
+    std::cout << "num misses: \t\t\t" << stats.num_misses << std::endl;
+    std::cout << "num nearest matches: \t\t" << stats.num_nearest_matches << std::endl;
+    std::cout << "num inserts: \t\t\t" << stats.num_inserts << std::endl;
+    std::cout << "num duplicate inserts: \t\t" << stats.num_duplicate_inserts << std::endl;
+    std::cout << "num nosolution inserts: \t" << stats.num_nosolutions_inserts << std::endl;
+    std::cout << "num nosolution gets: \t\t" << stats.num_nosolutions_gets << std::endl;
+    std::cout << "num nosolution retries: \t" << stats.num_nosolutions_retries << std::endl;
+    std::cout << "num errors: \t\t\t" << stats.num_errors << std::endl;
+    std::cout << "num evictions: \t\t\t" << stats.num_evictions << std::endl;
+    std::cout << "num replacements: \t\t" << stats.num_replacements << std::endl;
+    std::cout << "size of cache: \t\t\t" << stats.size << std::endl;
+    std::cout << "memory usage: \t\t\t" << stats.memory_usage << " bytes" << std::endl;
+    if( live_write_ )
+    {
+      std::cout << "num journal writes: \t\t" << stats.num_journal_writes << std::endl;
+      std::cout << "num journal drops: \t\t" << stats.num_journal_drops << std::endl;
+    }
+  }
+
+private:
+
+  /**
+   * @brief Writes every solution of an entry as a "key value" line
+   */
+  struct EntryWriter
+  {
+    EntryWriter(std::ostream& stream) :
+      stream_(stream),
+      num_lines_(0)
+    {
+    }
+
+    void operator()(int64_t key, const CacheEntry& entry)
+    {
+      for (std::size_t i = 0; i < entry.num_solutions; ++i)
+      {
+        stream_ << key << " " << entry.solutions[i] << "\n";
+        ++num_lines_;
+      }
+    }
+
+    std::ostream& stream_;
+    int num_lines_;
+  };
+
+  /**
+   * @brief Adds the bin center of every key that has a solution to the nearest neighbour index
+   */
+  struct NearestIndexer
+  {
+    NearestIndexer(SimpleCache& cache) :
+      cache_(cache)
+    {
+    }
+
+    void operator()(int64_t key, const CacheEntry& entry)
+    {
+      double pose[7];
+      if( !entry.isNoSolution() && cache_.keyToPose(key, pose) )
+        cache_.nearest_.add(pose, key);
+    }
+
+    SimpleCache& cache_;
+  };
+
+  /**
+   * @brief Collects all entries into a table with the binary file layout
+   */
+  struct TableBuilder
+  {
+    TableBuilder(std::size_t size)
+    {
+      table_.reserve(size);
+    }
+
+    void operator()(int64_t key, const CacheEntry& entry)
+    {
+      table_.insert(key, entry);
+    }
+
+    CacheTable table_;
+  };
+
+  /**
+   * @brief Call visitor(key, entry) for every entry in whichever container is in use, followed by the
+   *        mapped entries that are not overridden by the containers. Each shard is locked while it is visited.
+   */
+  template <typename Visitor>
+  void forEachEntry(Visitor& visitor) const
+  {
+    std::size_t num_mapped_overrides = 0;
+    for (std::size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+      const CacheShard& shard = shards_[i];
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      num_mapped_overrides += shard.num_mapped_overrides;
+
+      if( storage_ == FLAT_HASH_STORAGE )
+      {
+        for(FlatHashMap<CacheEntry>::const_iterator it = shard.flat_cache.begin(); it != shard.flat_cache.end(); ++it)
+          visitor(it->key, it->value);
+      }
+      else
+      {
+        for(std::map<int64_t, CacheEntry>::const_iterator it = shard.cache.begin(); it != shard.cache.end(); ++it)
+          visitor(it->first, it->second);
+      }
+    }
+
+    for(CacheTable::const_iterator it = mapped_.begin(); it != mapped_.end(); ++it)
+    {
+      if( num_mapped_overrides == 0 )
+      {
+        visitor(it->key, it->value);
+        continue;
+      }
+
+      const CacheShard& shard = getShard(it->key);
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      if( !findInContainer(shard, it->key) )
+        visitor(it->key, it->value);
+    }
+  }
+
+  /**
+   * @brief Map a binary cache file written with the same settings as this cache
+   * @param path location of file
+   * @return true if the file is in use
+   */
+  bool readBinaryFile(const std::string& path)
+  {
+    clearShards();
+
+    if( !mapped_.open(path) )
+      return false;
+
+    const CacheFileSettings settings = getFileSettings();
+    if( memcmp(&mapped_.getHeader().settings, &settings, sizeof(settings)) != 0 )
+    {
+      ROS_ERROR_STREAM_NAMED("cache","Binary cache file " << path << " was written with different joint count, "
+                             << "ranges or key encoding than this cache, not using it");
+      mapped_.close();
+      return false;
+    }
+
+    ROS_INFO_STREAM_NAMED("cache","Mapped " << mapped_.size() << " keys from binary file " << path);
+
+    if( use_nearest_ )
+      rebuildNearest();
+
+    return true;
+  }
+
+  /**
+   * @brief Describe how keys and values are built, for binary file headers
+   */
+  CacheFileSettings getFileSettings() const
+  {
+    CacheFileSettings settings;
+    memset(&settings, 0, sizeof(settings)); // padding is compared too
+
+    settings.num_joints = num_joints_;
+    settings.encoding = encoding_;
+    settings.pose_keying = pose_keying_;
+    settings.joint_hi = joint_hi_;
+    settings.joint_low = joint_low_;
+    settings.pose_hi = pose_hi_;
+    settings.pose_low = pose_low_;
+
+    if( pose_keying_ == SE3_POSE_KEYS )
+      fillKeyLayout(se3_encoder_, settings.pose_layout);
+    else if( encoding_ == BITPACKED_ENCODING )
+      fillKeyLayout(pose_encoder_, settings.pose_layout);
+
+    if( encoding_ == BITPACKED_ENCODING )
+      fillKeyLayout(joint_encoder_, settings.joint_layout);
+
+    return settings;
+  }
+
+  static void fillKeyLayout(const BitPackedEncoder& encoder, CacheFileKeyLayout& layout)
+  {
+    layout.num_dims = std::min(encoder.getNumDimensions(), CACHE_FILE_MAX_DIMENSIONS);
+    for (std::size_t i = 0; i < layout.num_dims; ++i)
+    {
+      const KeyDimension dim = encoder.getDimension(i);
+      layout.bits[i] = dim.bits;
+      layout.low[i] = dim.low;
+      layout.high[i] = dim.high;
+    }
+  }
+
+  /**
+   * @brief Refill the nearest neighbour index from the keys in the cache. Poses are restored to the
+   *        center of their bins.
+   */
+  void rebuildNearest()
+  {
+    // The indexer adds to nearest_ directly, so the index lock is held for the whole walk over the shards
+    boost::unique_lock<boost::shared_mutex> lock(nearest_mutex_);
+    nearest_.clear();
+    NearestIndexer indexer(*this);
+    forEachEntry(indexer);
+    nearest_.rebuild();
+  }
+
+  /**
+   * @brief Shard that holds a key. Uses the top bits of the hash because the containers use the bottom bits.
+   */
+  CacheShard& getShard(int64_t key)
+  {
+    return shards_[hashKey(key) >> 58];
+  }
+
+  const CacheShard& getShard(int64_t key) const
+  {
+    return shards_[hashKey(key) >> 58];
+  }
+
+  /**
+   * @brief Empty the containers of all shards, the stats are kept
+   */
+  void clearShards()
+  {
+    for (std::size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shards_[i].mutex);
+      shards_[i].cache.clear();
+      shards_[i].flat_cache.clear();
+      shards_[i].num_mapped_overrides = 0;
+    }
+  }
+
+  std::size_t containerSize(const CacheShard& shard) const
+  {
+    return storage_ == FLAT_HASH_STORAGE ? shard.flat_cache.size() : shard.cache.size();
+  }
+
+  /**
+   * @brief Evict one entry of a shard with the CLOCK policy: the hand sweeps over the entries, clearing
+   *        reference bits, and evicts the first entry whose bit is already clear. The caller holds the
+   *        exclusive lock of the shard.
+   */
+  void evictOne(CacheShard& shard)
+  {
+    if( storage_ == FLAT_HASH_STORAGE )
+    {
+      FlatHashMap<CacheEntry>& table = shard.flat_cache;
+      const std::size_t capacity = table.capacity();
+
+      // After one full sweep every bit is clear, so two sweeps always find a victim
+      for (std::size_t n = 0; n < 2 * capacity; ++n)
+      {
+        const std::size_t i = std::size_t(shard.clock_hand) & (capacity - 1);
+        FlatHashMap<CacheEntry>::Slot& slot = table.getSlot(i);
+        if( slot.key != FlatHashMap<CacheEntry>::EMPTY_KEY )
+        {
+          if( !slot.value.referenced )
+          {
+            // The hand stays, erasing shifts a not yet inspected entry into this slot
+            evicted(shard, slot.key);
+            table.eraseSlot(i);
+            return;
+          }
+          slot.value.referenced = 0;
+        }
+        shard.clock_hand = (i + 1) & (capacity - 1);
+      }
+    }
+    else
+    {
+      std::map<int64_t,CacheEntry>& map = shard.cache;
+      std::map<int64_t,CacheEntry>::iterator it = map.lower_bound(shard.clock_hand);
+      for (std::size_t n = 0; n < 2 * map.size() + 1; ++n, ++it)
+      {
+        if( it == map.end() )
+          it = map.begin();
+        if( it->second.referenced )
+        {
+          it->second.referenced = 0;
+          continue;
+        }
+
+        evicted(shard, it->first);
+        std::map<int64_t,CacheEntry>::iterator next = it;
+        ++next;
+        shard.clock_hand = next == map.end() ? LLONG_MIN : next->first;
+        map.erase(it);
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Bookkeeping for an entry that is about to be evicted
+   */
+  void evicted(CacheShard& shard, int64_t key)
+  {
+    // The mapped entry of the key becomes visible again
+    if( mapped_.isOpen() && mapped_.find(key) )
+      --shard.num_mapped_overrides;
+
+    increment(shard.num_evictions);
+    evictions_since_rebuild_.fetch_add(1, boost::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Drop evicted keys from the nearest neighbour index once they make up a large part of it
    */
-  SimpleCache(int num_joints, bool verbose,
-              double joint_hi, double joint_low, double pose_hi,  double pose_low) :
-    num_joints_(num_joints),
-    verbose_(verbose),
-    joint_hi_(joint_hi),
-    joint_low_(joint_low),
-    pose_hi_(pose_hi),
-    pose_low_(pose_low),
-    live_write_(false),
-    num_matches_(0),
-    num_inserts_(0),
-    num_duplicate_inserts_(0),
-    num_nosolutions_inserts_(0),
-    num_nosolutions_gets_(0),
-    num_errors_(0)
+  void rebuildNearestIfStale()
   {
+    if( !use_nearest_ || !max_entries_per_shard_ )
+      return;
+
+    std::size_t num_stale = evictions_since_rebuild_.load(boost::memory_order_relaxed);
+    const std::size_t threshold = std::max(std::size_t(1024), max_entries_per_shard_ * NUM_SHARDS / 2);
+    if( num_stale >= threshold &&
+        evictions_since_rebuild_.compare_exchange_strong(num_stale, 0, boost::memory_order_relaxed) )
+      rebuildNearest();
   }
 
   /**
-   * @brief Deconstructor - close append file if still open
+   * @brief Total of one stats counter over all shards
    */
-  ~SimpleCache()
+  unsigned int sumShardStat(boost::atomic<unsigned int> CacheShard::*counter) const
   {
-    // Only close file if we are in append mode
-    if( live_write_ )
-    {
-      ROS_INFO_STREAM_NAMED("cache","Closing append file...");
-      append_file_.close();
-    }
+    unsigned int total = 0;
+    for (std::size_t i = 0; i < NUM_SHARDS; ++i)
+      total += (shards_[i].*counter).load(boost::memory_order_relaxed);
+    return total;
   }
 
   /**
-   * @brief Write a cache to file
-   * @param path location of file
-   * @return true if write was successful
+   * @brief Count an event. Only the total matters, so no ordering with other memory is needed.
    */
-  bool writeFile(std::string path)
+  static void increment(boost::atomic<unsigned int>& counter)
   {
-    ROS_INFO_STREAM_NAMED("cache","Writing to file");
-    ros::Duration(3.0).sleep();
+    counter.fetch_add(1, boost::memory_order_relaxed);
+  }
 
-    int num_insertions = 0;
-    if (cache_.empty())
+  /**
+   * @brief Copy out the entry of a key, looking in the shard first and then in the mapped file
+   * @param shard the shard of key
+   * @param key input
+   * @param entry output
+   * @return false if not found
+   */
+  bool findEntry(const CacheShard& shard, int64_t key, CacheEntry& entry) const
+  {
     {
-      if(verbose_)
-        ROS_WARN_STREAM_NAMED("cache","Did not write to file because cache is empty");
-      return false;
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      const CacheEntry* found = findInContainer(shard, key);
+      if( found )
+      {
+        found->touch();
+        entry = *found;
+        return true;
+      }
     }
 
-    //FILE *file = fopen(path.c_str(), "w");
-    std::ofstream file;
-    file.open(path.c_str(), std::ios_base::out);
-
-    if (!file.is_open() || !file.good())
-    {
-      ROS_ERROR_STREAM_NAMED("cache","Error writing KDLC cache to disk.");
+    const CacheEntry* mapped_entry = mapped_.find(key);
+    if( !mapped_entry )
       return false;
-    }
-
-    // Write to file
-    for(std::map<int64_t, int64_t>::iterator it = cache_.begin(); it != cache_.end(); it++)
-    {
-      //fprintf(file, "%ld=%ld\n", it->first, it->second);
-      file << it->first << " " << it->second << std::endl;
-      num_insertions++;
-    }
-
-    //fclose(file);
-    file.close();
-
-    ROS_INFO_STREAM_NAMED("cache","Wrote " << num_insertions << " key value pairs to file");
-
-    // Sucess
+    entry = *mapped_entry;
     return true;
   }
 
   /**
-   * @brief open file for being appended to
-   * @param path location of file
+   * @brief Look up a key in whichever container of a shard is in use, ignoring the mapped file. The caller
+   *        holds the lock of the shard.
    */
-  void startAppend(std::string path)
+  const CacheEntry* findInContainer(const CacheShard& shard, int64_t key) const
   {
-    append_file_.open(path.c_str(), std::ios_base::app);
-
-    if (!append_file_.is_open() || !append_file_.good())
-    {
-      ROS_ERROR_STREAM_NAMED("cache","Error opening file for appending: " << path);
-      live_write_ = false;
-      return;
-    }
+    if( storage_ == FLAT_HASH_STORAGE )
+      return shard.flat_cache.find(key);
 
-    live_write_ = true;
+    std::map<int64_t,CacheEntry>::const_iterator it = shard.cache.find(key);
+    if( it == shard.cache.end() )
+      return NULL;
+    return &it->second;
   }
 
   /**
-   * @brief Load a cache from file
-   * @param path location of file
-   * @return true if read was successful
+   * @brief Find the entry of a key, adding an empty one if the key is not in the cache yet. The caller holds
+   *        the exclusive lock of the shard.
+   * @param shard the shard of key
+   * @param key input
+   * @param created output whether the entry is new
+   * @return the entry of the key. Invalidated by the next insertion into the shard.
    */
-  bool readFile(std::string path)
+  CacheEntry* findOrCreateEntry(CacheShard& shard, int64_t key, bool& created)
   {
-    if (access(path.c_str(), R_OK) < 0)
+    // Make room before inserting, so a full flat table never grows past the budget
+    if( max_entries_per_shard_ && containerSize(shard) >= max_entries_per_shard_ && !findInContainer(shard, key) )
+      evictOne(shard);
+
+    CacheEntry empty_entry = CacheEntry();
+
+    CacheEntry* entry;
+    if( storage_ == FLAT_HASH_STORAGE )
     {
-      ROS_WARN_STREAM_NAMED("cache","File not found: " << path);
-      return false;
+      std::pair<CacheEntry*, bool> result = shard.flat_cache.insert(key, empty_entry);
+      created = result.second;
+      entry = result.first;
     }
-
-    std::ifstream file(path.c_str());
-    //FILE *file = fopen(path.c_str(), "r");
-    if (!file.is_open())
+    else
     {
-      ROS_ERROR_STREAM_NAMED("cache","Error opening file " << path);
-      return false;
+      std::pair<std::map<int64_t,CacheEntry>::iterator, bool> result =
+        shard.cache.insert(std::make_pair(key, empty_entry));
+      created = result.second;
+      entry = &result.first->second;
     }
 
-    cache_.clear();
-
-    int num_insertions = 0;
-    int64_t key;
-    int64_t value;
-
-    while( file.good() )
+    // Copy on write from the mapped file
+    if( created && mapped_.isOpen() )
     {
-      file >> key >> value;
-
-      //ROS_INFO_STREAM_NAMED("cache","Read in " << key << "," << value);
-      // Add to cache
-      cache_[key] = value;
-
-      ++num_insertions;
+      const CacheEntry* mapped_entry = mapped_.find(key);
+      if( mapped_entry )
+      {
+        *entry = *mapped_entry;
+        created = false;
+        ++shard.num_mapped_overrides;
+      }
     }
+    return entry;
+  }
 
-    ROS_INFO_STREAM_NAMED("cache","Read " << num_insertions << " key value pairs into cache");
+  /**
+   * @brief Add a solution or failed search to the cache, as recorded in a journal, without any checks of the
+   *        value or stats. Follows the same rules as insert() so that replaying a journal rebuilds the same
+   *        entries.
+   */
+  void addRecord(const CacheJournalRecord& record)
+  {
+    CacheShard& shard = getShard(record.key);
+    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
 
-    // Sucess
-    return true;
+    bool created;
+    CacheEntry* entry = findOrCreateEntry(shard, record.key, created);
+    mergeRecord(shard, *entry, created, record);
   }
 
   /**
-   * @brief Add an IK solution to cache
-   * @param ik_pose the input key
-   * @param joint_values the input value
-   * @return results_t an enum of different status
+   * @brief Add an unscored solution of a text file, see addRecord()
    */
-  results_t insert(const geometry_msgs::Pose& ik_pose, const std::vector<double>& joint_values, bool no_solution = false)
+  void addSolution(int64_t key, int64_t value)
   {
-    // Error check
-    if( joint_values.size() != num_joints_ && !no_solution)
-    {
-      ROS_ERROR_STREAM_NAMED("cache","Mismatched solution size for joint values. Recieved " << joint_values.size()
-                             << " expected " << num_joints_);
-      ++num_errors_;
-      return FAILURE;
-    }
-
-    int64_t key = 0;
-    int64_t value = 0;
-    if(!poseToKey(ik_pose,key))
-    {
-      ++num_errors_;
-      return FAILURE;
-    }
+    CacheJournalRecord record = CacheJournalRecord();
+    record.key = key;
+    record.value = value;
+    addRecord(record);
+  }
 
-    // if no solution, set value to MAX VALUE
-    if(no_solution)
-    {
-      value = LLONG_MAX;
-      ++num_nosolutions_inserts_;
-    }
-    else if(!jointsToKey(joint_values,value))
-    {
-      ++num_errors_;
-      return FAILURE;
-    }
+  /**
+   * @brief Add a solution or failed search to the entry of its key, journal it and index its pose
+   * @param ik_pose pose of record.key, for the nearest neighbour index
+   * @param record what to add
+   * @return SUCCESS if the entry changed, DUPLICATE if not
+   */
+  results_t insertRecord(const geometry_msgs::Pose& ik_pose, const CacheJournalRecord& record)
+  {
+    CacheShard& shard = getShard(record.key);
 
-    // Check map for key
-    if(cache_.count( key ) == 1)
+    // Insert into cache, unless the key or this solution is already there
+    bool new_key;
     {
-      if(verbose_)
-        ROS_ERROR_STREAM_NAMED("cache","Key already in map! Prev: " << cache_[key] << " New: " << value);
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
 
-      // Check if previous one had a solution, out of curiosity
-      if( no_solution && cache_[key] != LLONG_MAX)
+      CacheEntry* entry = findOrCreateEntry(shard, record.key, new_key);
+      if( !new_key )
       {
-        ROS_ERROR_STREAM_NAMED("cache","Current solution is 'NOSOLUTION' but previous one had valid solution. Curious.");
+        entry->referenced = 1;
+
+        if(verbose_)
+          ROS_ERROR_STREAM_NAMED("cache","Key already in map! Prev: " << entry->solutions[0] << " New: " << record.value);
       }
 
-      ++num_duplicate_inserts_;
-      return DUPLICATE;
+      if( mergeRecord(shard, *entry, new_key, record) == DUPLICATE )
+      {
+        increment(shard.num_duplicate_inserts);
+        return DUPLICATE;
+      }
     }
+    increment(shard.num_inserts);
 
-    // Insert into cache
-    cache_[key] = value;
-    ++num_inserts_;
+    if( use_nearest_ && record.value != LLONG_MAX && new_key )
+    {
+      double pose[] = {ik_pose.position.x, ik_pose.position.y, ik_pose.position.z, ik_pose.orientation.x,
+                       ik_pose.orientation.y, ik_pose.orientation.z, ik_pose.orientation.w};
+      {
+        boost::unique_lock<boost::shared_mutex> lock(nearest_mutex_);
+        nearest_.add(pose, record.key);
+      }
+      rebuildNearestIfStale();
+    }
 
     // Save to file if necessary
     if( live_write_ )
-      fileAppend(key,value);
+      fileAppend(record);
 
     return SUCCESS;
   }
 
   /**
-   * @brief Get an IK solution from cache
-   * @param ik_pose the input key
-   * @param joint_values the returned ik seed
-   * @return results_t an enum of different status
+   * @brief Add a solution or failed search to an entry. The caller holds the exclusive lock of the shard.
+   * @param created whether the entry was just created and is still empty
+   * @param record the value, LLONG_MAX for a failed search, with its quality or the timeout and time of the failure
+   * @return SUCCESS if the entry changed, DUPLICATE if it did not
    */
-  results_t get(const geometry_msgs::Pose& ik_pose, std::vector<double>& joint_values)
+  results_t mergeRecord(CacheShard& shard, CacheEntry& entry, bool created, const CacheJournalRecord& record)
   {
-    // Convert ik_pose to key
-    int64_t key = 0;
-    if(!poseToKey(ik_pose,key))
+    const int64_t value = record.value;
+    const uint8_t quality = value == LLONG_MAX ? 0 : record.quality;
+
+    if( created )
     {
-      ++num_errors_;
-      return FAILURE;
+      entry.solutions[0] = value;
+      entry.qualities[0] = quality;
+      entry.num_solutions = 1;
+      if( value == LLONG_MAX )
+      {
+        entry.failures.timeout = record.timeout;
+        entry.failures.num_failures = 1;
+        entry.failures.expiry = getNoSolutionExpiry(1, record.time);
+      }
+      return SUCCESS;
     }
 
-    // Check map for key
-    if(cache_.count( key ) == 0)
+    if( value == LLONG_MAX )
     {
-      if(verbose_)
-        ROS_WARN_STREAM_NAMED("cache","get: No value found for key " << key);
+      // Check if previous one had a solution, out of curiosity
+      if( !entry.isNoSolution() )
+      {
+        ROS_ERROR_STREAM_NAMED("cache","Current solution is 'NOSOLUTION' but previous one had valid solution. Curious.");
+        return DUPLICATE;
+      }
 
-      return NOTFOUND;
+      // Failed again, be more confident there is no solution
+      CacheFailures& failures = entry.failures;
+      failures.timeout = std::max(failures.timeout, double(record.timeout));
+      if( failures.num_failures < UINT_MAX )
+        ++failures.num_failures;
+      failures.expiry = getNoSolutionExpiry(failures.num_failures, record.time);
+      return SUCCESS;
     }
 
-    // Get value in map
-    int64_t value = cache_[key];
-    ++num_matches_;
-
-    if(verbose_)
-      ROS_INFO_STREAM_NAMED("cache","get: found value " << value << " max is " << LLONG_MAX);
+    // Solved after all, e.g. with more time or a better seed
+    if( entry.isNoSolution() )
+    {
+      if( quality == 0 )
+        return DUPLICATE;
+      entry.solutions[0] = value;
+      entry.qualities[0] = quality;
+      increment(shard.num_replacements);
+      return SUCCESS;
+    }
 
-    // Check if key is at maximum value, if it is that means no solution was found
-    if(value == LLONG_MAX)
+    // Found again, keep the best score it was found with
+    const std::size_t index = entry.find(value);
+    if( index < entry.num_solutions )
     {
-      ++num_nosolutions_gets_;
-      return NOSOLUTION;
+      entry.qualities[index] = std::max(entry.qualities[index], quality);
+      return DUPLICATE;
     }
 
-    // Convert value to vector
-    if(!keyToJoints(value, joint_values))
+    if( entry.num_solutions < max_solutions_ )
     {
-      ++num_errors_;
-      return FAILURE;
+      entry.solutions[entry.num_solutions] = value;
+      entry.qualities[entry.num_solutions] = quality;
+      ++entry.num_solutions;
+      return SUCCESS;
     }
 
+    // Full bucket, a better solution takes the place of the worst one
+    const std::size_t worst = entry.findWorst();
+    if( quality <= entry.qualities[worst] )
+      return DUPLICATE;
+    entry.solutions[worst] = value;
+    entry.qualities[worst] = quality;
+    increment(shard.num_replacements);
     return SUCCESS;
   }
 
   /**
-   * @brief get size of cache (map)
-   * @return size of cache
+   * @brief Wall time until which a NOSOLUTION entry holds
+   * @param num_failures failed searches so far, at least 1
+   * @param time of the last failure, 0 if unknown
+   * @return 0 for never expiring
    */
-  size_t getSize()
+  double getNoSolutionExpiry(uint32_t num_failures, double time) const
   {
-    return cache_.size();
+    if( nosolution_ttl_ <= 0 || time <= 0 )
+      return 0;
+    return time + nosolution_ttl_ * double(1u << std::min(num_failures - 1, uint32_t(MAX_NOSOLUTION_DOUBLINGS)));
   }
 
   /**
-   * @brief output cache to console for debugging
+   * @brief Convert the solution of an entry that is closest to the seed into joint values
+   * @param entry input with at least one solution
+   * @param seed joint values to compare to, or empty to take the first solution
+   * @param joint_values output
+   * @return false if the solution could not be converted
    */
-  void printMap()
+  bool closestSolution(const CacheEntry& entry, const std::vector<double>& seed, std::vector<double>& joint_values)
   {
-    ROS_INFO_STREAM_NAMED("cache","Printing key value pairs in map: ---------------------------------------");
-    std::pair<int64_t,int64_t> keyvalue; // what a map<int, int> is made of
-    BOOST_FOREACH(keyvalue, cache_) {
-      std::cout << keyvalue.first << " " << keyvalue.second << "\n";
-    }
-  }
+    const std::size_t num_joints = num_joints_;
+    if( entry.num_solutions == 1 || seed.size() != num_joints )
+      return keyToJoints(entry.solutions[0], joint_values);
 
-  /**
-   * @brief output the number limits to consolte for debugging
-   */
-  void printLimits()
-  {
-    ROS_INFO_STREAM_NAMED("cache","Limits of numbers:");
-    std::cout << "joint_hi: " << joint_hi_ << std::endl;
-    std::cout << "joint_low: " << joint_low_ << std::endl;
-    std::cout << "pose_hi: " << pose_hi_ << std::endl;
-    std::cout << "pose_low: " << pose_low_ << std::endl;
-  }
+    double best_distance = std::numeric_limits<double>::max();
+    std::vector<double> candidate;
+    for (std::size_t i = 0; i < entry.num_solutions; ++i)
+    {
+      if( !keyToJoints(entry.solutions[i], candidate) )
+        return false;
 
-  /**
-   * @brief print out stats
-   */
-  void printStats()
-  {
-    ROS_INFO_STREAM_NAMED("cache","Stats");
-    std::cout << "num matches: \t\t\t" << num_matches_ << std::endl;
-    std::cout << "num inserts: \t\t\t" << num_inserts_ << std::endl;    
-    std::cout << "num duplicate inserts: \t\t" << num_duplicate_inserts_ << std::endl;
-    std::cout << "num nosolution inserts: \t" << num_nosolutions_inserts_ << std::endl;
-    std::cout << "num nosolution gets: \t\t" << num_nosolutions_gets_ << std::endl;
-    std::cout << "num errors: \t\t\t" << num_errors_ << std::endl;
-    std::cout << "size of cache: \t\t\t" << cache_.size() << std::endl;
-  }
+      double distance = 0;
+      for (std::size_t j = 0; j < num_joints; ++j)
+      {
+        double difference = candidate[j] - seed[j];
+        if( !continuous_joints_.empty() && continuous_joints_[j] )
+          difference -= 2.0 * M_PI * floor((difference + M_PI) / (2.0 * M_PI)); // into [-pi, pi)
+        distance += difference * difference;
+      }
 
-private:
+      if( distance < best_distance )
+      {
+        best_distance = distance;
+        joint_values.swap(candidate);
+      }
+    }
+    return true;
+  }
 
   /**
    * @brief save an insertion to disk
-   * @param key input
-   * @param value input
+   * @param record input
    */
-  void fileAppend(int64_t key, int64_t value)
+  void fileAppend(const CacheJournalRecord& record)
   {
-    // Make sure file is open first!
-    append_file_ << key << " " << value << std::endl;
+    // Only queues the record, the writer thread does the system calls
+    append_writer_.append(record);
   }
 
   /**
@@ -429,6 +1644,9 @@ private:
     double doubles[joint_size];
     std::copy( joint_values.begin(), joint_values.begin()+joint_size, doubles);
 
+    if( encoding_ == BITPACKED_ENCODING )
+      return joint_encoder_.encode(doubles, joint_size, key);
+
     if( !arrayToKey(doubles, joint_size, key, joint_low_, joint_hi_) )
       return false;
 
@@ -446,7 +1664,13 @@ private:
     double doubles[num_joints_];
 
     // Convert key to array
-    if( !keyToArray(key, num_joints_, doubles, joint_low_, joint_hi_) )
+    bool converted;
+    if( encoding_ == BITPACKED_ENCODING )
+      converted = joint_encoder_.decode(key, num_joints_, doubles);
+    else
+      converted = keyToArray(key, num_joints_, doubles, joint_low_, joint_hi_);
+
+    if( !converted )
     {
       // Failed to convert
       ROS_WARN_STREAM_NAMED("cache","Failed to convert value to array");
@@ -476,15 +1700,115 @@ private:
     if(verbose_)
       ROS_DEBUG_STREAM_NAMED("cache","Converting to 64 bit from pose:\n" << ik_pose );
 
+    if( pose_keying_ == SE3_POSE_KEYS )
+      return se3PoseToKey(ik_pose, key);
+
     static const int POSE_SIZE = 7;
     double doubles[] = {ik_pose.position.x, ik_pose.position.y, ik_pose.position.z, ik_pose.orientation.x,
                         ik_pose.orientation.y, ik_pose.orientation.z, ik_pose.orientation.w};
+
+    if( encoding_ == BITPACKED_ENCODING )
+    {
+      if( !pose_encoder_.encode<POSE_SIZE>(doubles, key) )
+      {
+        if(verbose_)
+          ROS_WARN_STREAM_NAMED("cache","Pose out of range, could not cache");
+        return false;
+      }
+      return true;
+    }
+
     if( !arrayToKey(doubles, POSE_SIZE, key, pose_low_, pose_hi_) )
       return false;
 
     return true;
   }
 
+  /**
+   * @brief Convert key value back to the center of its pose bin
+   * @param key input to be converted
+   * @param pose output x, y, z, qx, qy, qz, qw
+   * @return false if error occured
+   */
+  bool keyToPose(int64_t key, double pose[])
+  {
+    static const int POSE_SIZE = 7;
+    if( pose_keying_ == SE3_POSE_KEYS )
+    {
+      se3_encoder_.decode<6>(key, pose);
+
+      // w was dropped from the key because it is non negative and set by the unit norm
+      const double xyz_sq = pose[3]*pose[3] + pose[4]*pose[4] + pose[5]*pose[5];
+      pose[6] = sqrt(std::max(0.0, 1.0 - xyz_sq));
+      return true;
+    }
+
+    if( encoding_ == BITPACKED_ENCODING )
+    {
+      pose_encoder_.decode<POSE_SIZE>(key, pose);
+      return true;
+    }
+
+    if( !keyToArray(key, POSE_SIZE, pose, pose_low_, pose_hi_) )
+      return false;
+
+    // keyToArray gives the bottom of each bin
+    const double half_bin = fabs(pose_hi_ - pose_low_) / 200.0;
+    for (int i = 0; i < POSE_SIZE; ++i)
+      pose[i] += half_bin;
+    return true;
+  }
+
+  /**
+   * @brief Convert ik_pose to a key of position and canonical orientation
+   * @param ik_pose input to be converted
+   * @param key output value
+   * @return false if the position is outside the workspace or the quaternion is degenerate
+   */
+  bool se3PoseToKey(const geometry_msgs::Pose& ik_pose, int64_t& key)
+  {
+    const geometry_msgs::Quaternion& q = ik_pose.orientation;
+    const double norm = sqrt(q.x*q.x + q.y*q.y + q.z*q.z + q.w*q.w);
+    if( !(norm > 1e-9) )
+    {
+      if(verbose_)
+        ROS_WARN_STREAM_NAMED("cache","Degenerate quaternion, could not cache");
+      return false;
+    }
+
+    // q and -q are the same rotation, pick the one with w >= 0. When w is 0, the first non zero component
+    // decides so that the key is still unique.
+    double sign = 1.0 / norm;
+    if( q.w < 0 || (q.w == 0 && (q.x < 0 || (q.x == 0 && (q.y < 0 || (q.y == 0 && q.z < 0))))) )
+      sign = -sign;
+
+    double doubles[] = {ik_pose.position.x, ik_pose.position.y, ik_pose.position.z,
+                        q.x * sign, q.y * sign, q.z * sign};
+
+    // Components of a unit quaternion can reach 1.0 exactly, which the half open range excludes
+    for (std::size_t i = 3; i < 6; ++i)
+      doubles[i] = std::min(doubles[i], 1.0 - 1e-12);
+
+    if( !se3_encoder_.encode<6>(doubles, key) )
+    {
+      if(verbose_)
+        ROS_WARN_STREAM_NAMED("cache","Pose outside of cached workspace");
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Number of bits needed to tell apart num_bins values
+   */
+  static unsigned int bitsForBins(double num_bins)
+  {
+    unsigned int bits = 1;
+    while( bits < BitPackedEncoder::MAX_BITS && double(uint64_t(1) << bits) < num_bins )
+      ++bits;
+    return bits;
+  }
+
   /**
    * @brief Convert array of doubles to key value
    * @param doubles input to be converted
@@ -609,8 +1933,9 @@ private:
       return false; // this does not fit in cache
     }
 
-    // Translate x to be > 0
-    x = x + fabs(low);
+    // Translate x to be > 0. The same as adding fabs(low) for ranges around zero, and also right for ranges of
+    // joints whose limits are both positive
+    x = x - low;
 
     // Use the first decimal of x only
     x = (100.0*x)/fabs(high-low);
@@ -635,8 +1960,8 @@ private:
     // Scale back
     result = (result * fabs(high-low)) / 100.0;
 
-    // translate back to negative if necessary
-    result = result - fabs(low);
+    // translate back to the range
+    result = result + low;
 
     if(verbose_)
       ROS_DEBUG_STREAM_NAMED("cache","Converted " << x << " to " << result);
@@ -650,3 +1975,5 @@ typedef boost::shared_ptr<SimpleCache> SimpleCachePtr;
 typedef boost::shared_ptr<const SimpleCache> SimpleCacheConstPtr;
 
 } // namespace
+
+#endif
@@ -0,0 +1,287 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Solvers and scratch memory of one search, pooled so one plugin instance can serve many threads
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_SOLVER_CONTEXT_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_SOLVER_CONTEXT_
+
+// Boost
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+// KDL
+#include <kdl/chain.hpp>
+#include <kdl/jntarray.hpp>
+#include <kdl/chainiksolvervel_pinv.hpp>
+#include <kdl/chainiksolverpos_nr_jl.hpp>
+#include <kdl/chainfksolverpos_recursive.hpp>
+
+// C++
+#include <vector>
+#include <stdint.h>
+
+// Solvers
+#include "ik_solver_lm.h"
+
+namespace kdlc_kinematics_plugin
+{
+
+/**
+ * @brief Small and fast random number generator (splitmix64). Seeding is free, so every restart stream of a search
+ *        can start from a fixed seed and replay the same configurations.
+ */
+class RandomStream
+{
+public:
+
+  explicit RandomStream(uint64_t seed = 0, uint64_t stream = 0)
+  {
+    setSeed(seed, stream);
+  }
+
+  /**
+   * @brief Restart the sequence. Different streams of one seed give unrelated sequences.
+   */
+  void setSeed(uint64_t seed, uint64_t stream = 0)
+  {
+    state_ = seed;
+    state_ = next() + stream * 0x632be59bd9b4e019ULL;
+  }
+
+  uint64_t next()
+  {
+    uint64_t x = (state_ += 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  /**
+   * @brief Uniform in [0, 1), from the top 53 bits
+   */
+  double uniform01()
+  {
+    return double(next() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  double uniformReal(double low, double high)
+  {
+    return low + (high - low) * uniform01();
+  }
+
+private:
+
+  uint64_t state_;
+
+}; // end of class
+
+enum solver_backend_t
+{
+  NR_JL_BACKEND, // KDL::ChainIkSolverPos_NR_JL, Newton-Raphson with the pseudo inverse, clamped at the limits
+  LM_BACKEND // ChainIkSolverPos_LM_JL, damped least squares with adaptive damping
+};
+
+/**
+ * @brief Settings of the position solver of every context
+ */
+struct SolverOptions
+{
+  SolverOptions() :
+    backend(NR_JL_BACKEND),
+    max_iterations(500),
+    epsilon(1e-5)
+  {
+  }
+
+  solver_backend_t backend;
+  unsigned int max_iterations; // iterations per attempt
+  double epsilon; // convergence tolerance
+  std::vector<bool> continuous_joints; // joints that wrap around, only used by LM_BACKEND
+};
+
+/**
+ * @brief Everything a search or FK call writes to: the KDL solvers, scratch joint arrays and random stream. A
+ *        context is used by one thread at a time, so calls with different contexts can run concurrently.
+ */
+struct SolverContext
+{
+  SolverContext(const KDL::Chain& chain, const KDL::JntArray& joint_min, const KDL::JntArray& joint_max,
+                const SolverOptions& options, uint64_t seed) :
+    fk_solver(chain),
+    ik_solver_vel(chain),
+    jnt_seed_state(chain.getNrOfJoints()),
+    jnt_pos_in(chain.getNrOfJoints()),
+    jnt_pos_out(chain.getNrOfJoints()),
+    segment_frames(chain.getNrOfSegments() + 1),
+    random_stream(seed)
+  {
+    if( options.backend == LM_BACKEND )
+      ik_solver_pos.reset(new ChainIkSolverPos_LM_JL(chain, joint_min, joint_max, options.continuous_joints,
+                                                     options.max_iterations, options.epsilon));
+    else
+      ik_solver_pos.reset(new KDL::ChainIkSolverPos_NR_JL(chain, joint_min, joint_max, fk_solver, ik_solver_vel,
+                                                          options.max_iterations, options.epsilon));
+  }
+
+  KDL::ChainFkSolverPos_recursive fk_solver;
+  KDL::ChainIkSolverVel_pinv ik_solver_vel;
+  boost::scoped_ptr<KDL::ChainIkSolverPos> ik_solver_pos; // the NR_JL backend uses the two solvers above
+  KDL::JntArray jnt_seed_state, jnt_pos_in, jnt_pos_out;
+  std::vector<KDL::Frame> segment_frames; // frame of the base and of every segment tip, for FK of several links
+  std::vector<int> link_segments; // segment of every link of an FK request
+  RandomStream random_stream; // reseeded by searches that need reproducible restarts
+};
+
+typedef boost::shared_ptr<SolverContext> SolverContextPtr;
+
+/**
+ * @brief Free list of solver contexts of one chain. A context is created the first time no free one is left, so
+ *        the pool grows to the largest number of concurrent calls and then stops allocating.
+ */
+class SolverContextPool : boost::noncopyable
+{
+public:
+
+  /**
+   * @param chain copied, the solvers of every context refer to the copy
+   * @param joint_min lower joint limits of the chain
+   * @param joint_max upper joint limits of the chain
+   * @param options settings of the position solver
+   */
+  SolverContextPool(const KDL::Chain& chain, const KDL::JntArray& joint_min, const KDL::JntArray& joint_max,
+                    const SolverOptions& options) :
+    chain_(chain),
+    joint_min_(joint_min),
+    joint_max_(joint_max),
+    options_(options),
+    num_created_(0)
+  {
+  }
+
+  /**
+   * @brief Take a free context, or create one. The n-th context created has its random stream seeded with n.
+   */
+  SolverContextPtr acquire()
+  {
+    uint64_t seed;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if( !free_.empty() )
+      {
+        SolverContextPtr context = free_.back();
+        free_.pop_back();
+        return context;
+      }
+      seed = num_created_++;
+    }
+
+    // Building the solvers allocates, do it outside of the lock
+    return SolverContextPtr(new SolverContext(chain_, joint_min_, joint_max_, options_, seed));
+  }
+
+  /**
+   * @brief Hand a context from acquire() back to the pool
+   */
+  void release(const SolverContextPtr& context)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    free_.push_back(context);
+  }
+
+  /**
+   * @brief Number of contexts created so far, the peak number of concurrent users
+   */
+  std::size_t getNumCreated() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return num_created_;
+  }
+
+private:
+
+  const KDL::Chain chain_;
+  const KDL::JntArray joint_min_, joint_max_;
+  const SolverOptions options_;
+
+  mutable boost::mutex mutex_;
+  std::vector<SolverContextPtr> free_;
+  std::size_t num_created_;
+
+}; // end of class
+
+typedef boost::shared_ptr<SolverContextPool> SolverContextPoolPtr;
+
+/**
+ * @brief A context of a pool for the lifetime of this object
+ */
+class ScopedSolverContext : boost::noncopyable
+{
+public:
+
+  explicit ScopedSolverContext(SolverContextPool& pool) :
+    pool_(pool),
+    context_(pool.acquire())
+  {
+  }
+
+  ~ScopedSolverContext()
+  {
+    pool_.release(context_);
+  }
+
+  SolverContext& operator*() const
+  {
+    return *context_;
+  }
+
+  SolverContext* operator->() const
+  {
+    return context_.get();
+  }
+
+private:
+
+  SolverContextPool& pool_;
+  SolverContextPtr context_;
+
+}; // end of class
+
+} // namespace
+
+#endif
@@ -0,0 +1,178 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Fixed set of threads that run the items of a parallel loop
+*/
+
+#ifndef MOVEIT_KDLC_KINEMATICS_PLUGIN_WORKER_POOL_
+#define MOVEIT_KDLC_KINEMATICS_PLUGIN_WORKER_POOL_
+
+// Boost
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+
+// C++
+#include <cstddef>
+#include <stdint.h>
+
+namespace kdlc_kinematics_plugin
+{
+
+/**
+ * @brief Runs fn(item, worker) for every item of a loop on a fixed set of threads. Items are handed out one at a
+ *        time from a shared counter, so slow items do not hold up a whole slice of the loop. Every worker has a
+ *        fixed index below getNumWorkers(), which lets callers give each one its own solvers and scratch memory
+ *        without locking. The calling thread is worker 0, so a pool of one worker spawns no threads at all.
+ */
+class WorkerPool
+{
+public:
+
+  typedef boost::function<void(std::size_t item, std::size_t worker)> ItemFn;
+
+  /**
+   * @param num_workers number of threads working on a loop, including the caller of parallelFor()
+   */
+  explicit WorkerPool(std::size_t num_workers) :
+    next_item_(0),
+    num_items_(0),
+    fn_(NULL),
+    num_busy_(0),
+    generation_(0),
+    stopping_(false)
+  {
+    for (std::size_t worker = 1; worker < num_workers; ++worker)
+      threads_.create_thread(boost::bind(&WorkerPool::run, this, worker));
+  }
+
+  ~WorkerPool()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    threads_.join_all();
+  }
+
+  std::size_t getNumWorkers() const
+  {
+    return threads_.size() + 1;
+  }
+
+  /**
+   * @brief Call fn for every item in [0, num_items) and return once all calls finished. Loops from several
+   *        threads run one after another. fn must not throw and must not call parallelFor() on the same pool.
+   */
+  void parallelFor(std::size_t num_items, const ItemFn& fn)
+  {
+    boost::mutex::scoped_lock loop_lock(loop_mutex_);
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      fn_ = &fn;
+      num_items_ = num_items;
+      next_item_.store(0, boost::memory_order_relaxed);
+      num_busy_ = threads_.size();
+      ++generation_;
+    }
+    wake_.notify_all();
+
+    runItems(0);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    while( num_busy_ > 0 )
+      done_.wait(lock);
+    fn_ = NULL;
+  }
+
+private:
+
+  void run(std::size_t worker)
+  {
+    uint64_t generation = 0;
+    while( true )
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while( !stopping_ && generation_ == generation )
+          wake_.wait(lock);
+        if( stopping_ )
+          return;
+        generation = generation_;
+      }
+
+      runItems(worker);
+
+      boost::mutex::scoped_lock lock(mutex_);
+      if( --num_busy_ == 0 )
+        done_.notify_all();
+    }
+  }
+
+  void runItems(std::size_t worker)
+  {
+    for (std::size_t item = next_item_.fetch_add(1, boost::memory_order_relaxed); item < num_items_;
+         item = next_item_.fetch_add(1, boost::memory_order_relaxed))
+    {
+      (*fn_)(item, worker);
+    }
+  }
+
+  boost::thread_group threads_;
+
+  boost::atomic<std::size_t> next_item_; // next item of the current loop to hand out
+
+  // Current loop, only changed while no worker is running it
+  std::size_t num_items_;
+  const ItemFn* fn_;
+
+  boost::mutex loop_mutex_; // held for a whole loop
+  boost::mutex mutex_; // protects the fields below
+  boost::condition_variable wake_, done_;
+  std::size_t num_busy_; // threads still working on the current loop
+  uint64_t generation_; // incremented for every loop so threads notice a new one
+  bool stopping_;
+
+}; // end of class
+
+typedef boost::shared_ptr<WorkerPool> WorkerPoolPtr;
+
+} // namespace
+
+#endif
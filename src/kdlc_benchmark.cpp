@@ -0,0 +1,631 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   End-to-end IK and FK latency benchmark of the plugin on synthetic arms, runs without a ROS master
+*/
+
+#include <moveit/kdlc_kinematics_plugin/kdlc_kinematics_plugin.h>
+#include <moveit/kdlc_kinematics_plugin/cache_metrics.h>
+#include <moveit/kdlc_kinematics_plugin/batch_fk.h>
+#include <moveit/rdf_loader/rdf_loader.h>
+#include <kdl_parser/kdl_parser.hpp>
+#include <kdl/chainfksolverpos_recursive.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real.hpp>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h> // setenv, mkdtemp, strtoul, atoi, atof
+#include <string.h> // strcmp
+#include <math.h>
+
+#ifndef KDLC_BENCHMARK_DIR
+#define KDLC_BENCHMARK_DIR "benchmark"
+#endif
+
+namespace kdlc_benchmark
+{
+
+void printUsage(const char* program)
+{
+  std::cout << "Usage: " << program << " [options]\n"
+            << "Options:\n"
+            << "  --robot-dir DIR   directory of the synthetic_*dof.urdf/.srdf files, default " KDLC_BENCHMARK_DIR "\n"
+            << "  --output FILE     write the JSON results to FILE instead of stdout\n"
+            << "  --queries N       IK queries per pose class, default 200\n"
+            << "  --timeout T       timeout of each IK query in seconds, default 0.1\n"
+            << "  --seed S          seed of the sampled configurations, default 1\n"
+            << "No ROS master is needed, parameters of a running master are used if there is one. The caches are\n"
+            << "kept in a temporary directory that is removed at the end. The exit code is 1 if batched FK does not\n"
+            << "match the KDL solver on any robot.\n";
+}
+
+/**
+ * @brief A robot of the benchmark, loaded from <name>.urdf and <name>.srdf
+ */
+struct RobotSpec
+{
+  RobotSpec(const std::string& name_in, const std::string& group_in, const std::string& base_in,
+            const std::string& tip_in) :
+    name(name_in),
+    group(group_in),
+    base(base_in),
+    tip(tip_in)
+  {
+  }
+
+  std::string name;
+  std::string group;
+  std::string base;
+  std::string tip;
+};
+
+struct Options
+{
+  Options() :
+    robot_dir(KDLC_BENCHMARK_DIR),
+    num_queries(200),
+    timeout(0.1),
+    seed(1)
+  {
+  }
+
+  std::string robot_dir;
+  std::string output;
+  unsigned int num_queries;
+  double timeout;
+  uint32_t seed;
+};
+
+/**
+ * @brief Latencies of one class of queries, with exact percentiles
+ */
+class LatencySamples
+{
+public:
+
+  LatencySamples() :
+    num_solved_(0)
+  {
+  }
+
+  void record(double seconds, bool solved)
+  {
+    samples_.push_back(seconds);
+    if( solved )
+      ++num_solved_;
+  }
+
+  /**
+   * @brief Nearest rank percentile in milliseconds
+   * @param fraction between 0 and 1, e.g. 0.99
+   */
+  double getPercentile(double fraction) const
+  {
+    if( samples_.empty() )
+      return 0.0;
+
+    std::vector<double> sorted(samples_);
+    std::sort(sorted.begin(), sorted.end());
+    const std::size_t rank = std::size_t(ceil(fraction * sorted.size()));
+    return 1000.0 * sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+  }
+
+  void writeJson(std::ostream& stream) const
+  {
+    double total = 0.0;
+    for (std::size_t i = 0; i < samples_.size(); ++i)
+      total += samples_[i];
+    const double mean = samples_.empty() ? 0.0 : 1000.0 * total / samples_.size();
+
+    stream << "{\"count\": " << samples_.size() << ", \"solved\": " << num_solved_ << ", \"mean_ms\": " << mean
+           << ", \"p50_ms\": " << getPercentile(0.5) << ", \"p99_ms\": " << getPercentile(0.99)
+           << ", \"max_ms\": " << getPercentile(1.0) << "}";
+  }
+
+private:
+
+  std::vector<double> samples_;
+  std::size_t num_solved_;
+};
+
+bool readFile(const std::string& path, std::string& contents)
+{
+  std::ifstream file(path.c_str());
+  if( !file )
+    return false;
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  contents = buffer.str();
+  return true;
+}
+
+/**
+ * @brief Random configurations within the limits of a group
+ */
+class ConfigurationSampler
+{
+public:
+
+  ConfigurationSampler(const std::vector<moveit_msgs::JointLimits>& limits, uint32_t seed) :
+    limits_(limits),
+    generator_(seed),
+    unit_(0.0, 1.0)
+  {
+  }
+
+  void sample(std::vector<double>& values)
+  {
+    values.resize(limits_.size());
+    for (std::size_t j = 0; j < limits_.size(); ++j)
+      values[j] = limits_[j].min_position + unit_(generator_) * (limits_[j].max_position - limits_[j].min_position);
+  }
+
+  /**
+   * @brief Move every joint of values by up to +-delta, staying within the limits
+   */
+  void perturb(const std::vector<double>& values, double delta, std::vector<double>& result)
+  {
+    result.resize(values.size());
+    for (std::size_t j = 0; j < values.size(); ++j)
+    {
+      const double value = values[j] + (2.0 * unit_(generator_) - 1.0) * delta;
+      result[j] = std::max(limits_[j].min_position, std::min(limits_[j].max_position, value));
+    }
+  }
+
+  double uniform01()
+  {
+    return unit_(generator_);
+  }
+
+private:
+
+  std::vector<moveit_msgs::JointLimits> limits_;
+  boost::mt19937 generator_;
+  boost::uniform_real<double> unit_;
+};
+
+/**
+ * @brief Time searchPositionIK() on every pose, each with its own seed
+ */
+void timeSearches(const kdlc_kinematics_plugin::KDLCKinematicsPlugin& solver,
+                  const std::vector<geometry_msgs::Pose>& poses,
+                  const std::vector<std::vector<double> >& seeds, double timeout, LatencySamples& latencies)
+{
+  std::vector<double> solution;
+  moveit_msgs::MoveItErrorCodes error_code;
+  for (std::size_t i = 0; i < poses.size(); ++i)
+  {
+    const ros::WallTime start = ros::WallTime::now();
+    const bool solved = solver.searchPositionIK(poses[i], seeds[i], timeout, solution, error_code);
+    latencies.record((ros::WallTime::now() - start).toSec(), solved);
+  }
+}
+
+/**
+ * @brief Run single attempts of one position solver backend from random seeds and count how they end
+ * @param chain chain of the robot
+ * @param joint_min lower joint limits
+ * @param joint_max upper joint limits
+ * @param options settings of the solver, including the backend
+ * @param goals goal frames
+ * @param seeds start configuration of every goal
+ * @param json output, the counts as a JSON object
+ */
+void countBackendResults(const KDL::Chain& chain, const KDL::JntArray& joint_min, const KDL::JntArray& joint_max,
+                         const kdlc_kinematics_plugin::SolverOptions& options, const std::vector<KDL::Frame>& goals,
+                         const std::vector<KDL::JntArray>& seeds, std::ostream& json)
+{
+  kdlc_kinematics_plugin::SolverContext context(chain, joint_min, joint_max, options, 0);
+
+  std::size_t num_converged = 0;
+  std::size_t num_stalled = 0;
+  std::size_t num_not_converged = 0;
+  const ros::WallTime start = ros::WallTime::now();
+  for (std::size_t i = 0; i < goals.size(); ++i)
+  {
+    const int result = context.ik_solver_pos->CartToJnt(seeds[i], goals[i], context.jnt_pos_out);
+    if( result >= 0 )
+      ++num_converged;
+    else if( options.backend == kdlc_kinematics_plugin::LM_BACKEND &&
+             result == kdlc_kinematics_plugin::ChainIkSolverPos_LM_JL::E_STALLED )
+      ++num_stalled;
+    else
+      ++num_not_converged;
+  }
+  const double duration = (ros::WallTime::now() - start).toSec();
+
+  json << "{\"attempts\": " << goals.size() << ", \"converged\": " << num_converged << ", \"stalled\": "
+       << num_stalled << ", \"not_converged\": " << num_not_converged << ", \"mean_attempt_ms\": "
+       << (goals.empty() ? 0.0 : 1000.0 * duration / goals.size()) << "}";
+}
+
+/**
+ * @brief Compare the batched FK kernel with ChainFkSolverPos_recursive on random configurations. Batches of
+ *        every size up to a few groups of lanes are checked, so partly filled groups are covered as well.
+ * @param chain chain of the robot
+ * @param sampler configurations within the limits of the chain
+ * @param num_configs configurations of the largest batch
+ * @param json output, the check as a JSON object
+ * @return true if every frame matched to within BATCH_FK_TOLERANCE
+ */
+bool checkBatchFK(const KDL::Chain& chain, ConfigurationSampler& sampler, std::size_t num_configs,
+                  std::ostream& json)
+{
+  static const double BATCH_FK_TOLERANCE = 1e-9;
+
+  const kdlc_kinematics_plugin::BatchFK batch_fk(chain);
+  KDL::ChainFkSolverPos_recursive fk_solver(chain);
+  const std::size_t dof = batch_fk.getNumJoints();
+  const std::size_t max_small_batch = 3 * kdlc_kinematics_plugin::BatchFK::LANES;
+
+  std::size_t num_checked = 0;
+  double max_error = 0.0;
+  bool passed = batch_fk.isValid();
+  std::vector<double> config, joint_batch;
+  std::vector<KDL::Frame> frames;
+  KDL::JntArray jnt_array(dof);
+  KDL::Frame expected;
+  for (std::size_t batch_size = 1; passed && batch_size <= max_small_batch + 1; ++batch_size)
+  {
+    // The last batch is a large one with a partly filled last group
+    const std::size_t num_batch = batch_size <= max_small_batch ? batch_size :
+      std::max(max_small_batch, num_configs) | 1;
+
+    std::vector<std::vector<double> > configs(num_batch);
+    joint_batch.resize(dof * num_batch);
+    for (std::size_t c = 0; c < num_batch; ++c)
+    {
+      sampler.sample(configs[c]);
+      for (std::size_t j = 0; j < dof; ++j)
+        joint_batch[j * num_batch + c] = configs[c][j];
+    }
+    batch_fk.computeTipFrames(joint_batch, num_batch, frames);
+
+    for (std::size_t c = 0; c < num_batch; ++c)
+    {
+      for (std::size_t j = 0; j < dof; ++j)
+        jnt_array(j) = configs[c][j];
+      if( fk_solver.JntToCart(jnt_array, expected) < 0 )
+      {
+        passed = false;
+        break;
+      }
+      for (int i = 0; i < 3; ++i)
+      {
+        max_error = std::max(max_error, fabs(frames[c].p(i) - expected.p(i)));
+        for (int k = 0; k < 3; ++k)
+          max_error = std::max(max_error, fabs(frames[c].M(i, k) - expected.M(i, k)));
+      }
+      ++num_checked;
+    }
+  }
+  passed = passed && max_error <= BATCH_FK_TOLERANCE;
+
+  if( !passed )
+    ROS_ERROR_STREAM_NAMED("benchmark","Batched FK differs from the KDL solver by up to " << max_error
+                           << (batch_fk.isValid() ? "" : ", the kernel does not support this chain"));
+
+  json << "{\"configs\": " << num_checked << ", \"max_error\": " << max_error << ", \"tolerance\": "
+       << BATCH_FK_TOLERANCE << ", \"passed\": " << (passed ? "true" : "false") << "}";
+  return passed;
+}
+
+/**
+ * @brief Run all IK and FK measurements on one robot and write its JSON object
+ * @param checks_passed set to false if batched FK does not match the KDL solver
+ * @return false if the robot could not be loaded
+ */
+bool benchmarkRobot(const RobotSpec& spec, const Options& options, std::ostream& json, bool& checks_passed)
+{
+  std::string urdf_string, srdf_string;
+  const std::string prefix = options.robot_dir + "/" + spec.name;
+  if( !readFile(prefix + ".urdf", urdf_string) || !readFile(prefix + ".srdf", srdf_string) )
+  {
+    ROS_ERROR_STREAM_NAMED("benchmark","Could not read " << prefix << ".urdf and .srdf");
+    return false;
+  }
+
+  rdf_loader::RDFLoader rdf_loader(urdf_string, srdf_string);
+  const boost::shared_ptr<urdf::ModelInterface>& urdf_model = rdf_loader.getURDF();
+  const boost::shared_ptr<srdf::Model>& srdf = rdf_loader.getSRDF();
+
+  kdlc_kinematics_plugin::KDLCKinematicsPlugin solver;
+  if( !solver.initialize("kdlc_benchmark/" + spec.name, urdf_model, srdf, spec.group, spec.base, spec.tip, 0.01) )
+    return false;
+
+  // Limits for sampling and the reach of the chain for unreachable goals
+  const robot_model::RobotModel kinematic_model(urdf_model, srdf);
+  const std::vector<moveit_msgs::JointLimits> limits =
+    kinematic_model.getJointModelGroup(spec.group)->getVariableLimits();
+  KDL::Tree kdl_tree;
+  KDL::Chain kdl_chain;
+  if( !kdl_parser::treeFromUrdfModel(*urdf_model, kdl_tree) || !kdl_tree.getChain(spec.base, spec.tip, kdl_chain) )
+  {
+    ROS_ERROR_STREAM_NAMED("benchmark","Could not build the chain of " << spec.name);
+    return false;
+  }
+  KDL::JntArray joint_min(limits.size()), joint_max(limits.size());
+  for (std::size_t j = 0; j < limits.size(); ++j)
+  {
+    joint_min(j) = limits[j].min_position;
+    joint_max(j) = limits[j].max_position;
+  }
+  const double reach = kdlc_kinematics_plugin::KDLCKinematicsPlugin::getChainReach(kdl_chain, joint_min, joint_max);
+
+  ConfigurationSampler sampler(limits, options.seed);
+  const std::vector<std::string> tip_names(1, spec.tip);
+  const std::size_t num_queries = options.num_queries;
+
+  // Goal poses are FK of sampled configurations, so they are reachable
+  std::vector<std::vector<double> > configs(num_queries), seeds(num_queries);
+  std::vector<geometry_msgs::Pose> poses(num_queries), tip_pose(1);
+  for (std::size_t i = 0; i < num_queries; ++i)
+  {
+    sampler.sample(configs[i]);
+    sampler.sample(seeds[i]);
+    solver.getPositionFK(tip_names, configs[i], tip_pose);
+    poses[i] = tip_pose[0];
+  }
+
+  // Cold: empty cache, unrelated seeds. Every solution is cached on the way.
+  LatencySamples cold;
+  timeSearches(solver, poses, seeds, options.timeout, cold);
+
+  // Cache hit: the same goals again, from new unrelated seeds
+  LatencySamples cache_hit;
+  for (std::size_t i = 0; i < num_queries; ++i)
+    sampler.sample(seeds[i]);
+  timeSearches(solver, poses, seeds, options.timeout, cache_hit);
+
+  // Near miss: goals a few mrad of joint motion away from cached ones, usually in another key
+  LatencySamples near_miss;
+  std::vector<geometry_msgs::Pose> near_poses(num_queries);
+  std::vector<double> near_config;
+  for (std::size_t i = 0; i < num_queries; ++i)
+  {
+    sampler.perturb(configs[i], 0.01, near_config);
+    solver.getPositionFK(tip_names, near_config, tip_pose);
+    near_poses[i] = tip_pose[0];
+  }
+  timeSearches(solver, near_poses, seeds, options.timeout, near_miss);
+
+  // Warm: new goals seeded close to their answer, as when tracking a trajectory
+  LatencySamples warm;
+  for (std::size_t i = 0; i < num_queries; ++i)
+  {
+    sampler.sample(configs[i]);
+    sampler.perturb(configs[i], 0.05, seeds[i]);
+    solver.getPositionFK(tip_names, configs[i], tip_pose);
+    poses[i] = tip_pose[0];
+  }
+  timeSearches(solver, poses, seeds, options.timeout, warm);
+
+  // Unreachable: beyond the reach of the chain, every query runs until its timeout
+  LatencySamples unreachable;
+  const std::size_t num_unreachable = std::max<std::size_t>(1, num_queries / 10);
+  std::vector<geometry_msgs::Pose> far_poses(num_unreachable);
+  for (std::size_t i = 0; i < num_unreachable; ++i)
+  {
+    const double azimuth = 2.0 * M_PI * sampler.uniform01();
+    const double distance = 2.0 * reach + 1.0;
+    far_poses[i].position.x = distance * cos(azimuth);
+    far_poses[i].position.y = distance * sin(azimuth);
+    far_poses[i].position.z = 0.5 * reach;
+    far_poses[i].orientation.w = 1.0;
+  }
+  seeds.resize(num_unreachable);
+  timeSearches(solver, far_poses, seeds, options.timeout, unreachable);
+
+  // Single attempts of both solver backends on the same goals and seeds, without the cache and restarts.
+  // Continuous joints are the revolute joints without position limits.
+  kdlc_kinematics_plugin::SolverOptions solver_options;
+  solver_options.continuous_joints.assign(limits.size(), false);
+  const std::vector<const robot_model::JointModel*>& joint_models =
+    kinematic_model.getJointModelGroup(spec.group)->getJointModels();
+  for (std::size_t j = 0; j < limits.size(); ++j)
+  {
+    for (std::size_t m = 0; m < joint_models.size(); ++m)
+    {
+      const robot_model::RevoluteJointModel* revolute =
+        dynamic_cast<const robot_model::RevoluteJointModel*>(joint_models[m]);
+      if( revolute && revolute->isContinuous() && revolute->getName() == limits[j].joint_name )
+        solver_options.continuous_joints[j] = true;
+    }
+  }
+
+  KDL::ChainFkSolverPos_recursive fk_solver(kdl_chain);
+  std::vector<KDL::Frame> backend_goals(num_queries);
+  std::vector<KDL::JntArray> backend_seeds(num_queries, KDL::JntArray(limits.size()));
+  KDL::JntArray goal_config(limits.size());
+  std::vector<double> values;
+  for (std::size_t i = 0; i < num_queries; ++i)
+  {
+    sampler.sample(values);
+    for (std::size_t j = 0; j < values.size(); ++j)
+      goal_config(j) = values[j];
+    fk_solver.JntToCart(goal_config, backend_goals[i]);
+    sampler.sample(values);
+    for (std::size_t j = 0; j < values.size(); ++j)
+      backend_seeds[i](j) = values[j];
+  }
+
+  std::stringstream nr_jl_results, lm_results;
+  solver_options.backend = kdlc_kinematics_plugin::NR_JL_BACKEND;
+  countBackendResults(kdl_chain, joint_min, joint_max, solver_options, backend_goals, backend_seeds, nr_jl_results);
+  solver_options.backend = kdlc_kinematics_plugin::LM_BACKEND;
+  countBackendResults(kdl_chain, joint_min, joint_max, solver_options, backend_goals, backend_seeds, lm_results);
+
+  // FK throughput, cycling through the sampled configurations
+  const std::size_t num_fk = std::max<std::size_t>(1000, 50 * num_queries);
+  ros::WallTime start = ros::WallTime::now();
+  for (std::size_t i = 0; i < num_fk; ++i)
+    solver.getPositionFK(tip_names, configs[i % num_queries], tip_pose);
+  const double tip_rate = num_fk / (ros::WallTime::now() - start).toSec();
+
+  const std::vector<std::string>& link_names =
+    kinematic_model.getJointModelGroup(spec.group)->getLinkModelNames();
+  std::vector<geometry_msgs::Pose> link_poses(link_names.size());
+  start = ros::WallTime::now();
+  for (std::size_t i = 0; i < num_fk; ++i)
+    solver.getPositionFK(link_names, configs[i % num_queries], link_poses);
+  const double links_rate = num_fk / (ros::WallTime::now() - start).toSec();
+
+  // Batched FK over the same configurations in structure of arrays layout
+  const std::size_t dof = limits.size();
+  std::vector<double> joint_batch(dof * num_queries);
+  for (std::size_t c = 0; c < num_queries; ++c)
+    for (std::size_t j = 0; j < dof; ++j)
+      joint_batch[j * num_queries + c] = configs[c][j];
+  std::vector<geometry_msgs::Pose> batch_poses;
+  const std::size_t num_batches = std::max<std::size_t>(1, num_fk / num_queries);
+  start = ros::WallTime::now();
+  for (std::size_t i = 0; i < num_batches; ++i)
+    solver.getPositionFKBatch(joint_batch, num_queries, batch_poses);
+  const double batch_rate = num_batches * num_queries / (ros::WallTime::now() - start).toSec();
+
+  std::stringstream batch_check;
+  if( !checkBatchFK(kdl_chain, sampler, num_queries, batch_check) )
+    checks_passed = false;
+
+  json << "    {\"name\": ";
+  simple_cache::writeJsonString(json, spec.name);
+  json << ", \"dof\": " << dof << ",\n"
+       << "     \"ik\": {\n      \"cold\": ";
+  cold.writeJson(json);
+  json << ",\n      \"warm\": ";
+  warm.writeJson(json);
+  json << ",\n      \"cache_hit\": ";
+  cache_hit.writeJson(json);
+  json << ",\n      \"near_miss\": ";
+  near_miss.writeJson(json);
+  json << ",\n      \"unreachable\": ";
+  unreachable.writeJson(json);
+  json << "},\n     \"solver_backends\": {\"kdl_nr_jl\": " << nr_jl_results.str() << ",\n                         \"lm\": "
+       << lm_results.str() << "},\n     \"fk\": {\"tip_calls_per_s\": " << tip_rate << ", \"all_links_calls_per_s\": " << links_rate
+       << ", \"link_count\": " << link_names.size() << ", \"batch_configs_per_s\": " << batch_rate
+       << ",\n            \"batch_check\": " << batch_check.str() << "}}";
+  return true;
+}
+
+} // end namespace
+
+int main(int argc, char *argv[])
+{
+  // Without a master, parameter lookups fail right away and the plugin uses its defaults. Publishing to rosout
+  // would wait for a master, so it is off.
+  setenv("ROS_MASTER_URI", "http://localhost:11311", 0);
+
+  // Keep the caches of this run away from the real ones
+  char cache_home[] = "/tmp/kdlc_benchmark_XXXXXX";
+  if( !mkdtemp(cache_home) )
+  {
+    std::cerr << "Could not create a temporary directory" << std::endl;
+    return 1;
+  }
+  setenv("ROS_HOME", cache_home, 1);
+
+  ros::init(argc, argv, "kdlc_benchmark", ros::init_options::NoRosout | ros::init_options::AnonymousName);
+
+  kdlc_benchmark::Options options;
+  for (int i = 1; i < argc; ++i)
+  {
+    if( strcmp(argv[i], "--robot-dir") == 0 && i + 1 < argc )
+    {
+      options.robot_dir = argv[++i];
+    }
+    else if( strcmp(argv[i], "--output") == 0 && i + 1 < argc )
+    {
+      options.output = argv[++i];
+    }
+    else if( strcmp(argv[i], "--queries") == 0 && i + 1 < argc )
+    {
+      options.num_queries = std::max(1, atoi(argv[++i]));
+    }
+    else if( strcmp(argv[i], "--timeout") == 0 && i + 1 < argc )
+    {
+      options.timeout = atof(argv[++i]);
+    }
+    else if( strcmp(argv[i], "--seed") == 0 && i + 1 < argc )
+    {
+      options.seed = strtoul(argv[++i], NULL, 10);
+    }
+    else
+    {
+      kdlc_benchmark::printUsage(argv[0]);
+      boost::filesystem::remove_all(cache_home);
+      return 1;
+    }
+  }
+
+  std::vector<kdlc_benchmark::RobotSpec> robots;
+  robots.push_back(kdlc_benchmark::RobotSpec("synthetic_6dof", "manipulator", "base_link", "tool0"));
+  robots.push_back(kdlc_benchmark::RobotSpec("synthetic_7dof", "manipulator", "base_link", "tool0"));
+  robots.push_back(kdlc_benchmark::RobotSpec("synthetic_mixed_6dof", "manipulator", "base_link", "tool0"));
+
+  std::stringstream json;
+  json << "{\"benchmark\": \"kdlc_benchmark\", \"seed\": " << options.seed << ", \"queries\": "
+       << options.num_queries << ", \"timeout\": " << options.timeout << ",\n  \"robots\": [\n";
+  bool ok = true;
+  bool checks_passed = true;
+  for (std::size_t i = 0; i < robots.size() && ok; ++i)
+  {
+    if( i > 0 )
+      json << ",\n";
+    ok = kdlc_benchmark::benchmarkRobot(robots[i], options, json, checks_passed);
+  }
+  json << "\n  ]}\n";
+
+  boost::filesystem::remove_all(cache_home);
+  if( !ok )
+    return 1;
+
+  if( options.output.empty() )
+  {
+    std::cout << json.str();
+  }
+  else
+  {
+    std::ofstream file(options.output.c_str());
+    file << json.str();
+    if( !file )
+    {
+      std::cerr << "Could not write " << options.output << std::endl;
+      return 1;
+    }
+  }
+  return checks_passed ? 0 : 1;
+}
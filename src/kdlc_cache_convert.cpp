@@ -0,0 +1,112 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Converts a text cache file into the memory mapped binary format
+*/
+
+#include <moveit/kdlc_kinematics_plugin/kdlc_kinematics_plugin.h>
+#include <string.h> // strcmp
+
+namespace kdlc_cache_convert
+{
+
+void printUsage(const char* program)
+{
+  std::cout << "Usage: " << program << " TEXT_FILE BINARY_FILE GROUP BASE_FRAME TIP_FRAME [options]\n"
+            << "Options:\n"
+            << "  --robot-description NAME  parameter holding the URDF, default robot_description\n"
+            << "The key ranges are derived from the joint limits of the chain and the cache_* private parameters,\n"
+            << "exactly as the plugin does, so they must match those the text file was written with. Load the same\n"
+            << "yaml file as for the plugin into the namespace of this node.\n";
+}
+
+} // end namespace
+
+int main(int argc, char *argv[])
+{
+  ros::init(argc, argv, "kdlc_cache_convert");
+
+  if( argc < 6 )
+  {
+    kdlc_cache_convert::printUsage(argv[0]);
+    return 1;
+  }
+
+  const std::string text_path = argv[1];
+  const std::string binary_path = argv[2];
+  const std::string group_name = argv[3];
+  const std::string base_frame = argv[4];
+  const std::string tip_frame = argv[5];
+  std::string robot_description = "robot_description";
+
+  for (int i = 6; i < argc; ++i)
+  {
+    if( strcmp(argv[i], "--robot-description") == 0 && i + 1 < argc )
+    {
+      robot_description = argv[++i];
+    }
+    else
+    {
+      kdlc_cache_convert::printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  if( simple_cache::isBinaryCacheFile(text_path) )
+  {
+    ROS_ERROR_STREAM_NAMED("convert", text_path << " is already a binary cache file");
+    return 1;
+  }
+
+  // The plugin rejects binary files whose key settings differ from its own, so build the cache the same way.
+  // The joint range depends on the limits of the chain, it cannot be given by hand.
+  ros::NodeHandle private_handle("~");
+  KDL::Chain kdl_chain;
+  KDL::JntArray joint_min, joint_max;
+  if( !kdlc_kinematics_plugin::KDLCKinematicsPlugin::loadChain(robot_description, group_name, base_frame,
+                                                                tip_frame, kdl_chain, joint_min, joint_max) )
+    return 1;
+
+  simple_cache::SimpleCachePtr cache =
+    kdlc_kinematics_plugin::KDLCKinematicsPlugin::configureCache(kdl_chain, joint_min, joint_max,
+                                                                 private_handle,
+                                                                 simple_cache::FLAT_HASH_STORAGE);
+  cache->printLimits();
+
+  if( !cache->readFile(text_path) || !cache->writeBinaryFile(binary_path) )
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,275 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2013, University of Colorado, Boulder
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Univ of CO, Boulder nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Author: Dave Coleman
+   Desc:   Fills a cache file offline by sampling joint configurations of a chain and computing their FK
+*/
+
+#include <moveit/kdlc_kinematics_plugin/kdlc_kinematics_plugin.h>
+#include <tf_conversions/tf_kdl.h>
+#include <boost/thread.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real.hpp>
+#include <stdlib.h> // strtoul, strtoull, atoi
+#include <string.h> // strcmp
+
+namespace kdlc_cache_generator
+{
+
+void printUsage(const char* program)
+{
+  std::cout << "Usage: " << program << " GROUP BASE_FRAME TIP_FRAME CACHE_FILE NUM_SAMPLES [options]\n"
+            << "Options:\n"
+            << "  --threads N               sampling threads, default is one per core\n"
+            << "  --seed S                  seed of the first thread, default 1\n"
+            << "  --robot-description NAME  parameter holding the URDF, default robot_description\n"
+            << "The cache_* private parameters must match those of the plugin, e.g. load the same yaml file\n"
+            << "into the namespace of this node.\n";
+}
+
+/**
+ * @brief Samples uniformly within the joint limits, computes the pose of the tip and adds it to the cache.
+ *        Each worker has its own random number generator, the cache handles concurrent inserts. Samples are
+ *        drawn in chunks so their FK runs several configurations at a time.
+ */
+struct SampleWorker
+{
+  SampleWorker(simple_cache::SimpleCache& cache, const KDL::Chain& chain,
+               const kdlc_kinematics_plugin::BatchFK& batch_fk, const KDL::JntArray& joint_min,
+               const KDL::JntArray& joint_max, uint64_t num_samples, uint32_t seed,
+               boost::atomic<uint64_t>& num_done) :
+    cache_(cache),
+    chain_(chain),
+    batch_fk_(batch_fk),
+    joint_min_(joint_min),
+    joint_max_(joint_max),
+    num_samples_(num_samples),
+    seed_(seed),
+    num_done_(num_done)
+  {
+  }
+
+  void operator()()
+  {
+    KDL::ChainFkSolverPos_recursive fk_solver(chain_);
+    boost::mt19937 generator(seed_);
+    boost::uniform_real<double> unit(0.0, 1.0);
+
+    // Joint j of sample c at joint_batch[j * CHUNK_SIZE + c]
+    static const std::size_t CHUNK_SIZE = 256;
+    const std::size_t num_joints = joint_min_.rows();
+    std::vector<double> joint_batch(num_joints * CHUNK_SIZE);
+    std::vector<KDL::Frame> frames(CHUNK_SIZE);
+    KDL::JntArray jnt_array(num_joints);
+    std::vector<double> joint_values(num_joints);
+    geometry_msgs::Pose pose;
+
+    // Publish progress in chunks so the shared counter is not a point of contention
+    static const uint64_t REPORT_EVERY = 10000;
+    uint64_t unreported = 0;
+
+    for (uint64_t first = 0; first < num_samples_; first += CHUNK_SIZE)
+    {
+      const std::size_t chunk = std::min<uint64_t>(CHUNK_SIZE, num_samples_ - first);
+      for (std::size_t c = 0; c < chunk; ++c)
+        for (std::size_t j = 0; j < num_joints; ++j)
+          joint_batch[j * CHUNK_SIZE + c] = joint_min_(j) + unit(generator) * (joint_max_(j) - joint_min_(j));
+
+      std::vector<bool> valid(chunk, true);
+      if( batch_fk_.isValid() )
+        batch_fk_.computeTipFrames(&joint_batch[0], CHUNK_SIZE, chunk, &frames[0]);
+      else
+      {
+        for (std::size_t c = 0; c < chunk; ++c)
+        {
+          for (std::size_t j = 0; j < num_joints; ++j)
+            jnt_array(j) = joint_batch[j * CHUNK_SIZE + c];
+          valid[c] = fk_solver.JntToCart(jnt_array, frames[c]) >= 0;
+        }
+      }
+
+      for (std::size_t c = 0; c < chunk; ++c)
+      {
+        if( !valid[c] )
+          continue;
+        for (std::size_t j = 0; j < num_joints; ++j)
+          joint_values[j] = joint_batch[j * CHUNK_SIZE + c];
+        tf::poseKDLToMsg(frames[c], pose);
+        cache_.insert(pose, joint_values);
+      }
+
+      unreported += chunk;
+      if( unreported >= REPORT_EVERY )
+      {
+        num_done_ += unreported;
+        unreported = 0;
+      }
+    }
+    num_done_ += unreported;
+  }
+
+  simple_cache::SimpleCache& cache_;
+  const KDL::Chain& chain_;
+  const kdlc_kinematics_plugin::BatchFK& batch_fk_;
+  const KDL::JntArray& joint_min_;
+  const KDL::JntArray& joint_max_;
+  uint64_t num_samples_;
+  uint32_t seed_;
+  boost::atomic<uint64_t>& num_done_;
+};
+
+/**
+ * @brief Print the progress of the workers until they are all done
+ */
+void reportProgress(const boost::atomic<uint64_t>& num_done, uint64_t num_samples,
+                    const simple_cache::SimpleCache& cache)
+{
+  const ros::WallTime start_time = ros::WallTime::now();
+  try
+  {
+    while( true )
+    {
+      boost::this_thread::sleep(boost::posix_time::seconds(10));
+      const double duration = (ros::WallTime::now() - start_time).toSec();
+      const uint64_t done = num_done.load();
+      ROS_INFO_STREAM_NAMED("generator", done << " / " << num_samples << " samples, " << cache.getSize()
+                            << " keys, " << done / duration << " samples/s");
+    }
+  }
+  catch (boost::thread_interrupted&)
+  {
+  }
+}
+
+} // end namespace
+
+int main(int argc, char *argv[])
+{
+  ros::init(argc, argv, "kdlc_cache_generator");
+
+  if( argc < 6 )
+  {
+    kdlc_cache_generator::printUsage(argv[0]);
+    return 1;
+  }
+
+  const std::string group_name = argv[1];
+  const std::string base_frame = argv[2];
+  const std::string tip_frame = argv[3];
+  const std::string cache_path = argv[4];
+  const uint64_t num_samples = strtoull(argv[5], NULL, 10);
+
+  unsigned int num_threads = std::max(1u, boost::thread::hardware_concurrency());
+  uint32_t seed = 1;
+  std::string robot_description = "robot_description";
+
+  for (int i = 6; i < argc; ++i)
+  {
+    if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc )
+    {
+      num_threads = std::max(1, atoi(argv[++i]));
+    }
+    else if( strcmp(argv[i], "--seed") == 0 && i + 1 < argc )
+    {
+      seed = strtoul(argv[++i], NULL, 10);
+    }
+    else if( strcmp(argv[i], "--robot-description") == 0 && i + 1 < argc )
+    {
+      robot_description = argv[++i];
+    }
+    else
+    {
+      kdlc_cache_generator::printUsage(argv[0]);
+      return 1;
+    }
+  }
+
+  if( num_samples == 0 )
+  {
+    ROS_ERROR_STREAM_NAMED("generator","Invalid number of samples " << argv[5]);
+    return 1;
+  }
+
+  // Load the chain and its limits the same way as KDLCKinematicsPlugin::initialize()
+  ros::NodeHandle private_handle("~");
+  KDL::Chain kdl_chain;
+  KDL::JntArray joint_min, joint_max;
+  if( !kdlc_kinematics_plugin::KDLCKinematicsPlugin::loadChain(robot_description, group_name, base_frame,
+                                                                tip_frame, kdl_chain, joint_min, joint_max) )
+    return 1;
+
+  // Flat storage keeps large caches compact, the file format does not depend on it
+  simple_cache::SimpleCachePtr cache =
+    kdlc_kinematics_plugin::KDLCKinematicsPlugin::configureCache(kdl_chain, joint_min, joint_max,
+                                                                 private_handle,
+                                                                 simple_cache::FLAT_HASH_STORAGE);
+
+  ROS_INFO_STREAM_NAMED("generator","Sampling " << num_samples << " configurations of " << group_name
+                        << " with " << num_threads << " threads");
+
+  // Shared by all workers, it is immutable
+  const kdlc_kinematics_plugin::BatchFK batch_fk(kdl_chain);
+  if( !batch_fk.isValid() )
+    ROS_WARN_STREAM_NAMED("generator","Chain has joints the batched FK does not model, using the scalar solver");
+
+  const ros::WallTime start_time = ros::WallTime::now();
+  boost::atomic<uint64_t> num_done(0);
+  {
+    boost::thread reporter(boost::bind(&kdlc_cache_generator::reportProgress, boost::cref(num_done),
+                                       num_samples, boost::cref(*cache)));
+
+    boost::thread_group threads;
+    for (unsigned int t = 0; t < num_threads; ++t)
+    {
+      // Spread the remainder over the first threads
+      const uint64_t thread_samples = num_samples / num_threads + (t < num_samples % num_threads ? 1 : 0);
+      threads.create_thread(kdlc_cache_generator::SampleWorker(*cache, kdl_chain, batch_fk, joint_min,
+                                                               joint_max, thread_samples, seed + t,
+                                                               num_done));
+    }
+    threads.join_all();
+
+    reporter.interrupt();
+    reporter.join();
+  }
+  const double duration = (ros::WallTime::now() - start_time).toSec();
+
+  ROS_INFO_STREAM_NAMED("generator","Sampled " << num_done.load() << " configurations in " << duration << "s");
+  cache->printStats();
+
+  if( !cache->writeBinaryFile(cache_path) )
+    return 1;
+
+  return 0;
+}
@@ -50,42 +50,77 @@
 
 // C++
 #include <numeric>
+#include <limits>
+#include <boost/bind.hpp>
 
 static const double MAX_TIMEOUT_KDLC_PLUGIN = 5.0;
 
+// Quality score of a solution that took this many solver attempts, 255 for the first attempt and 32 less for
+// every doubling. A solution found from the seed is on the branch planners ask for, random restarts may not be.
+static uint8_t getSolutionQuality(unsigned int attempts)
+{
+  unsigned int doublings = 0;
+  while( attempts > 1 && doublings < 7 )
+  {
+    attempts >>= 1;
+    ++doublings;
+  }
+  return 255 - 32 * doublings;
+}
+
+// Angle wrapped into [-pi, pi), the range of continuous joints
+static double wrapAngle(double angle)
+{
+  return angle - 2.0 * M_PI * floor((angle + M_PI) / (2.0 * M_PI));
+}
+
+// Distance between two values of a joint with limits
+static double getLinearDistance(double a, double b)
+{
+  return fabs(a - b);
+}
+
+// Distance between two values of a continuous joint, the shorter way around
+static double getAngularDistance(double a, double b)
+{
+  return fabs(wrapAngle(a - b));
+}
+
 //register KDLCKinematics as a KinematicsBase implementation
 CLASS_LOADER_REGISTER_CLASS(kdlc_kinematics_plugin::KDLCKinematicsPlugin, kinematics::KinematicsBase)
 
 namespace kdlc_kinematics_plugin
 {
 
-KDLCKinematicsPlugin::KDLCKinematicsPlugin():active_(false){}
+KDLCKinematicsPlugin::KDLCKinematicsPlugin():active_(false),num_race_pools_(0){}
 
-void KDLCKinematicsPlugin::getRandomConfiguration(KDL::JntArray &jnt_array) const
+void KDLCKinematicsPlugin::getRandomConfiguration(SolverContext& context, KDL::JntArray &jnt_array) const
 {
-  std::vector<double> jnt_array_vector(dimension_,0.0);
-  robot_state::JointStateGroup*  joint_state_group = kinematic_state_->getJointStateGroup(getGroupName());
-  joint_state_group->setToRandomValues();
-  joint_state_group->getVariableValues(jnt_array_vector);
   for(std::size_t i=0; i < dimension_; ++i)
-    jnt_array(i) = jnt_array_vector[i];
+    jnt_array(i) = context.random_stream.uniformReal(joint_min_(i), joint_max_(i));
 }
 
-void KDLCKinematicsPlugin::getRandomConfiguration(const KDL::JntArray &seed_state,
+void KDLCKinematicsPlugin::getRandomConfiguration(SolverContext& context,
+                                                  const KDL::JntArray &seed_state,
                                                   const std::vector<double> &consistency_limits,
                                                   KDL::JntArray &jnt_array) const
 {
-  std::vector<double> values, near;
-  for(std::size_t i=0; i < dimension_; ++i)
-  {
-    near.push_back(seed_state(i));
-  }
-  robot_state::JointStateGroup*  joint_state_group = kinematic_state_->getJointStateGroup(getGroupName());
-  joint_state_group->setToRandomValuesNearBy(near, consistency_limits);
-  joint_state_group->getVariableValues(values);
   for(std::size_t i=0; i < dimension_; ++i)
   {
-    jnt_array(i) = values[i];
+    if( joint_continuous_[i] )
+    {
+      jnt_array(i) = wrapAngle(seed_state(i) +
+                               context.random_stream.uniformReal(-consistency_limits[i], consistency_limits[i]));
+      continue;
+    }
+
+    // The window around the seed, cut off at the joint limits
+    const double low = std::max(joint_min_(i), seed_state(i) - consistency_limits[i]);
+    const double high = std::min(joint_max_(i), seed_state(i) + consistency_limits[i]);
+    if( low < high )
+      jnt_array(i) = context.random_stream.uniformReal(low, high);
+    else // seed outside of the limits
+      jnt_array(i) = std::max(joint_min_(i), std::min(joint_max_(i), seed_state(i)));
   }
 }
 
@@ -93,30 +128,201 @@ bool KDLCKinematicsPlugin::checkConsistency(const KDL::JntArray& seed_state,
                                             const std::vector<double> &consistency_limits,
                                             const KDL::JntArray& solution) const
 {
-  std::vector<double> seed_state_vector(dimension_), solution_vector(dimension_);
   for(std::size_t i = 0; i < dimension_; ++i)
   {
-    seed_state_vector[i] = seed_state(i);
-    solution_vector[i] = solution(i);
+    if(joint_distance_[i](seed_state(i), solution(i)) > consistency_limits[i])
+      return false;
   }
-  robot_state::JointStateGroup* joint_state_group = kinematic_state_->getJointStateGroup(getGroupName());
-  robot_state::JointStateGroup* joint_state_group_2 = kinematic_state_2_->getJointStateGroup(getGroupName());
-  joint_state_group->setVariableValues(seed_state_vector);
-  joint_state_group_2->setVariableValues(solution_vector);
 
-  const std::vector<robot_state::JointState*>& joint_state_vector = joint_state_group->getJointStateVector();
-  const std::vector<robot_state::JointState*>& joint_state_vector_2 = joint_state_group_2->getJointStateVector();
+  return true;
+}
+
+bool KDLCKinematicsPlugin::loadChain(const std::string& robot_description, const std::string& group_name,
+                                     const std::string& base_frame, const std::string& tip_frame,
+                                     KDL::Chain& chain, KDL::JntArray& joint_min, KDL::JntArray& joint_max)
+{
+  rdf_loader::RDFLoader rdf_loader(robot_description);
+  const boost::shared_ptr<srdf::Model>& srdf = rdf_loader.getSRDF();
+  const boost::shared_ptr<urdf::ModelInterface>& urdf_model = rdf_loader.getURDF();
+  if( !urdf_model || !srdf )
+  {
+    ROS_ERROR_STREAM_NAMED("kdlc","Could not load the robot from " << robot_description);
+    return false;
+  }
 
-  for(std::size_t i = 0; i < joint_state_vector.size(); ++i)
+  const robot_model::RobotModel kinematic_model(urdf_model, srdf);
+  if( !kinematic_model.hasJointModelGroup(group_name) )
   {
-    if(joint_state_vector[i]->distance(joint_state_vector_2[i]) > consistency_limits[i])
-      return false;
+    ROS_ERROR_STREAM_NAMED("kdlc","Kinematic model does not contain group " << group_name);
+    return false;
+  }
+  const robot_model::JointModelGroup* joint_model_group = kinematic_model.getJointModelGroup(group_name);
+  if( !joint_model_group->isChain() )
+  {
+    ROS_ERROR_STREAM_NAMED("kdlc","Group " << group_name << " is not a chain");
+    return false;
+  }
+
+  KDL::Tree kdl_tree;
+  if( !kdl_parser::treeFromUrdfModel(*urdf_model, kdl_tree) )
+  {
+    ROS_ERROR_NAMED("kdlc","Could not initialize tree object");
+    return false;
+  }
+  if( !kdl_tree.getChain(base_frame, tip_frame, chain) )
+  {
+    ROS_ERROR_NAMED("kdlc","Could not initialize chain object");
+    return false;
   }
 
+  const std::vector<moveit_msgs::JointLimits> limits = joint_model_group->getVariableLimits();
+  if( limits.size() != chain.getNrOfJoints() )
+  {
+    ROS_ERROR_STREAM_NAMED("kdlc","Group " << group_name << " has " << limits.size()
+                           << " variables but the chain has " << chain.getNrOfJoints() << " joints");
+    return false;
+  }
+  joint_min.resize(limits.size());
+  joint_max.resize(limits.size());
+  for (std::size_t i = 0; i < limits.size(); ++i)
+  {
+    joint_min(i) = limits[i].min_position;
+    joint_max(i) = limits[i].max_position;
+  }
   return true;
 }
 
+simple_cache::SimpleCachePtr KDLCKinematicsPlugin::configureCache(const KDL::Chain& chain,
+                                                                  const KDL::JntArray& joint_min,
+                                                                  const KDL::JntArray& joint_max,
+                                                                  const ros::NodeHandle& private_handle,
+                                                                  simple_cache::storage_t storage)
+{
+  // Values are keyed over the joint range of the whole chain, with a margin because solutions can sit right
+  // on a limit. Chains without usable limits fall back to the old fixed range.
+  double joint_low = std::numeric_limits<double>::max();
+  double joint_hi = -std::numeric_limits<double>::max();
+  for (std::size_t i = 0; i < joint_min.rows(); ++i)
+  {
+    joint_low = std::min(joint_low, joint_min(i));
+    joint_hi = std::max(joint_hi, joint_max(i));
+  }
+  if( !(joint_hi > joint_low) || joint_hi - joint_low > 100.0 )
+  {
+    joint_low = -2.7;
+    joint_hi = 2.7;
+  }
+  const double margin = (joint_hi - joint_low) * 1e-3;
+
+  // TODO: dynamically set the pose limits
+  bool verbose_cache = false;
+  simple_cache::SimpleCachePtr cache(new simple_cache::SimpleCache(joint_min.rows(), verbose_cache,
+                                                                   joint_hi + margin, joint_low - margin,
+                                                                   1.0, -1.0, storage));
+
+  // Bit packed keys give finer bins but are not compatible with files written using decimal keys
+  bool cache_bit_packing;
+  private_handle.param("cache_bit_packing", cache_bit_packing, false);
+  if( cache_bit_packing )
+    cache->setBitPacking();
+
+  // Key poses with a canonical quaternion and separate position/orientation resolution over the
+  // reachable workspace of the chain
+  double cache_position_resolution, cache_angular_resolution;
+  private_handle.param("cache_position_resolution", cache_position_resolution, 0.0);
+  private_handle.param("cache_angular_resolution", cache_angular_resolution, 0.02);
+  if( cache_position_resolution > 0 )
+  {
+    const double reach = getChainReach(chain, joint_min, joint_max);
+    const double workspace_low[] = {-reach, -reach, -reach};
+    const double workspace_high[] = {reach, reach, reach};
+    ROS_INFO_STREAM_NAMED("kdlc","Caching poses within " << reach << "m of the base frame");
+    cache->setPoseResolution(cache_position_resolution, cache_angular_resolution, workspace_low, workspace_high);
+  }
+
+  // Several IK branches per pose, the one closest to the seed is used
+  int cache_max_solutions;
+  private_handle.param("cache_max_solutions", cache_max_solutions, 4);
+  cache->setMaxSolutions(std::max(1, cache_max_solutions));
+
+  // A pose that failed is searched again after this many seconds, doubled by every further failure. 0 never.
+  double cache_nosolution_ttl;
+  private_handle.param("cache_nosolution_ttl", cache_nosolution_ttl, 3600.0);
+  cache->setNoSolutionExpiry(cache_nosolution_ttl);
+
+  return cache;
+}
+
+simple_cache::SimpleCachePtr KDLCKinematicsPlugin::createCache(const ros::NodeHandle& private_handle)
+{
+  ROS_INFO_STREAM_NAMED("kdlc","Using cache at " << cache_location_);
+
+  // Load IK Cache
+  simple_cache::SimpleCachePtr cache = configureCache(kdl_chain_, joint_min_, joint_max_, private_handle);
+  cache->setContinuousJoints(joint_continuous_);
+
+  if( cache_nn_radius_ > 0 )
+  {
+    double cache_nn_rotation_weight;
+    private_handle.param("cache_nn_rotation_weight", cache_nn_rotation_weight, 0.1);
+    cache->enableNearest(cache_nn_rotation_weight);
+  }
+
+  // Bound memory use, least recently hit poses are evicted first. 0 is unlimited.
+  double cache_memory_budget;
+  private_handle.param("cache_memory_budget", cache_memory_budget, 0.0);
+  if( cache_memory_budget > 0 )
+    cache->setMemoryBudget(std::size_t(cache_memory_budget * 1024 * 1024));
+
+  // Open the data file, then add what was learned since it was written. A rotated journal is left behind
+  // when the process stopped while compacting.
+  const std::string journal_location = cache_location_ + ".journal";
+  const std::string rotated_journal_location = simple_cache::getRotatedJournalPath(journal_location);
+  cache->readFile(cache_location_);
+  if( access(rotated_journal_location.c_str(), R_OK) == 0 )
+    cache->replayJournal(rotated_journal_location);
+  if( access(journal_location.c_str(), R_OK) == 0 )
+    cache->replayJournal(journal_location);
+
+  // Setup the journal to auto-write to disk from a background thread
+  simple_cache::AppendWriterOptions append_options;
+  int cache_batch_size, cache_compact_records;
+  std::string cache_fsync;
+  private_handle.param("cache_batch_size", cache_batch_size, int(append_options.batch_size));
+  private_handle.param("cache_flush_interval", append_options.flush_interval, append_options.flush_interval);
+  private_handle.param("cache_fsync_interval", append_options.fsync_interval, append_options.fsync_interval);
+  private_handle.param("cache_fsync", cache_fsync, std::string("never"));
+  append_options.batch_size = std::max(1, cache_batch_size);
+  if( cache_fsync == "batch" )
+    append_options.fsync_policy = simple_cache::FSYNC_EVERY_BATCH;
+  else if( cache_fsync == "interval" )
+    append_options.fsync_policy = simple_cache::FSYNC_INTERVAL;
+  else if( cache_fsync != "never" )
+    ROS_WARN_STREAM_NAMED("kdlc","Unknown cache_fsync policy '" << cache_fsync << "', using 'never'");
+
+  // Fold the journal into the data file once it has this many records, 0 lets it grow forever
+  private_handle.param("cache_compact_records", cache_compact_records, 1000000);
+  append_options.compact_records = std::max(0, cache_compact_records);
+
+  cache->startAppend(journal_location, append_options, cache_location_);
+
+  return cache;
+}
+
+bool KDLCKinematicsPlugin::initialize(const std::string &robot_description,
+                                      const std::string& group_name,
+                                      const std::string& base_frame,
+                                      const std::string& tip_frame,
+                                      double search_discretization)
+{
+  rdf_loader::RDFLoader rdf_loader(robot_description);
+  return initialize(robot_description, rdf_loader.getURDF(), rdf_loader.getSRDF(), group_name, base_frame,
+                    tip_frame, search_discretization);
+}
+
 bool KDLCKinematicsPlugin::initialize(const std::string &robot_description,
+                                      const boost::shared_ptr<urdf::ModelInterface> &urdf_model,
+                                      const boost::shared_ptr<srdf::Model> &srdf,
                                       const std::string& group_name,
                                       const std::string& base_frame,
                                       const std::string& tip_frame,
@@ -128,9 +334,11 @@ bool KDLCKinematicsPlugin::initialize(const std::string &robot_description,
   setValues(robot_description, group_name, base_frame, tip_frame, search_discretization);
 
   ros::NodeHandle private_handle("~");
-  rdf_loader::RDFLoader rdf_loader(robot_description_);
-  const boost::shared_ptr<srdf::Model> &srdf = rdf_loader.getSRDF();
-  const boost::shared_ptr<urdf::ModelInterface>& urdf_model = rdf_loader.getURDF();
+  if(!urdf_model || !srdf)
+  {
+    ROS_ERROR("Could not load the robot from %s",robot_description.c_str());
+    return false;
+  }
 
   kinematic_model_.reset(new robot_model::RobotModel(urdf_model, srdf));
 
@@ -160,9 +368,13 @@ bool KDLCKinematicsPlugin::initialize(const std::string &robot_description,
   }
 
   dimension_ = joint_model_group->getVariableCount();
-  jnt_seed_state_.resize(dimension_);
-  jnt_pos_in_.resize(dimension_);
-  jnt_pos_out_.resize(dimension_);
+
+  // Number of chain segments up to every link, so FK does not search the chain by name. The base frame is the
+  // start of the chain.
+  segment_index_.clear();
+  segment_index_[base_frame_] = 0;
+  for(unsigned int i = 0; i < kdl_chain_.getNrOfSegments(); ++i)
+    segment_index_[kdl_chain_.getSegment(i).getName()] = i + 1;
   ik_chain_info_.joint_names = joint_model_group->getJointModelNames();
   ik_chain_info_.limits = joint_model_group->getVariableLimits();
   fk_chain_info_.joint_names = ik_chain_info_.joint_names;
@@ -185,21 +397,44 @@ bool KDLCKinematicsPlugin::initialize(const std::string &robot_description,
     joint_max_(i) = ik_chain_info_.limits[i].max_position;
   }
 
+  // Continuous joints wrap around instead of stopping at their limits, which changes how they are sampled and
+  // how far apart two of their values are
+  joint_continuous_.assign(dimension_, false);
+  const std::vector<const robot_model::JointModel*>& joint_models = joint_model_group->getJointModels();
+  for(std::size_t i = 0; i < joint_models.size(); ++i)
+  {
+    const robot_model::RevoluteJointModel* revolute =
+      dynamic_cast<const robot_model::RevoluteJointModel*>(joint_models[i]);
+    const int index = getJointIndex(joint_models[i]->getName());
+    if( revolute && revolute->isContinuous() && index >= 0 && index < int(dimension_) )
+      joint_continuous_[index] = true;
+  }
+  joint_distance_.resize(dimension_);
+  for(std::size_t i = 0; i < dimension_; ++i)
+    joint_distance_[i] = joint_continuous_[i] ? &getAngularDistance : &getLinearDistance;
+
   // Get Solver Parameters
   int max_solver_iterations;
-  double epsilon;
-
+  std::string solver_backend;
   private_handle.param("max_solver_iterations", max_solver_iterations, 500);
-  private_handle.param("epsilon", epsilon, 1e-5);
+  private_handle.param("epsilon", solver_options_.epsilon, 1e-5);
+  private_handle.param("solver_backend", solver_backend, std::string("kdl_nr_jl"));
+  solver_options_.max_iterations = std::max(1, max_solver_iterations);
+  solver_options_.continuous_joints = joint_continuous_;
 
-  // Build Solvers
-  fk_solver_.reset(new KDL::ChainFkSolverPos_recursive(kdl_chain_));
-  ik_solver_vel_.reset(new KDL::ChainIkSolverVel_pinv(kdl_chain_));
-  ik_solver_pos_.reset(new KDL::ChainIkSolverPos_NR_JL(kdl_chain_, joint_min_, joint_max_,*fk_solver_, *ik_solver_vel_, max_solver_iterations, epsilon));
+  // The damped least squares backend keeps making progress near singularities and gives up as soon as it is
+  // stuck at a limit, so restarts come sooner
+  if( solver_backend == "lm" )
+    solver_options_.backend = LM_BACKEND;
+  else if( solver_backend != "kdl_nr_jl" )
+    ROS_WARN_STREAM_NAMED("kdlc","Unknown solver_backend '" << solver_backend << "', using 'kdl_nr_jl'");
 
-  // Setup the joint state groups that we need
-  kinematic_state_.reset(new robot_state::RobotState((const robot_model::RobotModelConstPtr) kinematic_model_));
-  kinematic_state_2_.reset(new robot_state::RobotState((const robot_model::RobotModelConstPtr) kinematic_model_));
+  // Solvers are built per concurrent call, so that threads can share this instance
+  context_pool_.reset(new SolverContextPool(kdl_chain_, joint_min_, joint_max_, solver_options_));
+
+  batch_fk_.reset(new BatchFK(kdl_chain_));
+  if( !batch_fk_->isValid() )
+    ROS_WARN_STREAM_NAMED("kdlc","Chain has joints the batched FK does not model, batches use the scalar solver");
 
 
 
@@ -213,30 +448,56 @@ bool KDLCKinematicsPlugin::initialize(const std::string &robot_description,
 
   ROS_WARN_STREAM("Initializing kdlc solver " << this_instance_id_);
 
-  // Check if we need to load the cache_
-  static bool cache_loaded = false;
-  if( !cache_loaded )
+  // Seed from the closest cached pose when the exact bin is empty. 0 disables.
+  private_handle.param("cache_nn_radius", cache_nn_radius_, 0.0);
+
+  // A cached solution is returned without searching when its FK is this close to the goal, possibly after a
+  // few Newton steps. The solver itself stops within epsilon on every axis.
+  private_handle.param("cache_position_tolerance", cache_position_tolerance_, 1e-4);
+  private_handle.param("cache_angular_tolerance", cache_angular_tolerance_, 1e-3);
+  private_handle.param("cache_refine_iterations", cache_refine_iterations_, 5);
+  cache_refine_iterations_ = std::max(0, cache_refine_iterations_);
+
+  // Threads of searchPositionIKBatch(), started by the first batch
+  private_handle.param("batch_threads", batch_threads_, int(boost::thread::hardware_concurrency()));
+  batch_threads_ = std::max(1, batch_threads_);
+
+  // Race this many restart streams in every search, the first accepted solution wins. Every stream draws its
+  // restarts from search_seed, so a search can be replayed.
+  private_handle.param("search_threads", search_threads_, 1);
+  private_handle.param("search_seed", search_seed_, 0);
+  search_threads_ = std::max(1, search_threads_);
+
+  // Every search that races concurrently needs its own pool of search_threads_ threads. Searches beyond this
+  // many at once run their restarts serially instead of starting more threads.
+  private_handle.param("max_racing_searches", max_race_pools_, 4);
+  max_race_pools_ = std::max(1, max_race_pools_);
+
+  // Every chain gets its own cache, shared by all instances of that chain. The file defaults to one per
+  // robot, group and frames in cache_directory and can be set per group with ~<group>/cache_file
+  const simple_cache::CacheId cache_id(robot_description, group_name, base_frame_, tip_frame_);
+  std::string cache_directory;
+  if( !private_handle.getParam("cache_directory", cache_directory) )
+    cache_directory = simple_cache::CacheRegistry::getDefaultDirectory();
+  ros::NodeHandle group_handle(private_handle, group_name);
+  group_handle.param("cache_file", cache_location_, cache_directory + "/" + cache_id.getFileName(urdf_model->getName()));
+
+  cache_ = simple_cache::CacheRegistry::getInstance().getCache(cache_id,
+    boost::bind(&KDLCKinematicsPlugin::createCache, this, private_handle));
+  if( !cache_ )
   {
-    ROS_INFO_STREAM_NAMED("kdlc","Cache is not loaded, opening file");
-
-    // Get path to data file      TODO: make this cross-platform
-    cache_location_ = "/home/dave"; //getenv("HOME");
-    cache_location_ = cache_location_ + "/.ros/kdlc_cache.dat";
-    ROS_INFO_STREAM_NAMED("kdlc","Using cache at " << cache_location_);
-
-    // Load IK Cache
-    // TODO: dynamically set the joint and pose limits
-    bool verbose_cache = false;
-    cache_.reset(new simple_cache::SimpleCache(dimension_, verbose_cache, 2.7, -2.7, 1.0, -1.0));
-
-    // Open the data file
-    cache_->readFile(cache_location_);
-
-    // Setup the data file to auto-write to disk
-    cache_->startAppend(cache_location_);
+    ROS_ERROR_STREAM_NAMED("kdlc","Could not create cache for " << cache_id.toString());
+    return false;
+  }
 
-    // Remember we have loaded it
-    cache_loaded = true;
+  // Live hit rates and latencies of all chains, written as JSON when ~metrics_file is set
+  metrics_ = simple_cache::CacheRegistry::getInstance().getMetrics(cache_id);
+  std::string metrics_file;
+  if( private_handle.getParam("metrics_file", metrics_file) && !metrics_file.empty() )
+  {
+    double metrics_interval;
+    private_handle.param("metrics_interval", metrics_interval, 10.0);
+    simple_cache::CacheRegistry::getInstance().startReporting(metrics_file, metrics_interval);
   }
 
   // DTC
@@ -248,6 +509,57 @@ bool KDLCKinematicsPlugin::initialize(const std::string &robot_description,
   return true;
 }
 
+double KDLCKinematicsPlugin::getChainReach(const KDL::Chain& chain, const KDL::JntArray& joint_min,
+                                           const KDL::JntArray& joint_max)
+{
+  double reach = 0.0;
+  unsigned int joint_index = 0;
+  for (unsigned int i = 0; i < chain.getNrOfSegments(); ++i)
+  {
+    const KDL::Segment& segment = chain.getSegment(i);
+    reach += segment.getFrameToTip().p.Norm();
+
+    const KDL::Joint& joint = segment.getJoint();
+    if( joint.getType() == KDL::Joint::None )
+      continue;
+
+    // Prismatic joints can extend the chain by their full travel
+    if( joint.getType() == KDL::Joint::TransAxis || joint.getType() == KDL::Joint::TransX ||
+        joint.getType() == KDL::Joint::TransY || joint.getType() == KDL::Joint::TransZ )
+    {
+      reach += std::max(fabs(joint_min(joint_index)), fabs(joint_max(joint_index)));
+    }
+    ++joint_index;
+  }
+
+  // Small margin so that poses at full extension are not on the edge of the range
+  return reach * 1.05;
+}
+
+bool KDLCKinematicsPlugin::refineCachedSolution(SolverContext& context, const KDL::Frame& pose_desired, KDL::JntArray& jnt_array,
+                                                unsigned int max_iterations) const
+{
+  KDL::Frame pose_actual;
+  KDL::JntArray delta(dimension_);
+  for (unsigned int i = 0; ; ++i)
+  {
+    if( context.fk_solver.JntToCart(jnt_array, pose_actual) < 0 )
+      return false;
+
+    const KDL::Twist error = KDL::diff(pose_actual, pose_desired);
+    if( error.vel.Norm() <= cache_position_tolerance_ && error.rot.Norm() <= cache_angular_tolerance_ )
+      return true;
+    if( i == max_iterations )
+      return false;
+
+    // Same step as ChainIkSolverPos_NR_JL, without its restarts
+    if( context.ik_solver_vel.CartToJnt(jnt_array, error, delta) < 0 )
+      return false;
+    for (unsigned int j = 0; j < dimension_; ++j)
+      jnt_array(j) = std::max(joint_min_(j), std::min(joint_max_(j), jnt_array(j) + delta(j)));
+  }
+}
+
 int KDLCKinematicsPlugin::getJointIndex(const std::string &name) const
 {
   for (unsigned int i=0; i < ik_chain_info_.joint_names.size(); i++) {
@@ -259,14 +571,8 @@ int KDLCKinematicsPlugin::getJointIndex(const std::string &name) const
 
 int KDLCKinematicsPlugin::getKDLSegmentIndex(const std::string &name) const
 {
-  int i=0;
-  while (i < (int)kdl_chain_.getNrOfSegments()) {
-    if (kdl_chain_.getSegment(i).getName() == name) {
-      return i+1;
-    }
-    i++;
-  }
-  return -1;
+  boost::unordered_map<std::string, int>::const_iterator it = segment_index_.find(name);
+  return it == segment_index_.end() ? -1 : it->second;
 }
 
 bool KDLCKinematicsPlugin::timedOut(const ros::WallTime &start_time, double duration) const
@@ -382,20 +688,27 @@ bool KDLCKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
   // Get seed state from cache if one is available
   std::vector<double> ik_seed_state_new = ik_seed_state; // copy to non-const vector
 
-  simple_cache::results_t cache_result = cache_->get(ik_pose, ik_seed_state_new);
+  simple_cache::ik_outcome_t outcome = simple_cache::IK_CACHE_MISS;
+  simple_cache::results_t cache_result = cache_->get(ik_pose, ik_seed_state, ik_seed_state_new, timeout);
   if( cache_result == simple_cache::SUCCESS )
   {
-    // Since we are pulling the result from cache, we can lower the timeout
-    timeout = timeout * 0.00001;
-
-    ROS_DEBUG_STREAM_NAMED("kdlc","ik result from cache. new timeout is " << timeout);  
+    outcome = simple_cache::IK_CACHE_HIT;
+    ROS_DEBUG_STREAM_NAMED("kdlc","ik result from cache");
   }
   else if( cache_result == simple_cache::NOSOLUTION)
   {
     ROS_DEBUG_STREAM_NAMED("kdlc","ik result from cache- no solution");
     error_code.val = error_code.NO_IK_SOLUTION;
+    metrics_->recordSearch(simple_cache::IK_CACHE_NOSOLUTION, false, (ros::WallTime::now() - n1).toSec(), 0);
     return false;
   }
+  else if( cache_nn_radius_ > 0 &&
+           cache_->getNearest(ik_pose, cache_nn_radius_, ik_seed_state, ik_seed_state_new) == simple_cache::SUCCESS )
+  {
+    // A close pose was solved before, warm start from it but keep the full timeout
+    outcome = simple_cache::IK_CACHE_NEAREST;
+    ROS_DEBUG_STREAM_NAMED("kdlc","ik seed from nearest cached pose");
+  }
   else
   {
     //ROS_ERROR_STREAM_NAMED("kdlc","pose not in ik cache");
@@ -418,6 +731,13 @@ bool KDLCKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
     return false;
   }
 
+  if(!consistency_limits.empty() && ik_seed_state.size() != dimension_)
+  {
+    ROS_ERROR_STREAM("Consistency limits need a seed state of size " << dimension_ << " instead of size " << ik_seed_state.size());
+    error_code.val = error_code.NO_IK_SOLUTION;
+    return false;
+  }
+
   solution.resize(dimension_);
 
   KDL::Frame pose_desired;
@@ -431,89 +751,152 @@ bool KDLCKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
                          ik_pose.orientation.y << " " <<
                          ik_pose.orientation.z << " " <<
                          ik_pose.orientation.w);
-  //Do the IK
+
+  ScopedSolverContext context(*context_pool_);
+
+  // Solutions must stay within the consistency limits of the caller's seed, even when the search starts from a
+  // cached seed
+  const std::vector<double>& requested_seed = ik_seed_state.size() == dimension_ ? ik_seed_state : ik_seed_state_new;
   for(unsigned int i=0; i < dimension_; i++)
-    jnt_seed_state_(i) = ik_seed_state_new[i];
-  jnt_pos_in_ = jnt_seed_state_;
+    context->jnt_seed_state(i) = requested_seed[i];
 
-  unsigned int counter(0);
-  bool result = false; // state the function will return in
-  while(1)
+  // The cached solution may belong to another pose in the same bin. Return it without searching if its FK
+  // reaches the goal, possibly after a few Newton steps, otherwise it is still the seed of the full search.
+  if( cache_result == simple_cache::SUCCESS )
   {
-    //    ROS_DEBUG_STREAM_NAMED("kdlc_kdl","Iteration: %d, time: %f, Timeout: %f",counter,(ros::WallTime::now()-n1).toSec(),timeout);
-    counter++;
-    if(timedOut(n1,timeout))
-    {
-      ROS_DEBUG_STREAM_NAMED("kdlc","IK timed out");
-      error_code.val = error_code.TIMED_OUT;
-      result = false;
-      break;
-    }
-    int ik_valid = ik_solver_pos_->CartToJnt(jnt_pos_in_,pose_desired,jnt_pos_out_);
-    if(!consistency_limits.empty())
-    {
-      getRandomConfiguration(jnt_seed_state_, consistency_limits, jnt_pos_in_);
-      if(ik_valid < 0 || !checkConsistency(jnt_seed_state_, consistency_limits, jnt_pos_out_))
-      {
-        ROS_DEBUG_NAMED("kdlc_kdl","Could not find IK solution");
-        continue;
-      }
-    }
-    else
+    for(unsigned int i=0; i < dimension_; i++)
+      context->jnt_pos_out(i) = ik_seed_state_new[i];
+
+    bool verified = refineCachedSolution(*context, pose_desired, context->jnt_pos_out, cache_refine_iterations_);
+    if( verified && !consistency_limits.empty() )
+      verified = checkConsistency(context->jnt_seed_state, consistency_limits, context->jnt_pos_out);
+
+    if( verified )
     {
-      getRandomConfiguration(jnt_pos_in_);
-      if(ik_valid < 0)
+      for(unsigned int j=0; j < dimension_; j++)
+        solution[j] = context->jnt_pos_out(j);
+      if(!solution_callback.empty())
+        solution_callback(ik_pose,solution,error_code);
+      else
+        error_code.val = error_code.SUCCESS;
+
+      if(error_code.val == error_code.SUCCESS)
       {
-        ROS_DEBUG_NAMED("kdlc_kdl","Could not find IK solution");
-        continue;
+        metrics_->recordSearch(outcome, true, (ros::WallTime::now() - n1).toSec(), 0);
+        return true;
       }
     }
-    ROS_DEBUG_STREAM_NAMED("kdlc","Found IK solution");
-    for(unsigned int j=0; j < dimension_; j++)
-      solution[j] = jnt_pos_out_(j);
-    if(!solution_callback.empty())
-      solution_callback(ik_pose,solution,error_code);
-    else
-      error_code.val = error_code.SUCCESS;
+    ROS_DEBUG_STREAM_NAMED("kdlc","cached solution rejected, searching from it");
+  }
 
-    if(error_code.val == error_code.SUCCESS)
-    {
-      //ROS_DEBUG_STREAM("Solved after " << counter << " iterations");
-      result = true;
-      break;
-    }
-  } // while
+  //Do the IK, starting from the cached seed if there is one. Restarts are sampled around the caller's seed.
+  for(unsigned int i=0; i < dimension_; i++)
+    context->jnt_pos_in(i) = ik_seed_state_new[i];
 
-  // --------------------------------------------------------------------------------------------------------
-  // DTC
-  // if the cache did not have an entry, add it
-  if( cache_result != simple_cache::SUCCESS && cache_result != simple_cache::NOSOLUTION)
+  unsigned int counter(0);
+  unsigned int solution_attempts(0); // attempts it took to find the solution, scores it in the cache
+  bool result = false; // state the function will return in
+  bool any_converged = false; // some attempt reached the pose, even if its answer was rejected
+  WorkerPoolPtr race_pool;
+  if( search_threads_ > 1 )
+    race_pool = acquireRacePool();
+  if( race_pool )
   {
-    //ROS_WARN_STREAM_NAMED("grasp","inserting into ik cache");
-
-    if( !result ) // no solution found
+    RaceJob job;
+    job.ik_pose = &ik_pose;
+    job.pose_desired = pose_desired;
+    job.start_state = &context->jnt_pos_in;
+    job.seed_state = &context->jnt_seed_state;
+    job.consistency_limits = &consistency_limits;
+    job.solution_callback = &solution_callback;
+    job.start_time = n1;
+    job.timeout = timeout;
+    searchRacing(job, race_pool);
+
+    result = job.found;
+    any_converged = job.any_converged.load();
+    if( result )
+      solution = job.solution;
+    error_code = job.error_code;
+    // Counted like the serial loop, which includes the final check for the timeout. The solution is scored by
+    // the attempts of its own stream, the other streams ran alongside it.
+    counter = job.attempts.load() + (result ? 0 : 1);
+    solution_attempts = job.winner_attempts;
+  }
+  else
+  {
+    while(1)
     {
-      // check if vector is all zeros
-      double sum = std::accumulate(solution.begin(),solution.end(),0);
-      simple_cache::results_t cache_result2;
-      if( !sum ) // all zeros, so no solution for real. TODO: this might cause us to miss future good poses
+      //    ROS_DEBUG_STREAM_NAMED("kdlc_kdl","Iteration: %d, time: %f, Timeout: %f",counter,(ros::WallTime::now()-n1).toSec(),timeout);
+      counter++;
+      if(timedOut(n1,timeout))
       {
-        cache_result2 = cache_->insert(ik_pose, solution, true);
+        ROS_DEBUG_STREAM_NAMED("kdlc","IK timed out");
+        error_code.val = error_code.TIMED_OUT;
+        result = false;
+        break;
       }
-      else // we will insert our closest approximation TODO: is this useful at all?
+      int ik_valid = context->ik_solver_pos->CartToJnt(context->jnt_pos_in,pose_desired,context->jnt_pos_out);
+      if(ik_valid >= 0)
+        any_converged = true;
+      if(!consistency_limits.empty())
       {
-        cache_result2 = cache_->insert(ik_pose, solution);
+        getRandomConfiguration(*context, context->jnt_seed_state, consistency_limits, context->jnt_pos_in);
+        if(ik_valid < 0 || !checkConsistency(context->jnt_seed_state, consistency_limits, context->jnt_pos_out))
+        {
+          ROS_DEBUG_NAMED("kdlc_kdl","Could not find IK solution");
+          continue;
+        }
       }
-      if( cache_result2 == simple_cache::SUCCESS )
+      else
       {
-        //ROS_INFO_STREAM_NAMED("grasp","insertion sucessful. cache is now size " << cache_->getSize());
+        getRandomConfiguration(*context, context->jnt_pos_in);
+        if(ik_valid < 0)
+        {
+          ROS_DEBUG_NAMED("kdlc_kdl","Could not find IK solution");
+          continue;
+        }
       }
-    }
-    //ROS_WARN_STREAM_NAMED("grasp","cache in thread has size " << cache_->getSize());
+      ROS_DEBUG_STREAM_NAMED("kdlc","Found IK solution");
+      for(unsigned int j=0; j < dimension_; j++)
+        solution[j] = context->jnt_pos_out(j);
+      if(!solution_callback.empty())
+        solution_callback(ik_pose,solution,error_code);
+      else
+        error_code.val = error_code.SUCCESS;
+
+      if(error_code.val == error_code.SUCCESS)
+      {
+        //ROS_DEBUG_STREAM("Solved after " << counter << " iterations");
+        result = true;
+        solution_attempts = counter;
+        break;
+      }
+    } // while
+  }
+
+  // --------------------------------------------------------------------------------------------------------
+  // DTC
+  // Remember verified solutions so the next request for this pose takes the fast path. A full bucket keeps the
+  // solutions that took the fewest attempts, and a solution replaces an earlier NOSOLUTION.
+  if( result )
+  {
+    cache_->insert(ik_pose, solution, false, getSolutionQuality(solution_attempts));
+  }
+  // Record a failure only if the pose was never reached within the time it had. A later request with more time
+  // or after the entry expired searches again. When the solver did reach the pose but the consistency limits or
+  // the callback rejected every answer, the pose is reachable and another caller may accept it, so nothing is
+  // recorded.
+  else if( !any_converged && cache_result != simple_cache::SUCCESS && cache_result != simple_cache::NOSOLUTION)
+  {
+    cache_->insertNoSolution(ik_pose, timeout);
   }
   // DTC
   // --------------------------------------------------------------------------------------------------------
 
+  // counter includes the final check for the timeout
+  metrics_->recordSearch(outcome, result, (ros::WallTime::now() - n1).toSec(), result ? counter : counter - 1);
+
   /*
     ROS_DEBUG_STREAM_NAMED("kdlc","An IK that satisifes the constraints and is collision free could not be found");
     error_code.val = error_code.NO_IK_SOLUTION;
@@ -523,6 +906,285 @@ bool KDLCKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
   return result;
 }
 
+bool KDLCKinematicsPlugin::searchPositionIKBatch(const std::vector<geometry_msgs::Pose> &ik_poses,
+                                                 const std::vector<std::vector<double> > &ik_seed_states,
+                                                 double timeout,
+                                                 std::vector<std::vector<double> > &solutions,
+                                                 std::vector<moveit_msgs::MoveItErrorCodes> &error_codes) const
+{
+  ros::WallTime n1 = ros::WallTime::now();
+  solutions.assign(ik_poses.size(), std::vector<double>());
+  error_codes.resize(ik_poses.size());
+  for(std::size_t i = 0; i < error_codes.size(); ++i)
+    error_codes[i].val = moveit_msgs::MoveItErrorCodes::NO_IK_SOLUTION;
+
+  if(!active_)
+  {
+    ROS_ERROR("kinematics not active");
+    return false;
+  }
+
+  if(ik_seed_states.size() != ik_poses.size() && ik_seed_states.size() != 1)
+  {
+    ROS_ERROR_STREAM("Need one seed state per pose or a single seed state, got " << ik_seed_states.size() <<
+                     " for " << ik_poses.size() << " poses");
+    return false;
+  }
+
+  for(std::size_t i = 0; i < ik_seed_states.size(); ++i)
+  {
+    if(ik_seed_states[i].size() != dimension_)
+    {
+      ROS_ERROR_STREAM("Seed state must have size " << dimension_ << " instead of size " << ik_seed_states[i].size());
+      return false;
+    }
+  }
+
+  // Look up the whole batch in the cache before starting any solver. Known failures are answered right away,
+  // everything else becomes a pending pose, seeded from the cache when it has something.
+  BatchJob job;
+  job.poses = &ik_poses;
+  job.timeout = timeout;
+  job.cache_results.resize(ik_poses.size(), simple_cache::NOTFOUND);
+  job.outcomes.resize(ik_poses.size(), simple_cache::IK_CACHE_MISS);
+  job.solutions = &solutions;
+  job.error_codes = &error_codes;
+  job.pending.reserve(ik_poses.size());
+
+  for(std::size_t i = 0; i < ik_poses.size(); ++i)
+  {
+    const std::vector<double>& ik_seed_state = ik_seed_states.size() == 1 ? ik_seed_states[0] : ik_seed_states[i];
+    solutions[i] = ik_seed_state;
+
+    job.cache_results[i] = cache_->get(ik_poses[i], ik_seed_state, solutions[i], timeout);
+    if( job.cache_results[i] == simple_cache::SUCCESS )
+    {
+      job.outcomes[i] = simple_cache::IK_CACHE_HIT;
+    }
+    else if( job.cache_results[i] == simple_cache::NOSOLUTION )
+    {
+      solutions[i].clear();
+      metrics_->recordSearch(simple_cache::IK_CACHE_NOSOLUTION, false, 0.0, 0);
+      continue;
+    }
+    else if( cache_nn_radius_ > 0 &&
+             cache_->getNearest(ik_poses[i], cache_nn_radius_, ik_seed_state, solutions[i]) == simple_cache::SUCCESS )
+    {
+      job.outcomes[i] = simple_cache::IK_CACHE_NEAREST;
+    }
+    job.pending.push_back(i);
+  }
+
+  if( !job.pending.empty() )
+  {
+    WorkerPoolPtr pool = getWorkerPool(batch_pool_, batch_threads_);
+
+    // Every worker keeps one context for the whole batch
+    for(std::size_t i = 0; i < pool->getNumWorkers(); ++i)
+      job.contexts.push_back(context_pool_->acquire());
+
+    pool->parallelFor(job.pending.size(), boost::bind(&KDLCKinematicsPlugin::solveBatchItem, this,
+                                                      boost::ref(job), _1, _2));
+
+    for(std::size_t i = 0; i < job.contexts.size(); ++i)
+      context_pool_->release(job.contexts[i]);
+  }
+
+  std::size_t num_solved = 0;
+  for(std::size_t i = 0; i < error_codes.size(); ++i)
+  {
+    if( error_codes[i].val == moveit_msgs::MoveItErrorCodes::SUCCESS )
+      ++num_solved;
+  }
+  ROS_DEBUG_STREAM_NAMED("kdlc","Solved " << num_solved << " of " << ik_poses.size() << " poses, " <<
+                         job.pending.size() << " searched, in " << (ros::WallTime::now() - n1).toSec() << "s");
+
+  return num_solved == ik_poses.size();
+}
+
+void KDLCKinematicsPlugin::solveBatchItem(BatchJob& job, std::size_t item, std::size_t worker) const
+{
+  ros::WallTime n1 = ros::WallTime::now();
+  const std::size_t index = job.pending[item];
+  const geometry_msgs::Pose& ik_pose = (*job.poses)[index];
+  std::vector<double>& solution = (*job.solutions)[index];
+  moveit_msgs::MoveItErrorCodes& error_code = (*job.error_codes)[index];
+  SolverContext& context = *job.contexts[worker];
+
+  KDL::Frame pose_desired;
+  tf::poseMsgToKDL(ik_pose, pose_desired);
+
+  for(unsigned int i=0; i < dimension_; i++)
+    context.jnt_seed_state(i) = solution[i];
+
+  // Same fast path as searchPositionIK()
+  if( job.cache_results[index] == simple_cache::SUCCESS )
+  {
+    context.jnt_pos_out = context.jnt_seed_state;
+    if( refineCachedSolution(context, pose_desired, context.jnt_pos_out, cache_refine_iterations_) )
+    {
+      for(unsigned int j=0; j < dimension_; j++)
+        solution[j] = context.jnt_pos_out(j);
+      error_code.val = error_code.SUCCESS;
+      metrics_->recordSearch(job.outcomes[index], true, (ros::WallTime::now() - n1).toSec(), 0);
+      return;
+    }
+  }
+
+  context.jnt_pos_in = context.jnt_seed_state;
+
+  unsigned int counter(0);
+  bool result = false;
+  while(1)
+  {
+    counter++;
+    if(timedOut(n1,job.timeout))
+    {
+      error_code.val = error_code.TIMED_OUT;
+      break;
+    }
+    if(context.ik_solver_pos->CartToJnt(context.jnt_pos_in,pose_desired,context.jnt_pos_out) >= 0)
+    {
+      result = true;
+      break;
+    }
+    getRandomConfiguration(context, context.jnt_pos_in);
+  }
+
+  if( result )
+  {
+    for(unsigned int j=0; j < dimension_; j++)
+      solution[j] = context.jnt_pos_out(j);
+    error_code.val = error_code.SUCCESS;
+    cache_->insert(ik_pose, solution, false, getSolutionQuality(counter));
+  }
+  else
+  {
+    solution.clear();
+    if( job.cache_results[index] != simple_cache::SUCCESS )
+      cache_->insertNoSolution(ik_pose, job.timeout);
+  }
+
+  // counter includes the final check for the timeout
+  metrics_->recordSearch(job.outcomes[index], result, (ros::WallTime::now() - n1).toSec(),
+                         result ? counter : counter - 1);
+}
+
+void KDLCKinematicsPlugin::searchRacing(RaceJob& job, const WorkerPoolPtr& pool) const
+{
+  for(std::size_t i = 0; i < pool->getNumWorkers(); ++i)
+    job.contexts.push_back(context_pool_->acquire());
+
+  pool->parallelFor(search_threads_, boost::bind(&KDLCKinematicsPlugin::raceStream, this, boost::ref(job), _1, _2));
+
+  for(std::size_t i = 0; i < job.contexts.size(); ++i)
+    context_pool_->release(job.contexts[i]);
+  releaseRacePool(pool);
+
+  if( !job.found )
+  {
+    ROS_DEBUG_STREAM_NAMED("kdlc","IK timed out");
+    job.error_code.val = job.error_code.TIMED_OUT;
+  }
+}
+
+void KDLCKinematicsPlugin::raceStream(RaceJob& job, std::size_t stream, std::size_t worker) const
+{
+  SolverContext& context = *job.contexts[worker];
+  const std::vector<double>& consistency_limits = *job.consistency_limits;
+  context.random_stream.setSeed(search_seed_, stream);
+  context.jnt_seed_state = *job.seed_state;
+
+  // Stream 0 starts where the serial search would, the others somewhere else
+  if( stream == 0 )
+    context.jnt_pos_in = *job.start_state;
+  else if( !consistency_limits.empty() )
+    getRandomConfiguration(context, context.jnt_seed_state, consistency_limits, context.jnt_pos_in);
+  else
+    getRandomConfiguration(context, context.jnt_pos_in);
+
+  std::vector<double> solution(dimension_);
+  moveit_msgs::MoveItErrorCodes error_code;
+  unsigned int stream_attempts = 0;
+  while( !job.done.load(boost::memory_order_acquire) && !timedOut(job.start_time, job.timeout) )
+  {
+    ++stream_attempts;
+    job.attempts.fetch_add(1, boost::memory_order_relaxed);
+    const int ik_valid = context.ik_solver_pos->CartToJnt(context.jnt_pos_in, job.pose_desired, context.jnt_pos_out);
+    if( ik_valid >= 0 )
+      job.any_converged.store(true, boost::memory_order_relaxed);
+    const bool valid = ik_valid >= 0 && (consistency_limits.empty() ||
+      checkConsistency(context.jnt_seed_state, consistency_limits, context.jnt_pos_out));
+    if( valid )
+    {
+      for(unsigned int j=0; j < dimension_; j++)
+        solution[j] = context.jnt_pos_out(j);
+    }
+
+    // Next restart of this stream, used when this attempt failed or its solution is rejected
+    if( !consistency_limits.empty() )
+      getRandomConfiguration(context, context.jnt_seed_state, consistency_limits, context.jnt_pos_in);
+    else
+      getRandomConfiguration(context, context.jnt_pos_in);
+
+    if( !valid )
+      continue;
+
+    // The callback usually checks collisions against a planning scene, do not assume it is thread safe
+    boost::mutex::scoped_lock lock(job.mutex);
+    if( job.done.load(boost::memory_order_relaxed) )
+      break;
+
+    if(!job.solution_callback->empty())
+      (*job.solution_callback)(*job.ik_pose, solution, error_code);
+    else
+      error_code.val = error_code.SUCCESS;
+
+    if(error_code.val == error_code.SUCCESS)
+    {
+      ROS_DEBUG_STREAM_NAMED("kdlc","Found IK solution in restart stream " << stream);
+      job.solution = solution;
+      job.error_code = error_code;
+      job.found = true;
+      job.winner_attempts = stream_attempts;
+      job.done.store(true, boost::memory_order_release);
+    }
+  }
+}
+
+WorkerPoolPtr KDLCKinematicsPlugin::getWorkerPool(WorkerPoolPtr& pool, int num_workers) const
+{
+  boost::mutex::scoped_lock lock(pool_mutex_);
+  if( !pool )
+    pool.reset(new WorkerPool(num_workers));
+  return pool;
+}
+
+WorkerPoolPtr KDLCKinematicsPlugin::acquireRacePool() const
+{
+  {
+    boost::mutex::scoped_lock lock(pool_mutex_);
+    if( !free_race_pools_.empty() )
+    {
+      WorkerPoolPtr pool = free_race_pools_.back();
+      free_race_pools_.pop_back();
+      return pool;
+    }
+    if( num_race_pools_ >= max_race_pools_ )
+      return WorkerPoolPtr();
+    ++num_race_pools_;
+  }
+
+  // Starting the threads takes a while, do it outside of the lock
+  return WorkerPoolPtr(new WorkerPool(search_threads_));
+}
+
+void KDLCKinematicsPlugin::releaseRacePool(const WorkerPoolPtr& pool) const
+{
+  boost::mutex::scoped_lock lock(pool_mutex_);
+  free_race_pools_.push_back(pool);
+}
+
 bool KDLCKinematicsPlugin::getPositionFK(const std::vector<std::string> &link_names,
                                          const std::vector<double> &joint_angles,
                                          std::vector<geometry_msgs::Pose> &poses) const
@@ -544,22 +1206,35 @@ bool KDLCKinematicsPlugin::getPositionFK(const std::vector<std::string> &link_na
     return false;
   }
 
-  KDL::Frame p_out;
-  geometry_msgs::PoseStamped pose;
-  tf::Stamped<tf::Pose> tf_pose;
+  ScopedSolverContext context(*context_pool_);
 
-  for(unsigned int i=0; i < dimension_; i++)
+  // Resolve the links first, to know how far down the chain the walk has to go
+  std::vector<int>& link_segments = context->link_segments;
+  link_segments.resize(link_names.size());
+  int last_segment = 0;
+  for(std::size_t i = 0; i < link_names.size(); ++i)
   {
-    jnt_pos_in_(i) = joint_angles[i];
+    link_segments[i] = getKDLSegmentIndex(link_names[i]);
+    last_segment = std::max(last_segment, link_segments[i]);
+  }
+
+  // One walk down the chain computes the frames of all links, instead of one walk per link
+  std::vector<KDL::Frame>& segment_frames = context->segment_frames;
+  segment_frames[0] = KDL::Frame::Identity();
+  unsigned int joint = 0;
+  for(int s = 0; s < last_segment; ++s)
+  {
+    const KDL::Segment& segment = kdl_chain_.getSegment(s);
+    const double q = segment.getJoint().getType() != KDL::Joint::None ? joint_angles[joint++] : 0.0;
+    segment_frames[s + 1] = segment_frames[s] * segment.pose(q);
   }
 
   bool valid = true;
-  for(unsigned int i=0; i < poses.size(); i++)
+  for(std::size_t i = 0; i < link_names.size(); ++i)
   {
-    ROS_DEBUG_STREAM_NAMED("kdlc_kdl","End effector index: " << getKDLSegmentIndex(link_names[i]));
-    if(fk_solver_->JntToCart(jnt_pos_in_,p_out,getKDLSegmentIndex(link_names[i])) >=0)
+    if(link_segments[i] >= 0)
     {
-      tf::poseKDLToMsg(p_out,poses[i]);
+      tf::poseKDLToMsg(segment_frames[link_segments[i]],poses[i]);
     }
     else
     {
@@ -570,6 +1245,44 @@ bool KDLCKinematicsPlugin::getPositionFK(const std::vector<std::string> &link_na
   return valid;
 }
 
+bool KDLCKinematicsPlugin::getPositionFKBatch(const std::vector<double> &joint_batch,
+                                              std::size_t num_configs,
+                                              std::vector<geometry_msgs::Pose> &poses) const
+{
+  if(!active_)
+  {
+    ROS_ERROR("kinematics not active");
+    return false;
+  }
+  if(joint_batch.size() != num_configs * dimension_)
+  {
+    ROS_ERROR("Joint batch vector must have size: %zu",num_configs * dimension_);
+    return false;
+  }
+
+  std::vector<KDL::Frame> frames(num_configs);
+  if(batch_fk_->isValid())
+  {
+    if(num_configs > 0)
+      batch_fk_->computeTipFrames(&joint_batch[0], num_configs, num_configs, &frames[0]);
+  }
+  else
+  {
+    ScopedSolverContext context(*context_pool_);
+    for(std::size_t c = 0; c < num_configs; ++c)
+    {
+      for(unsigned int j = 0; j < dimension_; ++j)
+        context->jnt_pos_in(j) = joint_batch[j * num_configs + c];
+      context->fk_solver.JntToCart(context->jnt_pos_in, frames[c]);
+    }
+  }
+
+  poses.resize(num_configs);
+  for(std::size_t c = 0; c < num_configs; ++c)
+    tf::poseKDLToMsg(frames[c],poses[c]);
+  return true;
+}
+
 const std::vector<std::string>& KDLCKinematicsPlugin::getJointNames() const
 {
   return ik_chain_info_.joint_names;
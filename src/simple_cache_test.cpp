@@ -37,16 +37,30 @@
 */
 
 #include <moveit/kdlc_kinematics_plugin/simple_cache.h>
+#include <moveit/kdlc_kinematics_plugin/cache_registry.h>
+#include <moveit/kdlc_kinematics_plugin/worker_pool.h>
 #include <geometry_msgs/Pose.h>
-#include <stdlib.h> // rand
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real.hpp>
+#include <boost/random/normal_distribution.hpp>
+#include <boost/random/variate_generator.hpp>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h> // rand, mkdtemp, strtoul
+#include <string.h> // strcmp
+#include <math.h> // sin
 #include <stdio.h> // remove
+#include <unistd.h> // sysconf
 #include <time.h>
 
 namespace simple_cache_test
 {
 
 static const int NUM_JOINTS = 7;
-static const std::string CACHE_LOCATION = "/home/dave/.ros/kdlc_test_cache.dat";
+// Set by main to a file in a temporary directory
+static std::string cache_location;
 
 double fRand(double fMin, double fMax)
 {
@@ -101,11 +115,11 @@ void runTests(int num_tests)
   double total_missed = 0;
 
   // ---------------------------------------------------------------------------------------------------------
-  // Create random value ranges
-  double joint_hi = simple_cache_test::fRand(-5,10);
-  double joint_low = simple_cache_test::fRand(-10,joint_hi);
-  double pose_hi = simple_cache_test::fRand(-5,10);
-  double pose_low = simple_cache_test::fRand(-10,pose_hi);
+  // Fixed value ranges, so runs are comparable
+  double joint_hi = 2.7;
+  double joint_low = -2.7;
+  double pose_hi = 1.0;
+  double pose_low = -1.0;
 
   // Create instance of simple cache
   simple_cache::SimpleCache cache(simple_cache_test::NUM_JOINTS, verbose, joint_hi, joint_low, pose_hi, pose_low);
@@ -115,14 +129,14 @@ void runTests(int num_tests)
     cache.printLimits();
 
   // Delete previous cache
-  remove(CACHE_LOCATION.c_str());
+  remove(cache_location.c_str());
 
   // Read in previous cache
-  cache.readFile(CACHE_LOCATION);
+  cache.readFile(cache_location);
 
   // Begin to append new data to file
   if( live_write )
-    cache.startAppend(CACHE_LOCATION);
+    cache.startAppend(cache_location);
 
   // ---------------------------------------------------------------------------------------------------------
   // Create sets of fake data
@@ -254,7 +268,7 @@ void runTests(int num_tests)
 
   // Write cache to disk if we haven't already been doing it live
   if( !live_write )
-    cache.writeFile(CACHE_LOCATION);
+    cache.writeFile(cache_location);
 
 
   ROS_INFO_STREAM_NAMED("","Tests Complete ---------------------------------------------------------------");
@@ -280,31 +294,1210 @@ void runTests(int num_tests)
 
 }
 
-} // end namespace
+/**
+ * @brief Time insert and get on each storage engine and key encoding using the same data
+ * @param num_tests number of random key value pairs
+ */
+void runStorageBenchmark(int num_tests)
+{
+  static const double JOINT_HI = 2.7;
+  static const double JOINT_LOW = -2.7;
+  static const double POSE_HI = 1.0;
+  static const double POSE_LOW = -1.0;
 
-int main(int argc, char *argv[])
+  std::vector< std::pair<geometry_msgs::Pose,std::vector<double> > > test_data(num_tests);
+  for (int i = 0; i < num_tests; ++i)
+  {
+    simple_cache_test::getRandomPose(test_data[i].first, POSE_HI, POSE_LOW);
+    simple_cache_test::getRandomJoints(test_data[i].second, JOINT_HI, JOINT_LOW);
+  }
+
+  const simple_cache::storage_t storages[] = {simple_cache::MAP_STORAGE, simple_cache::FLAT_HASH_STORAGE};
+  const char* storage_names[] = {"std::map", "flat hash"};
+  const char* encoding_names[] = {"decimal", "bit packed"};
+
+  ROS_INFO_STREAM_NAMED("","Storage Benchmark -----------------------------------------------------------");
+  for (std::size_t t = 0; t < 4; ++t)
+  {
+    const std::size_t s = t % 2;
+    const std::size_t e = t / 2;
+    simple_cache::SimpleCache cache(NUM_JOINTS, false, JOINT_HI, JOINT_LOW, POSE_HI, POSE_LOW, storages[s]);
+    if( e == 1 )
+      cache.setBitPacking();
+
+    ros::WallTime start_time = ros::WallTime::now();
+    for (int i = 0; i < num_tests; ++i)
+      cache.insert(test_data[i].first, test_data[i].second);
+    double insert_duration = (ros::WallTime::now() - start_time).toSec();
+
+    int num_found = 0;
+    double total_error = 0;
+    std::vector<double> joint_values;
+    start_time = ros::WallTime::now();
+    for (int i = 0; i < num_tests; ++i)
+    {
+      if( cache.get(test_data[i].first, joint_values) == simple_cache::SUCCESS )
+      {
+        ++num_found;
+        total_error += fabs(joint_values[0] - test_data[i].second[0]);
+      }
+    }
+    double get_duration = (ros::WallTime::now() - start_time).toSec();
+
+    ROS_INFO_STREAM_NAMED("",storage_names[s] << ", " << encoding_names[e] << ": " << cache.getSize()
+                          << " entries, insert " << insert_duration / num_tests * 1e9 << " ns/op, get "
+                          << get_duration / num_tests * 1e9 << " ns/op, " << num_found << " found, avg error "
+                          << total_error / num_found);
+  }
+}
+
+/**
+ * @brief Check how many slightly moved poses miss their exact bin but are found with getNearest
+ * @param num_tests number of random key value pairs
+ */
+void runNearestBenchmark(int num_tests)
 {
-  int num_tests = 1000000;
-  //int num_tests = 10;
+  static const double NOISE = 0.002;
+  static const double RADIUS = 0.05;
 
-  // initialize ros time without using node handle
-  ros::Time::init();
+  simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+  cache.enableNearest(0.1);
+
+  std::vector<geometry_msgs::Pose> poses(num_tests);
+  for (int i = 0; i < num_tests; ++i)
+  {
+    std::vector<double> joints;
+    simple_cache_test::getRandomPose(poses[i], 1.0, -1.0);
+    simple_cache_test::getRandomJoints(joints, 2.7, -2.7);
+    cache.insert(poses[i], joints);
+  }
+
+  int num_exact = 0;
+  int num_nearest = 0;
+  std::vector<double> joint_values;
+  ros::WallTime start_time = ros::WallTime::now();
+  for (int i = 0; i < num_tests; ++i)
+  {
+    geometry_msgs::Pose pose = poses[i];
+    pose.position.x += fRand(-NOISE, NOISE);
+    pose.position.y += fRand(-NOISE, NOISE);
+    pose.position.z += fRand(-NOISE, NOISE);
+
+    if( cache.get(pose, joint_values) == simple_cache::SUCCESS )
+      ++num_exact;
+    else if( cache.getNearest(pose, RADIUS, joint_values) == simple_cache::SUCCESS )
+      ++num_nearest;
+  }
+  double duration = (ros::WallTime::now() - start_time).toSec();
+
+  ROS_INFO_STREAM_NAMED("","Nearest Benchmark -----------------------------------------------------------");
+  ROS_INFO_STREAM_NAMED("","Poses moved by up to " << NOISE << ": " << num_exact << " exact hits, " << num_nearest
+                        << " nearest hits, " << num_tests - num_exact - num_nearest << " misses, "
+                        << duration / num_tests * 1e9 << " ns/op");
+}
+
+/**
+ * @brief Check that SE(3) pose keys give q and -q the same key
+ * @param num_tests number of random key value pairs
+ * @return true if every pose was found with -q
+ */
+bool runPoseKeyingTest(int num_tests)
+{
+  simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+  const double workspace_low[] = {-1.0, -1.0, -1.0};
+  const double workspace_high[] = {1.0, 1.0, 1.0};
+  cache.setPoseResolution(0.005, 0.02, workspace_low, workspace_high);
+
+  int num_flipped_hits = 0;
+  std::vector<double> joint_values;
+  for (int i = 0; i < num_tests; ++i)
+  {
+    geometry_msgs::Pose pose;
+    std::vector<double> joints;
+    simple_cache_test::getRandomPose(pose, 1.0, -1.0);
+    simple_cache_test::getRandomJoints(joints, 2.7, -2.7);
+    cache.insert(pose, joints);
+
+    pose.orientation.x = -pose.orientation.x;
+    pose.orientation.y = -pose.orientation.y;
+    pose.orientation.z = -pose.orientation.z;
+    pose.orientation.w = -pose.orientation.w;
+    if( cache.get(pose, joint_values) == simple_cache::SUCCESS )
+      ++num_flipped_hits;
+  }
+
+  ROS_INFO_STREAM_NAMED("","Pose Keying Test ------------------------------------------------------------");
+  ROS_INFO_STREAM_NAMED("","SE(3) keys: " << num_flipped_hits << " of " << num_tests << " poses found with -q");
+  return num_flipped_hits == num_tests;
+}
+
+/**
+ * @brief Check that get() with a seed picks the closest of several solutions stored for a pose
+ * @param num_tests number of random poses
+ * @return true if the closest solution was returned for every pose
+ */
+bool runBucketTest(int num_tests)
+{
+  simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+  cache.setBitPacking();
+  cache.setMaxSolutions(simple_cache::CacheEntry::MAX_SOLUTIONS);
+
+  int num_closest = 0;
+  std::vector<double> joint_values;
+  for (int i = 0; i < num_tests; ++i)
+  {
+    geometry_msgs::Pose pose;
+    simple_cache_test::getRandomPose(pose, 1.0, -1.0);
+
+    std::vector<std::vector<double> > solutions(simple_cache::CacheEntry::MAX_SOLUTIONS);
+    for (std::size_t j = 0; j < solutions.size(); ++j)
+    {
+      simple_cache_test::getRandomJoints(solutions[j], 2.7, -2.7);
+      cache.insert(pose, solutions[j]);
+    }
+
+    // Ask with a seed near one of the solutions
+    const std::size_t target = rand() % solutions.size();
+    if( cache.get(pose, solutions[target], joint_values) != simple_cache::SUCCESS )
+      continue;
+
+    double error = 0;
+    for (std::size_t j = 0; j < joint_values.size(); ++j)
+      error = std::max(error, fabs(joint_values[j] - solutions[target][j]));
+    if( error < 0.05 )
+      ++num_closest;
+  }
+
+  ROS_INFO_STREAM_NAMED("","Bucket Test -----------------------------------------------------------------");
+  ROS_INFO_STREAM_NAMED("","Closest of " << simple_cache::CacheEntry::MAX_SOLUTIONS << " solutions returned for "
+                        << num_closest << " of " << num_tests << " poses");
+  return num_closest == num_tests;
+}
+
+/**
+ * @brief Max joint difference, to tell which solution the cache returned
+ */
+double jointError(const std::vector<double>& a, const std::vector<double>& b)
+{
+  double error = 0;
+  for (std::size_t j = 0; j < a.size() && j < b.size(); ++j)
+    error = std::max(error, fabs(a[j] - b[j]));
+  return error;
+}
+
+/**
+ * @brief A scored solution should replace a NOSOLUTION entry and the worst solution of a full bucket, and a
+ *        replayed journal should end up with the same buckets
+ * @param num_tests number of poses
+ * @return true if every pose behaved as expected, before and after the replay
+ */
+bool runQualityTest(int num_tests)
+{
+  const std::string journal_path = cache_location + ".quality.journal";
+  remove(journal_path.c_str());
+
+  std::vector<geometry_msgs::Pose> poses(num_tests);
+  std::vector<std::vector<std::vector<double> > > solutions(num_tests, std::vector<std::vector<double> >(4));
+  int num_correct = 0;
+  bool passed;
+  {
+    simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+    cache.setBitPacking();
+    cache.setMaxSolutions(2);
+    cache.startAppend(journal_path);
+
+    std::vector<double> joint_values;
+    for (int i = 0; i < num_tests; ++i)
+    {
+      simple_cache_test::getRandomPose(poses[i], 1.0, -1.0);
+      for (std::size_t j = 0; j < solutions[i].size(); ++j)
+        simple_cache_test::getRandomJoints(solutions[i][j], 2.7, -2.7);
+
+      cache.insert(poses[i], joint_values, true);
+      bool correct = cache.insert(poses[i], solutions[i][0], false, 100) == simple_cache::SUCCESS && // replaces NOSOLUTION
+        cache.insert(poses[i], solutions[i][1], false, 50) == simple_cache::SUCCESS &&  // fills the bucket
+        cache.insert(poses[i], solutions[i][2], false, 200) == simple_cache::SUCCESS && // replaces the 50
+        cache.insert(poses[i], solutions[i][3], false, 10) == simple_cache::DUPLICATE;  // worse than both
+      if( correct )
+        ++num_correct;
+    }
+    ROS_INFO_STREAM_NAMED("","Quality Test ----------------------------------------------------------------");
+    ROS_INFO_STREAM_NAMED("","Replacements as expected for " << num_correct << " of " << num_tests << " poses, "
+                          << cache.getStats().num_replacements << " replacements");
+    passed = num_correct == num_tests;
+  }
+
+  // The replayed buckets hold the first and third solution
+  simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+  cache.setBitPacking();
+  cache.setMaxSolutions(2);
+  cache.replayJournal(journal_path);
+
+  num_correct = 0;
+  std::vector<double> joint_values;
+  for (int i = 0; i < num_tests; ++i)
+  {
+    bool correct = true;
+    for (std::size_t j = 0; j < solutions[i].size() && correct; ++j)
+    {
+      correct = cache.get(poses[i], solutions[i][j], joint_values) == simple_cache::SUCCESS &&
+        (jointError(joint_values, solutions[i][j]) < 0.05) == (j == 0 || j == 2);
+    }
+    if( correct )
+      ++num_correct;
+  }
+  ROS_INFO_STREAM_NAMED("","Replayed buckets as expected for " << num_correct << " of " << num_tests << " poses");
+
+  remove(journal_path.c_str());
+  return passed && num_correct == num_tests;
+}
+
+/**
+ * @brief A failed pose should be rejected for requests with no more time than the failed search, retried with
+ *        more time or once it expired, and last longer after every further failure, also after a replay
+ * @param num_tests number of poses
+ * @return true if every pose behaved as expected, before and after the replay
+ */
+bool runNoSolutionTest(int num_tests)
+{
+  const std::string journal_path = cache_location + ".nosolution.journal";
+  remove(journal_path.c_str());
+
+  const double ttl = 0.5;
+  std::vector<geometry_msgs::Pose> poses(num_tests);
+  std::vector<double> joint_values;
+  int num_correct = 0;
+  bool passed;
+  {
+    simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+    cache.setNoSolutionExpiry(ttl);
+    cache.startAppend(journal_path);
+
+    for (int i = 0; i < num_tests; ++i)
+    {
+      simple_cache_test::getRandomPose(poses[i], 1.0, -1.0);
+      cache.insertNoSolution(poses[i], 0.1);
+
+      // Every other pose fails again with more time
+      bool correct = cache.get(poses[i], joint_values, joint_values, 0.1) == simple_cache::NOSOLUTION &&
+        cache.get(poses[i], joint_values, joint_values, 0.5) == simple_cache::NOTFOUND;
+      if( i % 2 == 0 )
+      {
+        cache.insertNoSolution(poses[i], 0.5);
+        correct = correct && cache.get(poses[i], joint_values, joint_values, 0.5) == simple_cache::NOSOLUTION;
+      }
+      if( correct )
+        ++num_correct;
+    }
+
+    ROS_INFO_STREAM_NAMED("","No Solution Test ------------------------------------------------------------");
+    ROS_INFO_STREAM_NAMED("","Rejected or retried as expected for " << num_correct << " of " << num_tests << " poses");
+    passed = num_correct == num_tests;
+  }
+
+  // After ttl only the poses that failed twice are still rejected, by the replayed cache as well
+  ros::WallDuration(ttl * 1.5).sleep();
+  simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+  cache.setNoSolutionExpiry(ttl);
+  cache.replayJournal(journal_path);
+
+  num_correct = 0;
+  for (int i = 0; i < num_tests; ++i)
+  {
+    const simple_cache::results_t expected = i % 2 == 0 ? simple_cache::NOSOLUTION : simple_cache::NOTFOUND;
+    if( cache.get(poses[i], joint_values, joint_values, 0.1) == expected )
+      ++num_correct;
+  }
+  ROS_INFO_STREAM_NAMED("","Expired as expected for " << num_correct << " of " << num_tests << " poses after "
+                        << ttl * 1.5 << " s, " << cache.getStats().num_nosolutions_retries << " retries");
+
+  remove(journal_path.c_str());
+  return passed && num_correct == num_tests;
+}
+
+/**
+ * @brief Compare loading the same cache from a text file and from a mapped binary file
+ * @param num_tests number of random key value pairs
+ */
+void runFileBenchmark(int num_tests)
+{
+  const std::string text_path = cache_location + ".txt";
+  const std::string binary_path = cache_location + ".bin";
+  const std::string journal_path = cache_location + ".journal";
+  remove(journal_path.c_str());
+
+  ROS_INFO_STREAM_NAMED("","File Benchmark --------------------------------------------------------------");
+
+  std::vector<geometry_msgs::Pose> poses(num_tests);
+  {
+    simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+    cache.setBitPacking();
+    cache.startAppend(journal_path);
+
+    std::vector<std::vector<double> > joints(num_tests);
+    for (int i = 0; i < num_tests; ++i)
+    {
+      simple_cache_test::getRandomPose(poses[i], 1.0, -1.0);
+      simple_cache_test::getRandomJoints(joints[i], 2.7, -2.7);
+    }
+
+    ros::WallTime start_time = ros::WallTime::now();
+    for (int i = 0; i < num_tests; ++i)
+      cache.insert(poses[i], joints[i]);
+    double duration = (ros::WallTime::now() - start_time).toSec();
+    ROS_INFO_STREAM_NAMED("","insert with journal: " << duration / num_tests * 1e9 << " ns/op");
+
+    cache.writeFile(text_path);
+    cache.writeBinaryFile(binary_path);
+  }
+
+  const std::string paths[] = {text_path, binary_path, journal_path};
+  const char* path_names[] = {"text", "binary", "journal"};
+  for (std::size_t f = 0; f < 3; ++f)
+  {
+    simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+    cache.setBitPacking();
+
+    ros::WallTime start_time = ros::WallTime::now();
+    cache.readFile(paths[f]);
+    double duration = (ros::WallTime::now() - start_time).toSec();
+
+    int num_found = 0;
+    std::vector<double> joint_values;
+    start_time = ros::WallTime::now();
+    for (int i = 0; i < num_tests; ++i)
+    {
+      if( cache.get(poses[i], joint_values) == simple_cache::SUCCESS )
+        ++num_found;
+    }
+    double get_duration = (ros::WallTime::now() - start_time).toSec();
+
+    ROS_INFO_STREAM_NAMED("",path_names[f] << " file: loaded " << cache.getSize() << " keys in "
+                          << duration * 1e3 << " ms, then found " << num_found << " at "
+                          << get_duration / num_tests * 1e9 << " ns/op");
+  }
+
+  remove(text_path.c_str());
+  remove(binary_path.c_str());
+  remove(journal_path.c_str());
+}
+
+/**
+ * @brief A hot set of poses that is looked up again and again, mixed with a stream of poses seen only once.
+ *        With a memory budget the hot set should stay resident while memory stays bounded, and compaction
+ *        should keep the files on disk from growing.
+ * @return true if memory stayed within the budget and the reload holds every resident key
+ */
+bool runEvictionTest(int num_tests)
+{
+  static const std::size_t BUDGET = 1 << 20;
+  const std::string snapshot_path = cache_location + ".snapshot";
+  const std::string journal_path = cache_location + ".journal";
+  remove(snapshot_path.c_str());
+  remove(journal_path.c_str());
+  remove(simple_cache::getRotatedJournalPath(journal_path).c_str());
+
+  const int num_hot = 2000;
+  std::vector<geometry_msgs::Pose> hot_poses(num_hot);
+  std::vector<std::vector<double> > hot_joints(num_hot);
+  for (int i = 0; i < num_hot; ++i)
+  {
+    simple_cache_test::getRandomPose(hot_poses[i], 1.0, -1.0);
+    simple_cache_test::getRandomJoints(hot_joints[i], 2.7, -2.7);
+  }
+
+  ROS_INFO_STREAM_NAMED("","Eviction Test ---------------------------------------------------------------");
+  std::size_t num_keys;
+  bool within_budget;
+  {
+    simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+    cache.setBitPacking();
+    cache.setMemoryBudget(BUDGET);
+
+    simple_cache::AppendWriterOptions options;
+    options.compact_records = num_tests / 10 + 1;
+    options.flush_interval = 0.01;
+    cache.startAppend(journal_path, options, snapshot_path);
+
+    int num_hot_hits = 0;
+    int num_hot_gets = 0;
+    std::vector<double> joint_values;
+    for (int i = 0; i < num_tests; ++i)
+    {
+      const int h = rand() % num_hot;
+      if( cache.get(hot_poses[h], joint_values) == simple_cache::SUCCESS )
+        ++num_hot_hits;
+      else
+        cache.insert(hot_poses[h], hot_joints[h]);
+      ++num_hot_gets;
+
+      geometry_msgs::Pose cold_pose;
+      std::vector<double> cold_joints;
+      simple_cache_test::getRandomPose(cold_pose, 1.0, -1.0);
+      simple_cache_test::getRandomJoints(cold_joints, 2.7, -2.7);
+      cache.insert(cold_pose, cold_joints);
+    }
+
+    const simple_cache::CacheStats stats = cache.getStats();
+    num_keys = stats.size;
+    ROS_INFO_STREAM_NAMED("",stats.memory_usage / 1024 << " KiB used of a " << BUDGET / 1024 << " KiB budget, "
+                          << stats.size << " keys, " << stats.num_evictions << " evictions, hot set hit rate "
+                          << double(num_hot_hits) / num_hot_gets);
+    within_budget = stats.memory_usage <= BUDGET;
+  }
+
+  struct stat snapshot_stat, journal_stat;
+  if( stat(snapshot_path.c_str(), &snapshot_stat) == 0 && stat(journal_path.c_str(), &journal_stat) == 0 )
+    ROS_INFO_STREAM_NAMED("","snapshot " << snapshot_stat.st_size / 1024 << " KiB, journal "
+                          << journal_stat.st_size / 1024 << " KiB after " << 2 * num_tests << " insertions");
+
+  // Reload the way the plugin does at startup
+  simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+  cache.setBitPacking();
+  cache.readFile(snapshot_path);
+  if( access(simple_cache::getRotatedJournalPath(journal_path).c_str(), R_OK) == 0 )
+    cache.replayJournal(simple_cache::getRotatedJournalPath(journal_path));
+  cache.replayJournal(journal_path);
+
+  // Keys evicted after the last compaction are still in the snapshot, so the reload can only hold more
+  ROS_INFO_STREAM_NAMED("","reloaded " << cache.getSize() << " keys, " << num_keys << " were resident");
+
+  remove(snapshot_path.c_str());
+  remove(journal_path.c_str());
+  return within_budget && cache.getSize() >= num_keys;
+}
+
+simple_cache::SimpleCachePtr createMetricsTestCache()
+{
+  simple_cache::SimpleCachePtr cache(new simple_cache::SimpleCache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0,
+                                                                   simple_cache::FLAT_HASH_STORAGE));
+  cache->setBitPacking();
+  return cache;
+}
+
+/**
+ * @brief Checks that the stats of a registered cache add up and prints the JSON report
+ * @param num_tests number of lookups
+ * @return true if every lookup was counted, about half of them hit and the IK metrics match what was recorded
+ */
+bool runMetricsTest(int num_tests)
+{
+  const simple_cache::CacheId id("robot_description", "test_group", "base", "tip");
+  simple_cache::SimpleCachePtr cache = simple_cache::CacheRegistry::getInstance().getCache(id, &createMetricsTestCache);
+  simple_cache::IKMetricsPtr metrics = simple_cache::CacheRegistry::getInstance().getMetrics(id);
+
+  // The metrics of a chain live as long as the process, only count what this test adds
+  const uint64_t hits_before = metrics->getLatency(simple_cache::IK_CACHE_HIT).getCount();
+  const uint64_t misses_before = metrics->getLatency(simple_cache::IK_CACHE_MISS).getCount();
+  const uint64_t solved_before = metrics->getNumSolved();
+
+  // Every other pose is inserted, so half of the lookups should hit
+  int num_hits = 0;
+  std::vector<double> joint_values;
+  for (int i = 0; i < num_tests; ++i)
+  {
+    geometry_msgs::Pose pose;
+    std::vector<double> joints;
+    simple_cache_test::getRandomPose(pose, 1.0, -1.0);
+    simple_cache_test::getRandomJoints(joints, 2.7, -2.7);
+    if( i % 2 == 0 )
+      cache->insert(pose, joints);
+
+    ros::WallTime start_time = ros::WallTime::now();
+    const bool hit = cache->get(pose, joint_values) == simple_cache::SUCCESS;
+    if( hit )
+      ++num_hits;
+    metrics->recordSearch(hit ? simple_cache::IK_CACHE_HIT : simple_cache::IK_CACHE_MISS, true,
+                          (ros::WallTime::now() - start_time).toSec(), hit ? 0 : 1 + rand() % 20);
+  }
+
+  const simple_cache::CacheStats stats = cache->getStats();
+  ROS_INFO_STREAM_NAMED("","Metrics Test ----------------------------------------------------------------");
+  ROS_INFO_STREAM_NAMED("","hit rate " << stats.getHitRate() << ", " << stats.num_matches + stats.num_misses
+                        << " of " << num_tests << " lookups counted, " << stats.memory_usage / 1024 << " KiB");
+
+  std::stringstream json;
+  simple_cache::CacheRegistry::getInstance().writeJson(json);
+  ROS_INFO_STREAM_NAMED("",json.str());
+
+  // Poses that were not inserted only hit if they share a key with an earlier one, which is rare
+  const int num_inserted = (num_tests + 1) / 2;
+  return stats.num_matches + stats.num_misses == uint64_t(num_tests) &&
+    num_hits >= num_inserted && num_hits <= num_inserted + num_tests / 20 &&
+    metrics->getLatency(simple_cache::IK_CACHE_HIT).getCount() - hits_before == uint64_t(num_hits) &&
+    metrics->getLatency(simple_cache::IK_CACHE_MISS).getCount() - misses_before == uint64_t(num_tests - num_hits) &&
+    metrics->getNumSolved() - solved_before == uint64_t(num_tests);
+}
+
+/**
+ * @brief One thread of the concurrency benchmark: mostly gets of preloaded poses with some insertions of new ones
+ */
+struct ConcurrentWorker
+{
+  ConcurrentWorker(simple_cache::SimpleCache& cache, const std::vector<geometry_msgs::Pose>& poses,
+                   const std::vector<std::vector<double> >& joints, std::size_t num_preloaded,
+                   std::size_t insert_begin, std::size_t insert_end, int num_ops, unsigned int seed) :
+    cache_(cache),
+    poses_(poses),
+    joints_(joints),
+    num_preloaded_(num_preloaded),
+    insert_begin_(insert_begin),
+    insert_end_(insert_end),
+    num_ops_(num_ops),
+    seed_(seed)
+  {
+  }
+
+  void operator()()
+  {
+    std::vector<double> joint_values;
+    std::size_t next_insert = insert_begin_;
+    for (int i = 0; i < num_ops_; ++i)
+    {
+      // rand() is not thread safe
+      const std::size_t r = rand_r(&seed_);
+      if( r % 10 == 0 && next_insert < insert_end_ )
+      {
+        cache_.insert(poses_[next_insert], joints_[next_insert]);
+        ++next_insert;
+      }
+      else
+        cache_.get(poses_[r % num_preloaded_], joints_[0], joint_values);
+    }
+  }
+
+  simple_cache::SimpleCache& cache_;
+  const std::vector<geometry_msgs::Pose>& poses_;
+  const std::vector<std::vector<double> >& joints_;
+  std::size_t num_preloaded_;
+  std::size_t insert_begin_;
+  std::size_t insert_end_;
+  int num_ops_;
+  unsigned int seed_;
+};
+
+/**
+ * @brief Throughput of a shared cache with 90% gets and 10% inserts as the number of threads grows
+ */
+void runConcurrencyBenchmark(int num_tests)
+{
+  static const int MAX_THREADS = 8;
+  const std::size_t num_preloaded = num_tests;
+  const std::size_t inserts_per_thread = num_tests / 10 + 1;
+
+  std::vector<geometry_msgs::Pose> poses(num_preloaded + MAX_THREADS * inserts_per_thread);
+  std::vector<std::vector<double> > joints(poses.size());
+  for (std::size_t i = 0; i < poses.size(); ++i)
+  {
+    simple_cache_test::getRandomPose(poses[i], 1.0, -1.0);
+    simple_cache_test::getRandomJoints(joints[i], 2.7, -2.7);
+  }
+
+  ROS_INFO_STREAM_NAMED("","Concurrency Benchmark -------------------------------------------------------");
+  ROS_INFO_STREAM_NAMED("","hardware threads: " << boost::thread::hardware_concurrency());
+  for (int num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2)
+  {
+    simple_cache::SimpleCache cache(NUM_JOINTS, false, 2.7, -2.7, 1.0, -1.0, simple_cache::FLAT_HASH_STORAGE);
+    cache.setBitPacking();
+    cache.setMaxSolutions(simple_cache::CacheEntry::MAX_SOLUTIONS);
+    for (std::size_t i = 0; i < num_preloaded; ++i)
+      cache.insert(poses[i], joints[i]);
+
+    // Every thread does the same amount of work, so perfect scaling keeps the wall time constant
+    ros::WallTime start_time = ros::WallTime::now();
+    boost::thread_group threads;
+    for (int t = 0; t < num_threads; ++t)
+    {
+      const std::size_t insert_begin = num_preloaded + t * inserts_per_thread;
+      threads.create_thread(ConcurrentWorker(cache, poses, joints, num_preloaded, insert_begin,
+                                             insert_begin + inserts_per_thread, num_tests, t + 1));
+    }
+    threads.join_all();
+    double duration = (ros::WallTime::now() - start_time).toSec();
+
+    ROS_INFO_STREAM_NAMED("",num_threads << " threads: " << double(num_threads) * num_tests / duration * 1e-6
+                          << " Mops/s, " << cache.getSize() << " entries");
+  }
+}
+
+/**
+ * @brief Stand-in for one IK search of a batch, each item only writes to its own slots
+ */
+struct PoolItem
+{
+  PoolItem(std::vector<int>& runs, std::vector<double>& results, int work) :
+    runs_(runs),
+    results_(results),
+    work_(work)
+  {
+  }
+
+  void operator()(std::size_t item, std::size_t worker)
+  {
+    double x = double(item);
+    for (int i = 0; i < work_; ++i)
+      x = sin(x) + 1.0;
+    results_[item] = x;
+    ++runs_[item];
+  }
+
+  std::vector<int>& runs_;
+  std::vector<double>& results_;
+  int work_;
+};
+
+/**
+ * @brief Every item of a parallel loop runs exactly once, and the loop speeds up with the number of workers
+ * @return true if every item ran the expected number of times with every pool size
+ */
+bool runWorkerPoolTest(int num_tests)
+{
+  static const int MAX_WORKERS = 8;
+
+  ROS_INFO_STREAM_NAMED("","Worker Pool Test ------------------------------------------------------------");
+  double single_duration = 0;
+  bool passed = true;
+  for (int num_workers = 1; num_workers <= MAX_WORKERS; num_workers *= 2)
+  {
+    kdlc_kinematics_plugin::WorkerPool pool(num_workers);
+    std::vector<int> runs(num_tests, 0);
+    std::vector<double> results(num_tests, 0.0);
+
+    // Two loops on the same pool, the second one reuses the idle threads
+    ros::WallTime start_time = ros::WallTime::now();
+    pool.parallelFor(num_tests / 2, PoolItem(runs, results, 100));
+    pool.parallelFor(num_tests, PoolItem(runs, results, 100));
+    double duration = (ros::WallTime::now() - start_time).toSec();
+    if( num_workers == 1 )
+      single_duration = duration;
+
+    int num_correct = 0;
+    for (int i = 0; i < num_tests; ++i)
+    {
+      if( runs[i] == (i < num_tests / 2 ? 2 : 1) )
+        ++num_correct;
+    }
+    ROS_INFO_STREAM_NAMED("",num_workers << " workers: " << num_correct << " of " << num_tests
+                          << " items ran the expected number of times, speedup " << single_duration / duration);
+    passed = passed && num_correct == num_tests;
+  }
+  return passed;
+}
+
+/**
+ * @brief Key distributions of the workload suite
+ */
+enum workload_t
+{
+  UNIFORM_WORKLOAD,   // every pose drawn uniformly from the whole workspace
+  CLUSTERED_WORKLOAD, // poses around a few workspace regions, e.g. a table and a shelf
+  ZIPF_WORKLOAD       // repeat traffic, a small set of poses is asked for again and again
+};
+
+static const char* WORKLOAD_NAMES[] = {"uniform", "clustered", "zipf"};
+
+// Ranges of the workload suite
+static const double WORKLOAD_POSE_HI = 1.0;
+static const double WORKLOAD_POSE_LOW = -1.0;
+static const double WORKLOAD_JOINT_HI = 2.7;
+static const double WORKLOAD_JOINT_LOW = -2.7;
+
+/**
+ * @brief Monotonic clock in nanoseconds, fine enough to time single cache operations
+ */
+inline int64_t nowNs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Resident memory of this process in bytes, 0 if it cannot be read
+ */
+std::size_t getResidentMemory()
+{
+  std::ifstream statm("/proc/self/statm");
+  std::size_t total_pages = 0, resident_pages = 0;
+  if( !(statm >> total_pages >> resident_pages) )
+    return 0;
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Durations of one kind of operation, with exact percentiles
+ */
+class OperationTimes
+{
+public:
+
+  void reserve(std::size_t num_ops)
+  {
+    times_.reserve(num_ops);
+  }
+
+  void record(int64_t ns)
+  {
+    times_.push_back(ns);
+  }
+
+  /**
+   * @brief Nearest rank percentile in nanoseconds
+   * @param fraction between 0 and 1, e.g. 0.99
+   */
+  int64_t getPercentile(double fraction)
+  {
+    if( times_.empty() )
+      return 0;
+
+    const std::size_t rank = std::size_t(ceil(fraction * times_.size()));
+    const std::size_t index = std::min(times_.size() - 1, rank > 0 ? rank - 1 : 0);
+    std::nth_element(times_.begin(), times_.begin() + index, times_.end());
+    return times_[index];
+  }
+
+  double getMean() const
+  {
+    double total = 0;
+    for (std::size_t i = 0; i < times_.size(); ++i)
+      total += times_[i];
+    return times_.empty() ? 0.0 : total / times_.size();
+  }
 
-  // Seed random
-  srand(ros::Time::now().toSec());
+  void writeJson(std::ostream& stream)
+  {
+    stream << "{\"count\": " << times_.size() << ", \"mean_ns\": " << getMean() << ", \"p50_ns\": "
+           << getPercentile(0.5) << ", \"p90_ns\": " << getPercentile(0.9) << ", \"p99_ns\": "
+           << getPercentile(0.99) << ", \"max_ns\": " << getPercentile(1.0) << "}";
+  }
+
+  std::string toString()
+  {
+    std::stringstream stream;
+    stream << "p50 " << getPercentile(0.5) << " ns, p99 " << getPercentile(0.99) << " ns, max "
+           << getPercentile(1.0) << " ns";
+    return stream.str();
+  }
+
+private:
+
+  std::vector<int64_t> times_;
+};
+
+/**
+ * @brief Draws workload poses and joint values from its own generator, so a workload only depends on its seed
+ */
+class WorkloadGenerator
+{
+public:
+
+  WorkloadGenerator(uint32_t seed) :
+    generator_(seed),
+    unit_(generator_, boost::uniform_real<double>(0.0, 1.0)),
+    normal_(generator_, boost::normal_distribution<double>(0.0, 1.0))
+  {
+  }
+
+  /**
+   * @brief The poses of num_ops operations and a solution for each
+   */
+  void generate(workload_t workload, std::size_t num_ops, std::vector<geometry_msgs::Pose>& poses,
+                std::vector<std::vector<double> >& joints)
+  {
+    poses.resize(num_ops);
+    joints.resize(num_ops);
+
+    switch( workload )
+    {
+      case UNIFORM_WORKLOAD:
+        for (std::size_t i = 0; i < num_ops; ++i)
+          getUniformPose(poses[i]);
+        break;
+
+      case CLUSTERED_WORKLOAD:
+      {
+        // Positions spread by a few cm and orientations by a few degrees around each region
+        static const std::size_t NUM_CLUSTERS = 8;
+        static const double POSITION_SPREAD = 0.03;
+        static const double ORIENTATION_SPREAD = 0.05;
+        std::vector<geometry_msgs::Pose> centers(NUM_CLUSTERS);
+        for (std::size_t c = 0; c < NUM_CLUSTERS; ++c)
+          getUniformPose(centers[c]);
+        for (std::size_t i = 0; i < num_ops; ++i)
+        {
+          const geometry_msgs::Pose& center = centers[std::size_t(unit_() * NUM_CLUSTERS) % NUM_CLUSTERS];
+          poses[i].position.x = clampPosition(center.position.x + POSITION_SPREAD * normal_());
+          poses[i].position.y = clampPosition(center.position.y + POSITION_SPREAD * normal_());
+          poses[i].position.z = clampPosition(center.position.z + POSITION_SPREAD * normal_());
+          setOrientation(poses[i], center.orientation.x + ORIENTATION_SPREAD * normal_(),
+                         center.orientation.y + ORIENTATION_SPREAD * normal_(),
+                         center.orientation.z + ORIENTATION_SPREAD * normal_(),
+                         center.orientation.w + ORIENTATION_SPREAD * normal_());
+        }
+        break;
+      }
+
+      case ZIPF_WORKLOAD:
+      {
+        // Pose of rank r is drawn with probability proportional to 1 / r
+        const std::size_t num_distinct = std::max<std::size_t>(1, num_ops / 10);
+        std::vector<geometry_msgs::Pose> distinct(num_distinct);
+        std::vector<double> cdf(num_distinct);
+        double total = 0;
+        for (std::size_t r = 0; r < num_distinct; ++r)
+        {
+          getUniformPose(distinct[r]);
+          total += 1.0 / (r + 1);
+          cdf[r] = total;
+        }
+        for (std::size_t i = 0; i < num_ops; ++i)
+        {
+          const std::size_t r = std::upper_bound(cdf.begin(), cdf.end(), unit_() * total) - cdf.begin();
+          poses[i] = distinct[std::min(r, num_distinct - 1)];
+        }
+        break;
+      }
+    }
+
+    for (std::size_t i = 0; i < num_ops; ++i)
+    {
+      joints[i].resize(NUM_JOINTS);
+      for (int j = 0; j < NUM_JOINTS; ++j)
+        joints[i][j] = WORKLOAD_JOINT_LOW + unit_() * (WORKLOAD_JOINT_HI - WORKLOAD_JOINT_LOW);
+    }
+  }
+
+private:
+
+  void getUniformPose(geometry_msgs::Pose& pose)
+  {
+    pose.position.x = WORKLOAD_POSE_LOW + unit_() * (WORKLOAD_POSE_HI - WORKLOAD_POSE_LOW);
+    pose.position.y = WORKLOAD_POSE_LOW + unit_() * (WORKLOAD_POSE_HI - WORKLOAD_POSE_LOW);
+    pose.position.z = WORKLOAD_POSE_LOW + unit_() * (WORKLOAD_POSE_HI - WORKLOAD_POSE_LOW);
+
+    // Normalized gaussian samples are uniform over rotations
+    setOrientation(pose, normal_(), normal_(), normal_(), normal_());
+  }
+
+  static void setOrientation(geometry_msgs::Pose& pose, double x, double y, double z, double w)
+  {
+    const double norm = sqrt(x*x + y*y + z*z + w*w);
+    pose.orientation.x = x / norm;
+    pose.orientation.y = y / norm;
+    pose.orientation.z = z / norm;
+    pose.orientation.w = w / norm;
+  }
+
+  static double clampPosition(double value)
+  {
+    return std::max(WORKLOAD_POSE_LOW, std::min(WORKLOAD_POSE_HI - 1e-9, value));
+  }
+
+  boost::mt19937 generator_;
+  boost::variate_generator<boost::mt19937&, boost::uniform_real<double> > unit_;
+  boost::variate_generator<boost::mt19937&, boost::normal_distribution<double> > normal_;
+};
+
+/**
+ * @brief Insert, get, write and read a workload on every storage engine, timing every operation on its own.
+ *        The same seed gives the same keys on every build, so results can be compared between cache changes.
+ * @param num_ops number of insert and get operations of each workload
+ * @param seed seed of the workload keys
+ * @param workloads which key distributions to run
+ * @param json output, one object per storage engine and workload
+ */
+void runWorkloadSuite(int num_ops, uint32_t seed, const std::vector<workload_t>& workloads, std::ostream& json)
+{
+  static const int FILE_REPEATS = 3;
+
+  const simple_cache::storage_t storages[] = {simple_cache::MAP_STORAGE, simple_cache::FLAT_HASH_STORAGE};
+  const char* storage_names[] = {"map", "flat_hash"};
+  const std::string text_path = cache_location + ".suite.txt";
+  const std::string binary_path = cache_location + ".suite.bin";
+
+  ROS_INFO_STREAM_NAMED("","Workload Suite --------------------------------------------------------------");
+  json << "{\"seed\": " << seed << ", \"operations\": " << num_ops << ", \"runs\": [";
+
+  bool first_run = true;
+  for (std::size_t w = 0; w < workloads.size(); ++w)
+  {
+    // Each workload gets its own stream, so selecting a subset does not change the keys
+    std::vector<geometry_msgs::Pose> poses;
+    std::vector<std::vector<double> > joints;
+    WorkloadGenerator(seed + workloads[w]).generate(workloads[w], num_ops, poses, joints);
+
+    for (std::size_t s = 0; s < 2; ++s)
+    {
+      OperationTimes insert_times, get_times, write_text_times, write_binary_times, read_text_times,
+        read_binary_times;
+      insert_times.reserve(num_ops);
+      get_times.reserve(num_ops);
+
+      simple_cache::SimpleCache cache(NUM_JOINTS, false, WORKLOAD_JOINT_HI, WORKLOAD_JOINT_LOW, WORKLOAD_POSE_HI,
+                                      WORKLOAD_POSE_LOW, storages[s]);
+      cache.setBitPacking();
+
+      for (int i = 0; i < num_ops; ++i)
+      {
+        const int64_t start = nowNs();
+        cache.insert(poses[i], joints[i]);
+        insert_times.record(nowNs() - start);
+      }
+      const std::size_t memory = cache.getMemoryUsage();
+      const std::size_t resident = getResidentMemory();
+
+      int num_found = 0;
+      std::vector<double> joint_values;
+      for (int i = 0; i < num_ops; ++i)
+      {
+        const int64_t start = nowNs();
+        const bool found = cache.get(poses[i], joint_values) == simple_cache::SUCCESS;
+        get_times.record(nowNs() - start);
+        if( found )
+          ++num_found;
+      }
+
+      for (int r = 0; r < FILE_REPEATS; ++r)
+      {
+        int64_t start = nowNs();
+        cache.writeFile(text_path);
+        write_text_times.record(nowNs() - start);
+
+        start = nowNs();
+        cache.writeBinaryFile(binary_path);
+        write_binary_times.record(nowNs() - start);
+
+        simple_cache::SimpleCache text_cache(NUM_JOINTS, false, WORKLOAD_JOINT_HI, WORKLOAD_JOINT_LOW,
+                                             WORKLOAD_POSE_HI, WORKLOAD_POSE_LOW, storages[s]);
+        text_cache.setBitPacking();
+        start = nowNs();
+        text_cache.readFile(text_path);
+        read_text_times.record(nowNs() - start);
+
+        simple_cache::SimpleCache binary_cache(NUM_JOINTS, false, WORKLOAD_JOINT_HI, WORKLOAD_JOINT_LOW,
+                                               WORKLOAD_POSE_HI, WORKLOAD_POSE_LOW, storages[s]);
+        binary_cache.setBitPacking();
+        start = nowNs();
+        binary_cache.readFile(binary_path);
+        read_binary_times.record(nowNs() - start);
+      }
+      remove(text_path.c_str());
+      remove(binary_path.c_str());
+
+      ROS_INFO_STREAM_NAMED("",WORKLOAD_NAMES[workloads[w]] << ", " << storage_names[s] << ": " << cache.getSize()
+                            << " keys, " << num_found << " of " << num_ops << " found, " << memory
+                            << " bytes (" << double(memory) / std::max<std::size_t>(1, cache.getSize())
+                            << " per key), process resident " << resident << " bytes");
+      ROS_INFO_STREAM_NAMED("","  insert " << insert_times.toString());
+      ROS_INFO_STREAM_NAMED("","  get " << get_times.toString());
+      ROS_INFO_STREAM_NAMED("","  writeFile text " << write_text_times.toString() << ", binary "
+                            << write_binary_times.toString());
+      ROS_INFO_STREAM_NAMED("","  readFile text " << read_text_times.toString() << ", binary "
+                            << read_binary_times.toString());
+
+      json << (first_run ? "\n  " : ",\n  ") << "{\"workload\": \"" << WORKLOAD_NAMES[workloads[w]]
+           << "\", \"storage\": \"" << storage_names[s] << "\", \"keys\": " << cache.getSize()
+           << ", \"found\": " << num_found << ", \"memory_bytes\": " << memory << ", \"resident_bytes\": "
+           << resident << ",\n   \"insert\": ";
+      insert_times.writeJson(json);
+      json << ",\n   \"get\": ";
+      get_times.writeJson(json);
+      json << ",\n   \"write_text\": ";
+      write_text_times.writeJson(json);
+      json << ",\n   \"write_binary\": ";
+      write_binary_times.writeJson(json);
+      json << ",\n   \"read_text\": ";
+      read_text_times.writeJson(json);
+      json << ",\n   \"read_binary\": ";
+      read_binary_times.writeJson(json);
+      json << "}";
+      first_run = false;
+    }
+  }
+  json << "\n]}\n";
+}
+
+/**
+ * @brief Log the outcome of a correctness test and remember it if it failed
+ */
+void checkResult(const std::string& name, bool passed, std::vector<std::string>& failed)
+{
+  if( passed )
+    ROS_INFO_STREAM_NAMED("",name << " passed");
+  else
+  {
+    ROS_ERROR_STREAM_NAMED("",name << " failed");
+    failed.push_back(name);
+  }
+}
+
+/**
+ * @brief The correctness tests and benchmarks of the individual cache features
+ * @return false if any correctness test failed, the benchmarks only report
+ */
+bool runAllTests(int num_tests)
+{
+  std::vector<std::string> failed;
 
   // Benchmark time
   ros::Time start_time;
   start_time = ros::Time::now();
   {
     // Run Tests
-    simple_cache_test::runTests(num_tests);
+    runTests(num_tests);
   }
   // Benchmark time
   double duration = (ros::Time::now() - start_time).toNSec() * 1e-6;
   ROS_INFO_STREAM_NAMED("","Total time: " << duration);
   std::cout << duration << "\t" << num_tests << std::endl;
 
-  return 0;
+  // Compare storage engines
+  runStorageBenchmark(num_tests);
+
+  // Near misses
+  runNearestBenchmark(num_tests);
+
+  // Equivalent quaternions
+  checkResult("runPoseKeyingTest", runPoseKeyingTest(num_tests), failed);
+
+  // Several solutions per pose
+  checkResult("runBucketTest", runBucketTest(num_tests), failed);
+
+  // Better solutions replace worse ones
+  checkResult("runQualityTest", runQualityTest(std::min(num_tests, 100000)), failed);
+
+  // Failed poses are retried
+  checkResult("runNoSolutionTest", runNoSolutionTest(std::min(num_tests, 10000)), failed);
+
+  // Startup time
+  runFileBenchmark(num_tests);
+
+  // Bounded memory and files
+  checkResult("runEvictionTest", runEvictionTest(num_tests), failed);
+
+  // Live stats
+  checkResult("runMetricsTest", runMetricsTest(std::min(num_tests, 10000)), failed);
+
+  // Shared between planning threads
+  runConcurrencyBenchmark(num_tests);
+
+  // Batches of IK searches
+  checkResult("runWorkerPoolTest", runWorkerPoolTest(std::min(num_tests, 100000)), failed);
+
+  for (std::size_t i = 0; i < failed.size(); ++i)
+    ROS_ERROR_STREAM_NAMED("","FAILED: " << failed[i]);
+  return failed.empty();
 }
 
+void printUsage(const char* program)
+{
+  std::cout << "Usage: " << program << " [options]\n"
+            << "Options:\n"
+            << "  --tests N        operations of every test and workload, default 1000000\n"
+            << "  --seed S         seed of all random data, default 1\n"
+            << "  --workload W     uniform, clustered, zipf or all, default all\n"
+            << "  --suite-only     only run the workload suite\n"
+            << "  --cache-dir DIR  directory of the test files, default a new temporary directory\n"
+            << "  --output FILE    write the workload suite results as JSON\n";
+}
+
+} // end namespace
+
+int main(int argc, char *argv[])
+{
+  int num_tests = 1000000;
+  //int num_tests = 10;
+  uint32_t seed = 1;
+  bool suite_only = false;
+  std::string cache_dir;
+  std::string output;
+  std::vector<simple_cache_test::workload_t> workloads;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if( strcmp(argv[i], "--tests") == 0 && i + 1 < argc )
+    {
+      num_tests = std::max(1, atoi(argv[++i]));
+    }
+    else if( strcmp(argv[i], "--seed") == 0 && i + 1 < argc )
+    {
+      seed = strtoul(argv[++i], NULL, 10);
+    }
+    else if( strcmp(argv[i], "--workload") == 0 && i + 1 < argc )
+    {
+      const std::string name = argv[++i];
+      for (int w = simple_cache_test::UNIFORM_WORKLOAD; w <= simple_cache_test::ZIPF_WORKLOAD; ++w)
+      {
+        if( name == "all" || name == simple_cache_test::WORKLOAD_NAMES[w] )
+          workloads.push_back(simple_cache_test::workload_t(w));
+      }
+      if( workloads.empty() )
+      {
+        simple_cache_test::printUsage(argv[0]);
+        return 1;
+      }
+    }
+    else if( strcmp(argv[i], "--suite-only") == 0 )
+    {
+      suite_only = true;
+    }
+    else if( strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc )
+    {
+      cache_dir = argv[++i];
+    }
+    else if( strcmp(argv[i], "--output") == 0 && i + 1 < argc )
+    {
+      output = argv[++i];
+    }
+    else
+    {
+      simple_cache_test::printUsage(argv[0]);
+      return 1;
+    }
+  }
+  if( workloads.empty() )
+  {
+    for (int w = simple_cache_test::UNIFORM_WORKLOAD; w <= simple_cache_test::ZIPF_WORKLOAD; ++w)
+      workloads.push_back(simple_cache_test::workload_t(w));
+  }
+
+  // Test files go to a fresh temporary directory that is removed at the end
+  bool remove_cache_dir = false;
+  if( cache_dir.empty() )
+  {
+    char temp_dir[] = "/tmp/simple_cache_test_XXXXXX";
+    if( !mkdtemp(temp_dir) )
+    {
+      ROS_ERROR_STREAM_NAMED("","Could not create a temporary directory");
+      return 1;
+    }
+    cache_dir = temp_dir;
+    remove_cache_dir = true;
+  }
+  simple_cache_test::cache_location = cache_dir + "/kdlc_test_cache.dat";
+
+  // initialize ros time without using node handle
+  ros::Time::init();
+
+  // Fixed seed, so every run uses the same data
+  srand(seed);
+
+  // Parameterized workloads on every storage engine
+  std::stringstream json;
+  simple_cache_test::runWorkloadSuite(num_tests, seed, workloads, json);
+  if( !output.empty() )
+  {
+    std::ofstream file(output.c_str());
+    file << json.str();
+    if( !file )
+      ROS_ERROR_STREAM_NAMED("","Could not write " << output);
+  }
+
+  bool passed = true;
+  if( !suite_only )
+    passed = simple_cache_test::runAllTests(num_tests);
+
+  if( remove_cache_dir )
+    boost::filesystem::remove_all(cache_dir);
+  return passed ? 0 : 1;
+}